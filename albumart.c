@@ -523,10 +523,10 @@ find_album_art(const char *path, uint8_t *image_data, int image_size)
 	if (album_art == NULL) return 0;
 
 
-	int64_t ret = sql_get_int_field(db, "SELECT ID from ALBUM_ART where PATH = '%q'", album_art);
+	int64_t ret = sql_get_int64_param(db, "SELECT ID from ALBUM_ART where PATH = ?", "t", album_art);
 	if (ret == 0)
 	{
-		if (sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK)
+		if (sql_exec_param(db, "INSERT into ALBUM_ART (PATH) VALUES (?)", "t", album_art) == SQLITE_OK)
 		{
 			ret = sqlite3_last_insert_rowid(db);
 		}
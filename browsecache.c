@@ -0,0 +1,233 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "browsecache.h"
+#include "upnpglobalvars.h"
+#include "sql.h"
+#include "utils.h"
+#include "log.h"
+
+#define BROWSECACHE_BUCKETS	256
+
+/*
+ * Control points browse the same few containers over and over (every
+ * time the menu opens, on every back-navigation), so finished Browse
+ * response bodies are kept by request.  The key spells out everything
+ * the body depends on; the caller builds it.
+ *
+ * Anything written to the database can change any response, so rather
+ * than tracking which containers a change touches, the whole cache is
+ * dropped whenever SystemUpdateID or the connection's change count
+ * moves.  Only the main loop browses, so there is no lock.
+ */
+struct browse_entry {
+	char			*key;
+	char			*data;
+	int			 len;
+	int			 size;		/* what it counts against the budget */
+	LIST_ENTRY(browse_entry) hash;
+	TAILQ_ENTRY(browse_entry) lru;
+};
+
+static LIST_HEAD(, browse_entry) buckets[BROWSECACHE_BUCKETS];
+static TAILQ_HEAD(browse_lru, browse_entry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static int nentries;
+static int nbytes;
+static unsigned int hits, misses;
+
+/* Paging cursors, a handful of them, replaced in round robin */
+static struct {
+	char			*key;
+	struct browse_cursor	 cursor;
+} cursors[BROWSE_CURSORS];
+static int next_cursor;
+static unsigned int cursor_hits;
+static uint32_t cached_update;
+static int cached_changes;
+
+#define BUCKET(key) (&buckets[DJBHash((const uint8_t *)(key), strlen(key)) % BROWSECACHE_BUCKETS])
+
+static void
+browsecache_remove(struct browse_entry *e)
+{
+	LIST_REMOVE(e, hash);
+	TAILQ_REMOVE(&lru, e, lru);
+	nbytes -= e->size;
+	nentries--;
+	free(e->key);
+	free(e->data);
+	free(e);
+}
+
+/* Drop everything if the database has changed since it was cached */
+static void
+browsecache_check(void)
+{
+	int changes = sql_changes(db);
+
+	if (cached_update == updateID && cached_changes == changes)
+		return;
+	if (nentries)
+		DPRINTF(E_DEBUG, L_HTTP, "browsecache: database changed, dropping %d entries\n", nentries);
+	browsecache_flush();
+	cached_update = updateID;
+	cached_changes = changes;
+}
+
+const char *
+browsecache_get(const char *key, int *len)
+{
+	struct browse_entry *e;
+
+	browsecache_check();
+	LIST_FOREACH(e, BUCKET(key), hash)
+	{
+		if (strcmp(e->key, key) != 0)
+			continue;
+		TAILQ_REMOVE(&lru, e, lru);
+		TAILQ_INSERT_HEAD(&lru, e, lru);
+		hits++;
+		*len = e->len;
+		return e->data;
+	}
+	misses++;
+
+	return NULL;
+}
+
+void
+browsecache_put(const char *key, const char *data, int len)
+{
+	struct browse_entry *e;
+	int size;
+
+	browsecache_check();
+	size = sizeof(struct browse_entry) + strlen(key) + 1 + len;
+	/* One huge listing shouldn't push out everything else */
+	if (size > BROWSECACHE_BYTES / 4)
+		return;
+
+	e = calloc(1, sizeof(struct browse_entry));
+	if (!e || !(e->key = strdup(key)) || !(e->data = malloc(len)))
+	{
+		DPRINTF(E_ERROR, L_HTTP, "browsecache: out of memory\n");
+		if (e)
+			free(e->key);
+		free(e);
+		return;
+	}
+	memcpy(e->data, data, len);
+	e->len = len;
+	e->size = size;
+
+	while (nbytes + size > BROWSECACHE_BYTES)
+		browsecache_remove(TAILQ_LAST(&lru, browse_lru));
+	LIST_INSERT_HEAD(BUCKET(key), e, hash);
+	TAILQ_INSERT_HEAD(&lru, e, lru);
+	nbytes += size;
+	nentries++;
+}
+
+void
+browsecache_flush(void)
+{
+	int i;
+
+	while (!TAILQ_EMPTY(&lru))
+		browsecache_remove(TAILQ_FIRST(&lru));
+	for (i = 0; i < BROWSE_CURSORS; i++)
+	{
+		free(cursors[i].key);
+		cursors[i].key = NULL;
+		browsecache_cursor_free(&cursors[i].cursor);
+	}
+}
+
+const struct browse_cursor *
+browsecache_cursor_get(const char *key, int start)
+{
+	int i;
+
+	browsecache_check();
+	for (i = 0; i < BROWSE_CURSORS; i++)
+	{
+		if (cursors[i].key && cursors[i].cursor.next == start &&
+		    strcmp(cursors[i].key, key) == 0)
+		{
+			cursor_hits++;
+			return &cursors[i].cursor;
+		}
+	}
+
+	return NULL;
+}
+
+void
+browsecache_cursor_put(const char *key, struct browse_cursor *cursor)
+{
+	char *copy;
+	int i;
+
+	browsecache_check();
+	copy = strdup(key);
+	if (!copy)
+	{
+		browsecache_cursor_free(cursor);
+		return;
+	}
+	/* Each client paging through a container needs only its latest */
+	for (i = 0; i < BROWSE_CURSORS; i++)
+		if (cursors[i].key && strcmp(cursors[i].key, key) == 0)
+			break;
+	if (i == BROWSE_CURSORS)
+	{
+		i = next_cursor;
+		next_cursor = (next_cursor + 1) % BROWSE_CURSORS;
+	}
+	free(cursors[i].key);
+	browsecache_cursor_free(&cursors[i].cursor);
+	cursors[i].key = copy;
+	cursors[i].cursor = *cursor;
+	memset(cursor, 0, sizeof(*cursor));
+}
+
+void
+browsecache_cursor_free(struct browse_cursor *cursor)
+{
+	int i;
+
+	for (i = 0; i < cursor->nkeys; i++)
+		free(cursor->key[i].text);
+	memset(cursor, 0, sizeof(*cursor));
+}
+
+void
+browsecache_stats(struct browsecache_stat *stat)
+{
+	stat->hits = hits;
+	stat->misses = misses;
+	stat->entries = nentries;
+	stat->bytes = nbytes;
+	stat->cursor_hits = cursor_hits;
+}
@@ -0,0 +1,80 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BROWSECACHE_H__
+#define __BROWSECACHE_H__
+
+#include <stdint.h>
+
+#define BROWSECACHE_BYTES	(4 * 1024 * 1024)
+#define BROWSE_CURSORS		16
+#define BROWSE_CURSOR_KEYS	8	/* sort keys, the last one o.ID */
+
+/* One sort key value of the last row of a page */
+struct browse_key {
+	int		 type;		/* SQLITE_INTEGER, _FLOAT, _TEXT or _NULL */
+	int64_t		 i;
+	double		 f;
+	char		*text;
+};
+
+/* Where a page of a sorted Browse ended, so the next page can carry on
+ * from there instead of skipping StartingIndex rows again. */
+struct browse_cursor {
+	int		 next;		/* the StartingIndex it continues at */
+	int		 rows;		/* rows read into this page so far */
+	int		 nkeys;
+	struct browse_key key[BROWSE_CURSOR_KEYS];
+};
+
+struct browsecache_stat {
+	unsigned int hits;
+	unsigned int misses;
+	int entries;
+	int bytes;
+	unsigned int cursor_hits;
+};
+
+/* browsecache_get()
+ * look up the response body cached under key.  The returned data is
+ * good until the next browsecache_put() or flush. */
+const char *browsecache_get(const char *key, int *len);
+
+/* browsecache_put()
+ * remember a response body under key, dropping the least recently
+ * used entries to stay within BROWSECACHE_BYTES. */
+void browsecache_put(const char *key, const char *data, int len);
+
+/* browsecache_flush()
+ * forget everything */
+void browsecache_flush(void);
+
+void browsecache_stats(struct browsecache_stat *stat);
+
+/* browsecache_cursor_get()
+ * find the cursor remembered under key, if it continues at start.
+ * Dropped along with the cached responses when the database changes. */
+const struct browse_cursor *browsecache_cursor_get(const char *key, int start);
+
+/* browsecache_cursor_put()
+ * remember cursor under key, taking over its key values */
+void browsecache_cursor_put(const char *key, struct browse_cursor *cursor);
+
+/* browsecache_cursor_free()
+ * release the key values of a cursor that wasn't handed over */
+void browsecache_cursor_free(struct browse_cursor *cursor);
+
+#endif
@@ -0,0 +1,302 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "dbwriter.h"
+#include "upnpglobalvars.h"
+#include "utils.h"
+#include "sql.h"
+#include "log.h"
+
+#define DBWRITER_LATENCY_MS	50	/* longest a write waits for its commit */
+#define DBWRITER_BATCH		256	/* commit without waiting once this many */
+
+/*
+ * The few writes that come in with requests (bookmarks, play counts,
+ * image rotation) are handed to a thread of their own, so the main
+ * loop never sits in the busy timeout while the scanner or inotify
+ * holds the write lock.  Requests push onto a lock-free stack; the
+ * writer takes the whole stack at once, puts it back in order and
+ * applies it together with anything else arriving within
+ * DBWRITER_LATENCY_MS, in one transaction.
+ */
+enum dbw_type {
+	DBW_BOOKMARK,
+	DBW_WATCH_COUNT,
+	DBW_ROTATION
+};
+
+struct dbw_cmd {
+	struct dbw_cmd	*next;
+	enum dbw_type	 type;
+	int64_t		 id;
+	int		 value;		/* SEC or ROTATION */
+	char		 old[32];	/* the value it must still have, if set */
+	char		 new[32];	/* WATCH_COUNT, or empty to add one */
+};
+
+static struct dbw_cmd *queue;
+static sem_t wake;
+static pthread_t writer;
+static int running;
+static int stopping;
+
+static int
+dbw_apply(struct dbw_cmd *c)
+{
+	int ret = SQLITE_OK;
+
+	switch (c->type)
+	{
+	case DBW_BOOKMARK:
+		ret = sql_exec_param(db, "INSERT OR IGNORE into BOOKMARKS (ID, SEC) VALUES (?, ?)",
+		                     "Ii", c->id, c->value);
+		if (c->old[0])
+			ret = sql_exec_param(db, "UPDATE BOOKMARKS set SEC = ? where SEC = ? and ID = ?",
+			                     "itI", c->value, c->old, c->id);
+		else
+			ret = sql_exec_param(db, "UPDATE BOOKMARKS set SEC = ? where ID = ?",
+			                     "iI", c->value, c->id);
+		break;
+	case DBW_WATCH_COUNT:
+		ret = sql_exec_param(db, "INSERT or IGNORE into BOOKMARKS (ID, WATCH_COUNT) VALUES (?, ?)",
+		                     "It", c->id, c->new[0] ? c->new : "1");
+		/* A new row already has the count */
+		if (ret != SQLITE_OK || sqlite3_changes(db))
+			break;
+		if (!c->new[0])
+			ret = sql_exec_param(db, "UPDATE BOOKMARKS set WATCH_COUNT ="
+			                         " ifnull(WATCH_COUNT,'0') + 1 where ID = ?",
+			                     "I", c->id);
+		else if (c->old[0])
+			ret = sql_exec_param(db, "UPDATE BOOKMARKS set WATCH_COUNT = ?"
+			                         " where WATCH_COUNT = ? and ID = ?",
+			                     "ttI", c->new, c->old, c->id);
+		else
+			ret = sql_exec_param(db, "UPDATE BOOKMARKS set WATCH_COUNT = ? where ID = ?",
+			                     "tI", c->new, c->id);
+		break;
+	case DBW_ROTATION:
+		ret = sql_exec_param(db, "UPDATE DETAILS set ROTATION = ? where ID = ?",
+		                     "iI", c->value, c->id);
+		break;
+	}
+	if (ret != SQLITE_OK)
+		DPRINTF(E_WARN, L_DB_SQL, "dbwriter: write %d for %lld failed\n",
+		        c->type, (long long)c->id);
+
+	return ret;
+}
+
+/* Everything queued so far, oldest first */
+static struct dbw_cmd *
+dbw_take(void)
+{
+	struct dbw_cmd *c, *next, *list = NULL;
+
+	c = __atomic_exchange_n(&queue, NULL, __ATOMIC_ACQUIRE);
+	for (; c; c = next)
+	{
+		next = c->next;
+		c->next = list;
+		list = c;
+	}
+
+	return list;
+}
+
+static void
+dbw_batch(struct dbw_cmd *list)
+{
+	struct dbw_cmd *next;
+	struct timespec deadline;
+	int n = 0, txn;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += DBWRITER_LATENCY_MS * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	/* Without a transaction each write commits on its own */
+	txn = (sql_begin(db) == SQLITE_OK);
+	for (;;)
+	{
+		for (; list; list = next)
+		{
+			next = list->next;
+			dbw_apply(list);
+			free(list);
+			n++;
+		}
+		if (n >= DBWRITER_BATCH || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+			break;
+		if (sem_timedwait(&wake, &deadline) != 0 && errno == ETIMEDOUT)
+			break;
+		list = dbw_take();
+	}
+	if (!txn)
+		DPRINTF(E_MAXDEBUG, L_DB_SQL, "dbwriter: made %d writes\n", n);
+	else if (sql_exec(db, "COMMIT") != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "dbwriter: lost %d writes\n", n);
+		sql_exec(db, "ROLLBACK");
+	}
+	else
+		DPRINTF(E_MAXDEBUG, L_DB_SQL, "dbwriter: committed %d writes\n", n);
+}
+
+static void *
+dbwriter_thread(void *arg)
+{
+	struct dbw_cmd *list;
+
+	open_db(NULL);
+	for (;;)
+	{
+		list = dbw_take();
+		if (list)
+		{
+			dbw_batch(list);
+			continue;
+		}
+		if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+			break;
+		while (sem_wait(&wake) != 0 && errno == EINTR)
+			continue;
+	}
+	sql_close(db);
+
+	return NULL;
+}
+
+static int
+dbw_push(struct dbw_cmd *c)
+{
+	struct dbw_cmd *head;
+	int ret;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+	{
+		ret = dbw_apply(c);
+		free(c);
+		return ret == SQLITE_OK ? 0 : -1;
+	}
+	head = __atomic_load_n(&queue, __ATOMIC_RELAXED);
+	do {
+		c->next = head;
+	} while (!__atomic_compare_exchange_n(&queue, &head, c, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* The writer only sleeps on an empty queue */
+	if (!head)
+		sem_post(&wake);
+
+	return 0;
+}
+
+static struct dbw_cmd *
+dbw_new(enum dbw_type type, int64_t id, int value, const char *old, const char *new)
+{
+	struct dbw_cmd *c;
+
+	c = calloc(1, sizeof(struct dbw_cmd));
+	if (!c)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "dbwriter: out of memory\n");
+		return NULL;
+	}
+	c->type = type;
+	c->id = id;
+	c->value = value;
+	if (old)
+		strncpyt(c->old, old, sizeof(c->old));
+	if (new)
+		strncpyt(c->new, new, sizeof(c->new));
+
+	return c;
+}
+
+int
+dbwriter_bookmark(int64_t detailID, int sec, const char *current)
+{
+	struct dbw_cmd *c = dbw_new(DBW_BOOKMARK, detailID, sec, current, NULL);
+
+	return c ? dbw_push(c) : -1;
+}
+
+int
+dbwriter_watch_count(int64_t detailID, const char *current, const char *new)
+{
+	struct dbw_cmd *c = dbw_new(DBW_WATCH_COUNT, detailID, 0, current, new);
+
+	return c ? dbw_push(c) : -1;
+}
+
+int
+dbwriter_rotation(int64_t detailID, int rotation)
+{
+	struct dbw_cmd *c = dbw_new(DBW_ROTATION, detailID, rotation, NULL, NULL);
+
+	return c ? dbw_push(c) : -1;
+}
+
+int
+dbwriter_start(void)
+{
+	sigset_t set, oset;
+	int ret;
+
+	if (sem_init(&wake, 0, 0) != 0)
+		return -1;
+	/* Signals are for the main loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	ret = pthread_create(&writer, NULL, dbwriter_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (ret != 0)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "dbwriter: failed to start thread\n");
+		sem_destroy(&wake);
+		return -1;
+	}
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void
+dbwriter_stop(void)
+{
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&wake);
+	pthread_join(writer, NULL);
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	sem_destroy(&wake);
+}
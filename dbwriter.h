@@ -0,0 +1,48 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DBWRITER_H__
+#define __DBWRITER_H__
+
+#include <stdint.h>
+
+/* dbwriter_start()
+ * start the thread that applies the queued writes below.  Until it
+ * runs (or if it can't), they are made directly on the caller's db. */
+int dbwriter_start(void);
+
+/* dbwriter_stop()
+ * commit whatever is still queued and stop the thread */
+void dbwriter_stop(void);
+
+/* The writes themselves.  They return 0 once the write is queued, or
+ * -1 if it couldn't be; how it went is only logged. */
+
+/* dbwriter_bookmark()
+ * set the resume position of detailID to sec, but only if it is still
+ * current (NULL for whatever it is) */
+int dbwriter_bookmark(int64_t detailID, int sec, const char *current);
+
+/* dbwriter_watch_count()
+ * set the play count of detailID to new if it is still current (NULL
+ * or "" for whatever it is), or add one to it if new is NULL */
+int dbwriter_watch_count(int64_t detailID, const char *current, const char *new);
+
+/* dbwriter_rotation()
+ * remember how an image should be rotated */
+int dbwriter_rotation(int64_t detailID, int rotation);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2017 Gleb Smirnoff <glebius@FreeBSD.org>
+ * Copyright (c) 2002-2017 Igor Sysoev
+ * Copyright (c) 2011-2017 Nginx, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+
+static event_module_init_t epoll_init;
+static event_module_fini_t epoll_fini;
+static event_module_add_t epoll_add;
+static event_module_del_t epoll_del;
+static event_module_process_t epoll_process;
+
+static int ep = -1;
+static struct epoll_event *event_list;
+
+#define	MAXEVENTS	128
+
+struct event_module event_module = {
+	.add =		epoll_add,
+	.del =		epoll_del,
+	.process =	epoll_process,
+	.init =		epoll_init,
+	.fini =		epoll_fini,
+};
+
+static int
+epoll_init(void)
+{
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep == -1)
+		return (errno);
+
+	event_list = calloc(MAXEVENTS, sizeof(struct epoll_event));
+	if (event_list == NULL)
+		return (ENOMEM);
+
+	return (0);
+}
+
+static void
+epoll_fini(void)
+{
+
+	(void )close(ep);
+	ep = -1;
+
+	free(event_list);
+	event_list = NULL;
+}
+
+static int
+epoll_add(struct event *ev)
+{
+	struct epoll_event ee;
+
+	assert(ev->fd >= 0);
+
+	memset(&ee, 0, sizeof(ee));
+	switch (ev->rdwr) {
+	case EVENT_READ:
+		ee.events = EPOLLIN | EPOLLRDHUP;
+		break;
+	case EVENT_WRITE:
+		ee.events = EPOLLOUT;
+		break;
+	}
+	if (ev->flags & EV_FLAG_EDGE)
+		ee.events |= EPOLLET;
+	ee.data.ptr = ev;
+
+	DPRINTF(E_DEBUG, L_GENERAL, "epoll_add %d\n", ev->fd);
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, ev->fd, &ee) == -1) {
+		/* Direction change on a descriptor we already watch. */
+		if (errno != EEXIST ||
+		    epoll_ctl(ep, EPOLL_CTL_MOD, ev->fd, &ee) == -1) {
+			DPRINTF(E_ERROR, L_GENERAL, "epoll_ctl(ADD, %d): %s\n",
+			    ev->fd, strerror(errno));
+			return (errno);
+		}
+	}
+	ev->index = 0;
+
+	return (0);
+}
+
+static int
+epoll_del(struct event *ev, int flags)
+{
+
+	assert(ev->fd >= 0);
+
+	if (ev->index == -1)
+		return (0);
+	ev->index = -1;
+
+	/*
+	 * Unlike kqueue, epoll tracks the open file description rather
+	 * than the descriptor: closing our fd does not remove the
+	 * registration while a forked child still holds the socket.  We
+	 * would then get events for a freed struct event, so always
+	 * delete explicitly, even if the caller is about to close.
+	 */
+	DPRINTF(E_DEBUG, L_GENERAL, "epoll_del %d\n", ev->fd);
+	if (epoll_ctl(ep, EPOLL_CTL_DEL, ev->fd, NULL) == -1 &&
+	    !(flags & EV_FLAG_CLOSING)) {
+		DPRINTF(E_ERROR, L_GENERAL, "epoll_ctl(DEL, %d): %s\n",
+		    ev->fd, strerror(errno));
+		return (errno);
+	}
+
+	return (0);
+}
+
+static int
+epoll_process(u_long msec)
+{
+	struct event *ev;
+	int events, i;
+
+	events = epoll_wait(ep, event_list, MAXEVENTS, (int) msec);
+
+	if (events == -1) {
+		if (errno == EINTR)
+			return (errno);
+		DPRINTF(E_FATAL, L_GENERAL, "epoll_wait(): %s. EXITING\n",
+		    strerror(errno));
+	}
+
+	for (i = 0; i < events; i++) {
+		ev = (struct event *)event_list[i].data.ptr;
+		/*
+		 * A handler may have deleted an event which is still
+		 * further down the list; don't call into it.
+		 */
+		if (ev->index == -1)
+			continue;
+		/*
+		 * Errors and hangups are reported regardless of the
+		 * requested direction; let the handler find out via
+		 * its next read or write.
+		 */
+		ev->process(ev);
+	}
+
+	return (0);
+}
@@ -19,6 +19,12 @@ typedef enum {
 } event_t;
 
 #define	EV_FLAG_CLOSING	0x00000001
+/*
+ * Passed in struct event flags: ask the module for edge-triggered
+ * notification.  The handler must then drain the descriptor until
+ * EAGAIN.  Modules that can't do that (select) just ignore it.
+ */
+#define	EV_FLAG_EDGE	0x00000002
 
 typedef	void	event_process_t(struct event *);
 #ifdef HAVE_KQUEUE
@@ -29,6 +35,7 @@ struct event {
 	int		 fd;
 	int		 index;
 	event_t		 rdwr;
+	int		 flags;
 	union {
 		event_process_t		*process;
 #ifdef HAVE_KQUEUE
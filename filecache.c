@@ -0,0 +1,273 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "config.h"
+#include "filecache.h"
+#include "log.h"
+
+#define FILECACHE_BUCKETS	256
+
+/*
+ * Media requests come in bursts for the same few files (range probes,
+ * seeks, several TVs playing the same thing), so the DETAILS lookup
+ * for each (detail ID, client type) is kept in a small LRU.  Entries
+ * are hashed by ID alone, so invalidating a row finds every client's
+ * variant in one bucket.  The inotify thread invalidates while the
+ * main loop serves, hence the lock.
+ *
+ * Separately, the outcome of _open_file() -- realpath(), the media_dirs
+ * check and the open() -- is kept per path as an open descriptor (or
+ * the refusal), handed out as dup()s.  A stat() of the path has to
+ * match on every hit, so a replaced or re-linked file is checked again
+ * even where inotify doesn't see it (the art cache, no inotify).
+ */
+struct file_entry {
+	int64_t			 id;
+	enum client_types	 client;
+	char			 mime[32];
+	char			 dlna[96];
+	int			 captions;
+	int			 seek;
+	uint32_t		 bitrate;
+	char			*path;
+	LIST_ENTRY(file_entry)	 hash;
+	TAILQ_ENTRY(file_entry)	 lru;
+};
+
+static LIST_HEAD(, file_entry) buckets[FILECACHE_BUCKETS];
+static TAILQ_HEAD(file_lru, file_entry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static int nentries;
+
+struct fd_entry {
+	char			*path;
+	int			 fd;		/* -1 if refused */
+	dev_t			 dev;
+	ino_t			 ino;
+	off_t			 size;
+	time_t			 mtime;
+	TAILQ_ENTRY(fd_entry)	 lru;
+};
+
+static TAILQ_HEAD(fd_lru, fd_entry) fds = TAILQ_HEAD_INITIALIZER(fds);
+static int nfds;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define BUCKET(id) (&buckets[(uint64_t)(id) % FILECACHE_BUCKETS])
+
+static void
+filecache_remove(struct file_entry *e)
+{
+	LIST_REMOVE(e, hash);
+	TAILQ_REMOVE(&lru, e, lru);
+	free(e->path);
+	free(e);
+	nentries--;
+}
+
+int
+filecache_get(int64_t id, enum client_types client, struct file_info *info)
+{
+	struct file_entry *e;
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(e, BUCKET(id), hash)
+	{
+		if (e->id != id || e->client != client)
+			continue;
+		TAILQ_REMOVE(&lru, e, lru);
+		TAILQ_INSERT_HEAD(&lru, e, lru);
+		strncpy(info->path, e->path, sizeof(info->path));
+		info->path[sizeof(info->path)-1] = '\0';
+		memcpy(info->mime, e->mime, sizeof(info->mime));
+		memcpy(info->dlna, e->dlna, sizeof(info->dlna));
+		info->captions = e->captions;
+		info->seek = e->seek;
+		info->bitrate = e->bitrate;
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return -1;
+}
+
+void
+filecache_put(int64_t id, enum client_types client, const struct file_info *info)
+{
+	struct file_entry *e, *old;
+
+	e = calloc(1, sizeof(struct file_entry));
+	if (!e || !(e->path = strdup(info->path)))
+	{
+		DPRINTF(E_ERROR, L_HTTP, "filecache: out of memory\n");
+		free(e);
+		return;
+	}
+	e->id = id;
+	e->client = client;
+	memcpy(e->mime, info->mime, sizeof(e->mime));
+	memcpy(e->dlna, info->dlna, sizeof(e->dlna));
+	e->captions = info->captions;
+	e->seek = info->seek;
+	e->bitrate = info->bitrate;
+
+	pthread_mutex_lock(&lock);
+	LIST_FOREACH(old, BUCKET(id), hash)
+	{
+		if (old->id == id && old->client == client)
+		{
+			filecache_remove(old);
+			break;
+		}
+	}
+	while (nentries >= FILECACHE_ENTRIES)
+		filecache_remove(TAILQ_LAST(&lru, file_lru));
+	LIST_INSERT_HEAD(BUCKET(id), e, hash);
+	TAILQ_INSERT_HEAD(&lru, e, lru);
+	nentries++;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+filecache_invalidate(int64_t id)
+{
+	struct file_entry *e, *next;
+
+	pthread_mutex_lock(&lock);
+	for (e = LIST_FIRST(BUCKET(id)); e; e = next)
+	{
+		next = LIST_NEXT(e, hash);
+		if (e->id == id)
+			filecache_remove(e);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void
+filecache_flush(void)
+{
+	pthread_mutex_lock(&lock);
+	while (!TAILQ_EMPTY(&lru))
+		filecache_remove(TAILQ_FIRST(&lru));
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+filecache_close_entry(struct fd_entry *e)
+{
+	TAILQ_REMOVE(&fds, e, lru);
+	if (e->fd >= 0)
+		close(e->fd);
+	free(e->path);
+	free(e);
+	nfds--;
+}
+
+int
+filecache_open(const char *path, off_t *size)
+{
+	struct fd_entry *e;
+	struct stat st;
+	int fd = -1;
+
+	if (stat(path, &st) != 0)
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(e, &fds, lru)
+	{
+		if (strcmp(e->path, path) != 0)
+			continue;
+		if (e->dev != st.st_dev || e->ino != st.st_ino ||
+		    e->size != st.st_size || e->mtime != st.st_mtime)
+		{
+			filecache_close_entry(e);
+			break;
+		}
+		TAILQ_REMOVE(&fds, e, lru);
+		TAILQ_INSERT_HEAD(&fds, e, lru);
+		if (e->fd < 0)
+			fd = -403;
+		else if ((fd = dup(e->fd)) >= 0)
+			*size = e->size;
+		break;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return fd;
+}
+
+void
+filecache_add(const char *path, int fd, const struct stat *st)
+{
+	struct fd_entry *e, *old;
+
+	e = calloc(1, sizeof(struct fd_entry));
+	if (!e || !(e->path = strdup(path)))
+	{
+		free(e);
+		return;
+	}
+	e->fd = -1;
+	if (fd >= 0 && (e->fd = dup(fd)) < 0)
+	{
+		free(e->path);
+		free(e);
+		return;
+	}
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(old, &fds, lru)
+	{
+		if (strcmp(old->path, path) == 0)
+		{
+			filecache_close_entry(old);
+			break;
+		}
+	}
+	while (nfds >= FILECACHE_FDS)
+		filecache_close_entry(TAILQ_LAST(&fds, fd_lru));
+	TAILQ_INSERT_HEAD(&fds, e, lru);
+	nfds++;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+filecache_close(const char *path)
+{
+	struct fd_entry *e, *next;
+	size_t len = strlen(path);
+
+	pthread_mutex_lock(&lock);
+	for (e = TAILQ_FIRST(&fds); e; e = next)
+	{
+		next = TAILQ_NEXT(e, lru);
+		if (strncmp(e->path, path, len) == 0 &&
+		    (e->path[len] == '\0' || e->path[len] == '/'))
+			filecache_close_entry(e);
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,71 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "clients.h"
+
+#define FILECACHE_ENTRIES	512
+#define FILECACHE_FDS		64
+
+/* What SendResp_dlnafile() needs to know about a DETAILS row, with
+ * the MIME type already adjusted for the client.  The file size is not
+ * here: filecache_open() has it from the stat() it makes on every hit,
+ * which also catches a file that has grown since it was scanned. */
+struct file_info {
+	char path[PATH_MAX];
+	char mime[32];
+	char dlna[96];		/* "DLNA.ORG_PN=...;" or empty */
+	int captions;		/* a CAPTIONS row exists */
+	int seek;		/* a SEEK_INDEX row exists */
+	uint32_t bitrate;	/* bytes per second, 0 if unknown */
+};
+
+/* filecache_get()
+ * copy the entry for (id, client) into info.  Returns 0 on a hit. */
+int filecache_get(int64_t id, enum client_types client, struct file_info *info);
+
+/* filecache_put()
+ * remember info for (id, client), dropping the least recently used
+ * entry when the cache is full. */
+void filecache_put(int64_t id, enum client_types client, const struct file_info *info);
+
+/* filecache_invalidate() / filecache_flush()
+ * forget one DETAILS row for every client, or everything. */
+void filecache_invalidate(int64_t id);
+void filecache_flush(void);
+
+/* filecache_open()
+ * look up a path _open_file() has checked before.  Returns a new
+ * descriptor for the caller to close, -403 if the path was refused,
+ * or -1 if it needs checking (again). */
+int filecache_open(const char *path, off_t *size);
+
+/* filecache_add()
+ * remember the outcome of checking path: an open fd (the cache keeps
+ * its own duplicate) or -403.  st describes what path points to. */
+void filecache_add(const char *path, int fd, const struct stat *st);
+
+/* filecache_close()
+ * forget path and everything below it */
+void filecache_close(const char *path);
+
+#endif
@@ -105,6 +105,8 @@ kqueue_add(struct event *ev)
 		fflags = NOTE_DELETE | NOTE_WRITE | NOTE_EXTEND;
 	} else {
 		flags = EV_ADD | EV_ENABLE;
+		if (ev->flags & EV_FLAG_EDGE)
+			flags |= EV_CLEAR;
 		fflags = 0;
 	}
 
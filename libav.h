@@ -263,6 +263,26 @@ lav_free_packet(AVPacket *pkt)
 #endif
 }
 
+static inline int
+lav_index_entries(AVStream *s)
+{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+	return avformat_index_get_entries_count(s);
+#else
+	return s->nb_index_entries;
+#endif
+}
+
+static inline const AVIndexEntry *
+lav_index_entry(AVStream *s, int i)
+{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+	return avformat_index_get_entry(s, i);
+#else
+	return &s->index_entries[i];
+#endif
+}
+
 static inline int
 lav_avcodec_open(AVCodecContext *avctx, const AVCodec *codec, AVDictionary **options)
 {
@@ -42,6 +42,7 @@
 #include "albumart.h"
 #include "utils.h"
 #include "sql.h"
+#include "seekindex.h"
 #include "log.h"
 
 #define FLAG_TITLE	0x00000001
@@ -142,10 +143,9 @@ check_for_captions(const char *path, int64_t detailID)
 	do {
 		strcpy(p, *subtitle_format);
 		if(access(file, R_OK) == 0) {
-			sql_exec(db, "INSERT OR REPLACE into CAPTIONS"
-			             " (ID, PATH) "
-			             "VALUES"
-			             " (%lld, %Q)", detailID, file);
+			sql_exec_param(db, "INSERT OR REPLACE into CAPTIONS"
+			                   " (ID, PATH) VALUES (?, ?)",
+			               "It", detailID, file);
 			break;
 		}
 	} while(*++subtitle_format);
@@ -276,11 +276,10 @@ GetFolderMetadata(const char *name, const char *path, const char *artist, const
 {
 	int ret;
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (TITLE, PATH, CREATOR, ARTIST, GENRE, ALBUM_ART) "
-	                   "VALUES"
-	                   " ('%q', %Q, %Q, %Q, %Q, %lld);",
-	                   name, path, artist, artist, genre, album_art);
+	ret = sql_exec_param(db, "INSERT into DETAILS"
+	                         " (TITLE, PATH, CREATOR, ARTIST, GENRE, ALBUM_ART) "
+	                         "VALUES (?, ?, ?, ?, ?, ?)",
+	                     "tttttI", name, path, artist, artist, genre, album_art);
 	if( ret != SQLITE_OK )
 		ret = 0;
 	else
@@ -473,14 +472,14 @@ GetAudioMetadata(const char *path, const char *name)
 
 	album_art = find_album_art(path, song.image, song.image_size);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
-	                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, '%s', %d, %d, %d, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %d, %d, %Q, '%s', %lld);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration, song.channels, song.bitrate,
-	                   song.samplerate, m.date, m.title, m.creator, m.artist, m.album, m.genre, m.comment, song.disc,
-	                   song.track, m.dlna_pn, song.mime?song.mime:m.mime, album_art);
+	ret = sql_exec_param(db, "INSERT into DETAILS"
+	                         " (PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
+	                         "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
+	                         "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+	                     "tIItiiitttttttiittI",
+	                     path, (int64_t)file.st_size, (int64_t)file.st_mtime, m.duration, song.channels, song.bitrate,
+	                     song.samplerate, m.date, m.title, m.creator, m.artist, m.album, m.genre, m.comment, song.disc,
+	                     song.track, m.dlna_pn, song.mime?song.mime:m.mime, album_art);
 	if( ret != SQLITE_OK )
 	{
 		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
@@ -655,13 +654,13 @@ no_exifdata:
 	m.title = strdup(name);
 	strip_ext(m.title);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
-	                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
-	                   "VALUES"
-	                   " (%Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %Q, %Q, %Q);",
-	                   path, m.title, (long long)file.st_size, (long long)file.st_mtime, m.date,
-	                   m.resolution, m.rotation, thumb, m.creator, m.dlna_pn, m.mime);
+	ret = sql_exec_param(db, "INSERT into DETAILS"
+	                         " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
+	                         " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
+	                         "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+	                     "ttIIttiittt",
+	                     path, m.title, (int64_t)file.st_size, (int64_t)file.st_mtime, m.date,
+	                     m.resolution, (int)m.rotation, thumb, m.creator, m.dlna_pn, m.mime);
 	if( ret != SQLITE_OK )
 	{
 		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
@@ -676,6 +675,70 @@ no_exifdata:
 	return ret;
 }
 
+static uint32_t
+seek_ms(AVStream *st, int64_t ts)
+{
+	if( st->start_time != AV_NOPTS_VALUE )
+		ts -= st->start_time;
+	if( ts < 0 )
+		return 0;
+	return av_rescale_q(ts, st->time_base, (AVRational){1, 1000});
+}
+
+/* Index the keyframes of a streamable container for TimeSeekRange.
+ * Matroska cues are used as they are; MPEG program and transport
+ * streams have no index, so those get read all the way through. */
+static void
+build_seek_index(AVFormatContext *ctx, int video_stream, struct seek_index *idx)
+{
+	AVStream *st = ctx->streams[video_stream];
+	const AVIndexEntry *ie;
+	AVPacket packet;
+	int64_t ts;
+	int i, n, last = -1;
+
+	if( strncmp(ctx->iformat->name, "matroska", 8) == 0 )
+	{
+		/* Cues at the end of the file are only read on the first seek */
+		av_seek_frame(ctx, video_stream, 0, AVSEEK_FLAG_BACKWARD);
+		n = lav_index_entries(st);
+		for( i = 0; i < n; i++ )
+		{
+			ie = lav_index_entry(st, i);
+			if( (ie->flags & AVINDEX_KEYFRAME) && ie->pos >= 0 )
+				seekindex_add(idx, seek_ms(st, ie->timestamp), ie->pos, ie->size > 0 ? ie->size : 0);
+		}
+	}
+	else if( strcmp(ctx->iformat->name, "mpegts") == 0 ||
+	         strcmp(ctx->iformat->name, "mpeg") == 0 )
+	{
+		av_init_packet(&packet);
+		packet.data = NULL;
+		packet.size = 0;
+		while( av_read_frame(ctx, &packet) >= 0 )
+		{
+			if( packet.stream_index == video_stream && packet.pos >= 0 )
+			{
+				/* A keyframe runs up to where the next video packet starts */
+				if( last >= 0 && packet.pos > idx->entries[last].offset )
+				{
+					idx->entries[last].len = packet.pos - idx->entries[last].offset;
+					last = -1;
+				}
+				ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+				if( (packet.flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE &&
+				    seekindex_add(idx, seek_ms(st, ts), packet.pos, 0) )
+					last = idx->count - 1;
+			}
+			lav_free_packet(&packet);
+		}
+	}
+	if( ctx->duration > 0 )
+		idx->duration = ctx->duration / (AV_TIME_BASE/1000);
+	if( idx->count )
+		DPRINTF(E_DEBUG, L_METADATA, "Seek index: %d keyframes\n", idx->count);
+}
+
 int64_t
 GetVideoMetadata(const char *path, const char *name)
 {
@@ -693,9 +756,11 @@ GetVideoMetadata(const char *path, const char *name)
 	metadata_t m;
 	uint32_t free_flags = 0xFFFFFFFF;
 	char *path_cpy, *basepath;
+	struct seek_index seek;
 
 	memset(&m, '\0', sizeof(m));
 	memset(&video, '\0', sizeof(video));
+	memset(&seek, '\0', sizeof(seek));
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing video %s...\n", name);
 	if ( stat(path, &file) != 0 )
@@ -1576,17 +1641,19 @@ video_no_dlna:
 
 	album_art = find_album_art(path, m.thumb_data, m.thumb_size);
 	freetags(&video);
+	if( GETFLAG(SEEK_INDEX_MASK) )
+		build_seek_index(ctx, video_stream, &seek);
 	lav_close(ctx);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
-	                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART, DISC, TRACK) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, %Q, %Q, %u, %u, %u, %Q, '%q', %Q, %Q, %Q, %Q, %Q, '%q', %lld, %u, %u);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration,
-	                   m.date, m.channels, m.bitrate, m.frequency, m.resolution,
-	                   m.title, m.creator, m.artist, m.genre, m.comment, m.dlna_pn,
-	                   m.mime, album_art, m.disc, m.track);
+	ret = sql_exec_param(db, "INSERT into DETAILS"
+	                         " (PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
+	                         "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART, DISC, TRACK) "
+	                         "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+	                     "tIIttiiittttttttIii",
+	                     path, (int64_t)file.st_size, (int64_t)file.st_mtime, m.duration,
+	                     m.date, (int)m.channels, (int)m.bitrate, (int)m.frequency, m.resolution,
+	                     m.title, m.creator, m.artist, m.genre, m.comment, m.dlna_pn,
+	                     m.mime, album_art, (int)m.disc, (int)m.track);
 	if( ret != SQLITE_OK )
 	{
 		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
@@ -1596,7 +1663,9 @@ video_no_dlna:
 	{
 		ret = sqlite3_last_insert_rowid(db);
 		check_for_captions(path, ret);
+		seekindex_save(db, ret, &seek);
 	}
+	seekindex_free(&seek);
 	free_metadata(&m, free_flags);
 	free(path_cpy);
 
@@ -90,6 +90,10 @@
 #include "minissdp.h"
 #include "minidlnatypes.h"
 #include "process.h"
+#include "streamer.h"
+#include "filecache.h"
+#include "dbwriter.h"
+#include "browsecache.h"
 #include "upnpevents.h"
 #include "scanner.h"
 #include "monitor.h"
@@ -105,6 +109,8 @@
 #endif
 
 static LIST_HEAD(httplisthead, upnphttp) upnphttphead;
+static int scan_bench_flag = 0;
+static int query_bench_tracks = 0;
 
 /* OpenAndConfHTTPSocket() :
  * setup the socket used to handle incoming HTTP connections. */
@@ -147,45 +153,96 @@ OpenAndConfHTTPSocket(unsigned short port)
 		return -1;
 	}
 
+	/* ProcessListen() drains the accept queue until EAGAIN */
+	if (fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "fcntl(http, O_NONBLOCK): %s\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+
 	return s;
 }
 
+/* A descriptor held back so a connection can still be taken off the
+ * backlog (and closed) when we have run out */
+static int spare_fd = -1;
+
 /* ProcessListen() :
- * accept incoming HTTP connection. */
+ * accept incoming HTTP connections.  The listening socket is
+ * non-blocking and may be registered edge-triggered, so keep
+ * accepting until the backlog is empty. */
 static void
 ProcessListen(struct event *ev)
 {
-	int shttp;
+	int shttp, flags, err;
 	socklen_t clientnamelen;
 	struct sockaddr_in clientname;
-	clientnamelen = sizeof(struct sockaddr_in);
 
-	shttp = accept(ev->fd, (struct sockaddr *)&clientname, &clientnamelen);
-	if (shttp<0)
+	for (;;)
 	{
-		DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
-	}
-	else
-	{
-		struct upnphttp * tmp = 0;
-		DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
-			inet_ntoa(clientname.sin_addr),
-			ntohs(clientname.sin_port) );
-		/*if (fcntl(shttp, F_SETFL, O_NONBLOCK) < 0) {
-			DPRINTF(E_ERROR, L_GENERAL, "fcntl F_SETFL, O_NONBLOCK\n");
-		}*/
-		/* Create a new upnphttp object and add it to
-		 * the active upnphttp object list */
-		tmp = New_upnphttp(shttp);
-		if (tmp)
+		clientnamelen = sizeof(struct sockaddr_in);
+		shttp = accept(ev->fd, (struct sockaddr *)&clientname, &clientnamelen);
+		if (shttp < 0)
 		{
-			tmp->clientaddr = clientname.sin_addr;
-			LIST_INSERT_HEAD(&upnphttphead, tmp, entries);
+			err = errno;
+			if (err == EINTR || err == ECONNABORTED)
+				continue;
+			if (err == EAGAIN || err == EWOULDBLOCK)
+				break;
+			/* Edge-triggered, a connection left in the backlog isn't
+			 * reported again until another one arrives.  Out of
+			 * descriptors, refuse it with the spare one. */
+			if ((err == EMFILE || err == ENFILE) && spare_fd >= 0)
+			{
+				close(spare_fd);
+				shttp = accept(ev->fd, NULL, NULL);
+				if (shttp >= 0)
+					close(shttp);
+				spare_fd = open("/dev/null", O_RDONLY);
+				if (shttp >= 0)
+				{
+					DPRINTF(E_WARN, L_GENERAL, "accept(http): %s; connection refused\n",
+						strerror(err));
+					continue;
+				}
+			}
+			DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(err));
+			/* Otherwise, have the backlog reported for as long as
+			 * there is one */
+			if (ev->flags & EV_FLAG_EDGE)
+			{
+				DPRINTF(E_WARN, L_GENERAL, "Watching for HTTP connections level-triggered\n");
+				event_module.del(ev, 0);
+				ev->flags &= ~EV_FLAG_EDGE;
+				event_module.add(ev);
+			}
+			break;
 		}
 		else
 		{
-			DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
-			close(shttp);
+			struct upnphttp * tmp = 0;
+			DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
+				inet_ntoa(clientname.sin_addr),
+				ntohs(clientname.sin_port) );
+			/* Connections never block the main loop; a full socket
+			 * buffer just waits for EVENT_WRITE. */
+			flags = fcntl(shttp, F_GETFL, 0);
+			if (flags < 0 || fcntl(shttp, F_SETFL, flags | O_NONBLOCK) < 0)
+				DPRINTF(E_WARN, L_GENERAL, "fcntl(O_NONBLOCK): %s\n", strerror(errno));
+			/* Create a new upnphttp object and add it to
+			 * the active upnphttp object list */
+			tmp = New_upnphttp(shttp);
+			if (tmp)
+			{
+				tmp->clientaddr = clientname.sin_addr;
+				LIST_INSERT_HEAD(&upnphttphead, tmp, entries);
+			}
+			else
+			{
+				DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
+				close(shttp);
+			}
 		}
 	}
 }
@@ -394,18 +451,24 @@ _get_dbtime(void)
 {
 	char path[PATH_MAX];
 	struct stat st;
+	time_t mtime;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
 	if (stat(path, &st) != 0)
 		return 0;
-	return st.st_mtime;
+	mtime = st.st_mtime;
+	/* In WAL mode, writes reach files.db only at checkpoints */
+	snprintf(path, sizeof(path), "%s/files.db-wal", db_path);
+	if (stat(path, &st) == 0 && st.st_mtime > mtime)
+		mtime = st.st_mtime;
+	return mtime;
 }
 
 static void
 check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 {
 	struct media_dir_s *media_path = NULL;
-	char cmd[PATH_MAX*2];
+	char cmd[PATH_MAX*4];
 	char **result;
 	int i, rows = 0;
 	int ret;
@@ -459,9 +522,10 @@ rescan:
 		else
 			DPRINTF(E_WARN, L_GENERAL, "Database version mismatch (%d => %d); need to recreate...\n",
 				ret, DB_VERSION);
-		sqlite3_close(db);
+		sql_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache",
+		         db_path, db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
@@ -469,6 +533,8 @@ rescan:
 		if (CreateDatabase() != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to create sqlite database!  Exiting...\n");
 	}
+	if (sql_fulltext(db))
+		SETFLAG(FULLTEXT_MASK);
 	if (ret || GETFLAG(RESCAN_MASK))
 	{
 		start_scanner();
@@ -675,6 +741,10 @@ init(int argc, char **argv)
 	runtime_vars.port = 8200;
 	runtime_vars.notify_interval = 895;	/* seconds between SSDP announces */
 	runtime_vars.max_connections = 50;
+	runtime_vars.keepalive_timeout = 15;
+	runtime_vars.keepalive_requests = 100;
+	runtime_vars.pacing_headroom = 50;
+	runtime_vars.admission_timeout = 10;
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
 
@@ -893,6 +963,22 @@ init(int argc, char **argv)
 			if (!strtobool(ary_options[i].value))
 				CLEARFLAG(SUBTITLES_MASK);
 			break;
+		case ENABLE_SEEK_INDEX:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(SEEK_INDEX_MASK);
+			break;
+		case KEEPALIVE_TIMEOUT:
+			runtime_vars.keepalive_timeout = atoi(ary_options[i].value);
+			break;
+		case KEEPALIVE_REQUESTS:
+			runtime_vars.keepalive_requests = atoi(ary_options[i].value);
+			break;
+		case PACING_HEADROOM:
+			runtime_vars.pacing_headroom = atoi(ary_options[i].value);
+			break;
+		case ADMISSION_TIMEOUT:
+			runtime_vars.admission_timeout = atoi(ary_options[i].value);
+			break;
 		default:
 			DPRINTF(E_ERROR, L_GENERAL, "Unknown option in file %s\n",
 				optionsfile);
@@ -918,6 +1004,14 @@ init(int argc, char **argv)
 			runtime_vars.port = -1;
 			break;
 		}
+		else if (strcmp(argv[i], "--scan-bench") == 0)
+			scan_bench_flag = 1;
+		else if (strcmp(argv[i], "--query-bench") == 0)
+		{
+			query_bench_tracks = QUERY_BENCH_TRACKS;
+			if (i+1 < argc && isdigit(argv[i+1][0]))
+				query_bench_tracks = atoi(argv[++i]);
+		}
 		else switch(argv[i][1])
 		{
 		case 't':
@@ -999,7 +1093,8 @@ init(int argc, char **argv)
 			SETFLAG(RESCAN_MASK);
 			break;
 		case 'R':
-			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache",
+			         db_path, db_path, db_path, db_path);
 			if (system(buf) != 0)
 				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache %s. EXITING\n", db_path);
 			break;
@@ -1062,10 +1157,11 @@ init(int argc, char **argv)
 			"\t\t[-t notify_interval] [-P pid_filename]\n"
 			"\t\t[-s serial] [-m model_number]\n"
 #ifdef __linux__
-			"\t\t[-w url] [-l] [-r] [-R] [-L] [-S] [-V] [-h]\n"
+			"\t\t[-w url] [-l] [-r] [-R] [-L] [-S] [-V] [-h] [--scan-bench]\n"
 #else
-			"\t\t[-w url] [-l] [-r] [-R] [-L] [-V] [-h]\n"
+			"\t\t[-w url] [-l] [-r] [-R] [-L] [-V] [-h] [--scan-bench]\n"
 #endif
+			"\t\t[--query-bench [tracks]]\n"
 			"\nNotes:\n\tNotify interval is in seconds. Default is 895 seconds.\n"
 			"\tDefault pid file is %s.\n"
 			"\tWith -d minidlna will run in debug mode (not daemonize).\n"
@@ -1079,7 +1175,9 @@ init(int argc, char **argv)
 #ifdef __linux__
 			"\t-S changes behaviour for systemd\n"
 #endif
-			"\t-V print the version number\n",
+			"\t-V print the version number\n"
+			"\t--scan-bench times a scan of the media dirs into a scratch database\n"
+			"\t--query-bench times Browse and Search queries against a scratch database of synthetic tracks\n",
 			argv[0], pidfilename);
 		return 1;
 	}
@@ -1100,7 +1198,7 @@ init(int argc, char **argv)
 		log_level = log_str;
 		log_path[0] = '\0';
 	}
-	else if (GETFLAG(SYSTEMD_MASK))
+	else if (GETFLAG(SYSTEMD_MASK) || scan_bench_flag || query_bench_tracks)
 	{
 		pid = getpid();
 		log_path[0] = '\0';
@@ -1114,6 +1212,9 @@ init(int argc, char **argv)
 	if (log_init(log_level) < 0)
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to open log file '%s/" LOGFILE_NAME "': %s\n",
 			log_path, strerror(errno));
+	/* The benchmark leaves the real database and any running server alone */
+	if (scan_bench_flag || query_bench_tracks)
+		return 0;
 
 	if (process_check_if_running(pidfilename) < 0)
 		DPRINTF(E_FATAL, L_GENERAL, SERVER_NAME " is already running. EXITING.\n");
@@ -1181,6 +1282,10 @@ init(int argc, char **argv)
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to init event module. "
 		    "[%s] EXITING.\n", strerror(error));
 
+	if ((error = streamer_init()) != 0)
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to start streaming threads, "
+		    "serving inline. [%s]\n", strerror(error));
+
 	return 0;
 }
 
@@ -1197,7 +1302,7 @@ main(int argc, char **argv)
 	struct timeval tv, timeofday, lastnotifytime = {0, 0};
 	time_t lastupdatetime = 0, lastdbtime = 0;
 	u_long timeout;	/* in milliseconds */
-	int last_changecnt = 0;
+	int last_changecnt = 0, changecnt;
 	pthread_t inotify_thread = 0;
 	struct event ssdpev, httpev, monev;
 #ifdef TIVO_SUPPORT
@@ -1221,6 +1326,10 @@ main(int argc, char **argv)
 	// USE_FORK is not set, or inotify/kqueue detect a change, etc.
 	av_register_all();
 	av_log_set_level(AV_LOG_PANIC);
+	if (scan_bench_flag)
+		return scan_bench();
+	if (query_bench_tracks)
+		return query_bench(query_bench_tracks);
 
 	DPRINTF(E_WARN, L_GENERAL, "Starting " SERVER_NAME " version " MINIDLNA_VERSION ".\n");
 	if (sqlite3_libversion_number() < 3005001)
@@ -1239,6 +1348,8 @@ main(int argc, char **argv)
 	}
 	check_db(db, ret, &scanner_pid);
 	lastdbtime = _get_dbtime();
+	if (dbwriter_start() != 0)
+		DPRINTF(E_WARN, L_GENERAL, "Database writes will be made inline\n");
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
@@ -1271,7 +1382,7 @@ main(int argc, char **argv)
 	}
 	else
 	{
-		ssdpev = (struct event ){ .fd = sssdp, .rdwr = EVENT_READ, .process = ProcessSSDPRequest };
+		ssdpev = (struct event ){ .fd = sssdp, .rdwr = EVENT_READ, .flags = EV_FLAG_EDGE, .process = ProcessSSDPRequest };
 		event_module.add(&ssdpev);
 	}
 
@@ -1280,7 +1391,8 @@ main(int argc, char **argv)
 	if (shttpl < 0)
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
 	DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d\n", runtime_vars.port);
-	httpev = (struct event ){ .fd = shttpl, .rdwr = EVENT_READ, .process = ProcessListen };
+	spare_fd = open("/dev/null", O_RDONLY);
+	httpev = (struct event ){ .fd = shttpl, .rdwr = EVENT_READ, .flags = EV_FLAG_EDGE, .process = ProcessListen };
 	event_module.add(&httpev);
 
 #ifdef TIVO_SUPPORT
@@ -1371,6 +1483,16 @@ main(int argc, char **argv)
 		}
 #endif
 
+		/* wake up in time to close idle persistent connections */
+		if (runtime_vars.keepalive_timeout > 0 && !LIST_EMPTY(&upnphttphead) &&
+		    timeout > (u_long)runtime_vars.keepalive_timeout * 1000)
+			timeout = runtime_vars.keepalive_timeout * 1000;
+
+		/* and to turn away requests that waited too long for a stream */
+		ret = stream_expire();
+		if (ret >= 0 && timeout > (u_long)ret)
+			timeout = ret;
+
 		if (GETFLAG(SCANNING_MASK)) {
 			// If we fork()ed a scanner process, wait for it to finish. If we didn't
 			// fork(), we have already completed the scan (inline) at this point.
@@ -1381,9 +1503,17 @@ main(int argc, char **argv)
 				// missing database", then if the same statement is re-stepped error 1,
 				// "database schema has changed"). By re-opening the database here,
 				// before marking scanning as completed, we force SQLite to refresh,
-				// preventing these errors.
-				sqlite3_close(db);
-				open_db(&db);
+				// preventing these errors.  With a write-ahead log every
+				// query reads a committed snapshot, so there is no need.
+				if (!GETFLAG(WAL_MASK))
+				{
+					sql_close(db);
+					open_db(&db);
+				}
+
+				// The scan may have renumbered DETAILS
+				filecache_flush();
+				browsecache_flush();
 
 				// Mark scan complete
 				CLEARFLAG(SCANNING_MASK);
@@ -1412,19 +1542,25 @@ main(int argc, char **argv)
 					last_changecnt = -1;
 				}
 			}
-			if (sqlite3_total_changes(db) != last_changecnt)
+			changecnt = sql_changes(db);
+			if (changecnt != last_changecnt)
 			{
 				updateID++;
-				last_changecnt = sqlite3_total_changes(db);
+				last_changecnt = changecnt;
 				upnp_event_var_change_notify(EContentDirectory);
 				lastupdatetime = timeofday.tv_sec;
 			}
 		}
-		/* delete finished HTTP connections */
+		/* delete finished and idle HTTP connections */
+		time_t now = time(NULL);
 		for (e = upnphttphead.lh_first; e != NULL; e = next)
 		{
 			next = e->entries.le_next;
-			if(e->state >= 100)
+			if(e->state >= 100 ||
+			   (e->state == 0 && !e->req_buflen && runtime_vars.keepalive_timeout > 0 &&
+			    now - e->idle >= runtime_vars.keepalive_timeout) ||
+			   /* don't let a stalled client hold a database query open */
+			   (e->state == 4 && e->stream.fill && now - e->idle >= DIDL_STALL_TIMEOUT))
 			{
 				LIST_REMOVE(e, entries);
 				Delete_upnphttp(e);
@@ -1437,6 +1573,9 @@ shutdown:
 	if (GETFLAG(SCANNING_MASK) && scanner_pid)
 		kill(scanner_pid, SIGKILL);
 
+	/* stop the streaming threads before tearing down their connections */
+	streamer_fini();
+
 	/* close out open sockets */
 	while (upnphttphead.lh_first != NULL)
 	{
@@ -1467,6 +1606,8 @@ shutdown:
 		pthread_join(inotify_thread, NULL);
 	}
 
+	dbwriter_stop();
+
 	/* kill other child processes */
 	process_reap_children();
 	free(children);
@@ -1474,7 +1615,7 @@ shutdown:
 	event_module.fini();
 
 	sql_exec(db, "UPDATE SETTINGS set VALUE = '%u' where KEY = 'UPDATE_ID'", updateID);
-	sqlite3_close(db);
+	sql_close(db);
 
 	upnpevents_removeSubscribers();
 
@@ -49,6 +49,10 @@ struct runtime_vars_s {
 	int port;	/* HTTP Port */
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
+	int keepalive_timeout;	/* idle seconds before closing a persistent connection, 0 disables */
+	int keepalive_requests;	/* max requests per persistent connection */
+	int pacing_headroom;	/* percent above the bitrate to pace streams at, 0 disables */
+	int admission_timeout;	/* seconds to wait for a free stream before a 503 */
 	const char *root_container;	/* root ObjectID (instead of "0") */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
 #ifdef ENABLE_VIDEO_THUMB
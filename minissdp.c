@@ -478,12 +478,12 @@ close:
 	}
 }
 
-/* ProcessSSDPRequest()
- * process SSDP M-SEARCH requests and responds to them */
-void
-ProcessSSDPRequest(struct event *ev)
+/* ProcessSSDPDatagram()
+ * read one datagram and respond to it if it is an M-SEARCH.
+ * Returns -1 once the socket has been drained. */
+static int
+ProcessSSDPDatagram(int s)
 {
-	int s = ev->fd;
 	int n;
 	char bufr[1500];
 	struct sockaddr_in sendername;
@@ -506,17 +506,20 @@ ProcessSSDPRequest(struct event *ev)
 		.msg_controllen = sizeof(cmbuf)
 	};
 
-	n = recvmsg(s, &mh, 0);
+	n = recvmsg(s, &mh, MSG_DONTWAIT);
 #else
 
-	n = recvfrom(s, bufr, sizeof(bufr)-1, 0,
+	n = recvfrom(s, bufr, sizeof(bufr)-1, MSG_DONTWAIT,
 	             (struct sockaddr *)&sendername, &len_r);
 	len_r = MIN(len_r, sizeof(struct sockaddr_in));
 #endif
 	if (n < 0)
 	{
-		DPRINTF(E_ERROR, L_SSDP, "recvfrom(udp): %s\n", strerror(errno));
-		return;
+		if (errno == EINTR)
+			return 0;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			DPRINTF(E_ERROR, L_SSDP, "recvfrom(udp): %s\n", strerror(errno));
+		return -1;
 	}
 	bufr[n] = '\0';
 	n -= 2;
@@ -532,7 +535,7 @@ ProcessSSDPRequest(struct event *ev)
 				break;
 		}
 		if (strcasestrc(bufr+i, "HTTP/1.1", '\r') == NULL)
-			return;
+			return 0;
 		while (i < n)
 		{
 			while ((i < n) && (bufr[i] != '\r' || bufr[i+1] != '\n'))
@@ -567,7 +570,7 @@ ProcessSSDPRequest(struct event *ev)
 		}
 		if (!loc || !srv || !nt || !nts || (strncmp(nts, "ssdp:alive", 10) != 0) ||
 		    (strncmp(nt, "urn:schemas-upnp-org:device:MediaRenderer", 41) != 0))
-			return;
+			return 0;
 		loc[loc_len] = '\0';
 		if ((strncmp(srv, "Allegro-Software-RomPlug", 24) == 0) || /* Roku */
 		    (strstr(loc, "SamsungMRDesc.xml") != NULL) || /* Samsung TV */
@@ -581,7 +584,7 @@ ProcessSSDPRequest(struct event *ev)
 				    client->type->type != ESamsungSeriesA)
 				{
 					client->age = time(NULL);
-					return;
+					return 0;
 				}
 			}
 			ParseUPnPClient(loc);
@@ -597,7 +600,7 @@ ProcessSSDPRequest(struct event *ev)
 				break;
 		}
 		if (strcasestrc(bufr+i, "HTTP/1.1", '\r') == NULL)
-			return;
+			return 0;
 		while (i < n)
 		{
 			while ((i < n) && (bufr[i] != '\r' || bufr[i+1] != '\n'))
@@ -689,7 +692,7 @@ ProcessSSDPRequest(struct event *ev)
 			{
 				DPRINTF(E_DEBUG, L_SSDP, "Ignoring SSDP M-SEARCH on other interface [%s]\n",
 					inet_ntoa(sendername.sin_addr));
-				return;
+				return 0;
 			}
 
 			DPRINTF(E_DEBUG, L_SSDP, "SSDP M-SEARCH from %s:%d ST: %.*s, MX: %.*s, MAN: %.*s\n",
@@ -726,7 +729,7 @@ ProcessSSDPRequest(struct event *ev)
 				}
 				_usleep(13000, 20000);
 				SendSSDPResponse(s, sendername, i, host, len_r);
-				return;
+				return 0;
 			}
 			/* Responds to request with ST: ssdp:all */
 			/* strlen("ssdp:all") == 8 */
@@ -748,13 +751,25 @@ ProcessSSDPRequest(struct event *ev)
 	}
 	else if (memcmp(bufr, "YOUKU-NOTIFY", 12) == 0)
 	{
-		return;
+		return 0;
 	}
 	else
 	{
 		DPRINTF(E_WARN, L_SSDP, "Unknown udp packet received from %s:%d\n",
 			inet_ntoa(sendername.sin_addr), ntohs(sendername.sin_port));
 	}
+
+	return 0;
+}
+
+/* ProcessSSDPRequest()
+ * process SSDP M-SEARCH requests and responds to them.  The socket
+ * may be registered edge-triggered, so read until nothing is left. */
+void
+ProcessSSDPRequest(struct event *ev)
+{
+	while (ProcessSSDPDatagram(ev->fd) == 0)
+		continue;
 }
 
 /* This will broadcast ssdp:byebye notifications to inform 
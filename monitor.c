@@ -50,6 +50,7 @@
 #include "metadata.h"
 #include "albumart.h"
 #include "playlist.h"
+#include "filecache.h"
 #include "log.h"
 
 static time_t next_pl_fill = 0;
@@ -269,8 +270,10 @@ monitor_remove_file(const char * path)
 	int64_t detailID;
 	int rows, playlist;
 
+	filecache_close(path);
 	if( is_caption(path) )
 	{
+		filecache_flush();
 		return sql_exec(db, "DELETE from CAPTIONS where PATH = '%q'", path);
 	}
 	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
@@ -308,7 +311,7 @@ monitor_remove_file(const char * path)
 					         atoi(strrchr(result[i], '$') + 1));
 				}
 
-				children = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]);
+				children = sql_get_int_param(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "t", result[i]);
 				if( children < 0 )
 					continue;
 				if( children < 2 )
@@ -318,7 +321,7 @@ monitor_remove_file(const char * path)
 					ptr = strrchr(result[i], '$');
 					if( ptr )
 						*ptr = '\0';
-					if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]) == 0 )
+					if( sql_get_int_param(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "t", result[i]) == 0 )
 					{
 						sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
 					}
@@ -329,6 +332,8 @@ monitor_remove_file(const char * path)
 		/* Now delete the actual objects */
 		sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
 		sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+		sql_exec(db, "DELETE from SEEK_INDEX where ID = %lld", detailID);
+		filecache_invalidate(detailID);
 	}
 
 	art_cache_cleanup(path);
@@ -367,6 +372,7 @@ monitor_insert_file(const char *name, const char *path)
 	struct stat st;
 	char dirpath[PATH_MAX];
 
+	filecache_close(path);
 	strncpyt(dirpath, path, sizeof(dirpath));
 	if ( has_ignore(dirname((char*)dirpath), 1) )
 		return -1;
@@ -375,7 +381,10 @@ monitor_insert_file(const char *name, const char *path)
 	if (mtype == TYPE_IMAGE)
 		update_if_album_art(path);
 	else if (mtype == TYPE_CAPTION)
+	{
 		check_for_captions(path, 0);
+		filecache_flush();
+	}
 	else if (mtype == TYPE_PLAYLIST)
 		tbl = "PLAYLISTS";
 	else if (mtype == TYPE_NFO)
@@ -527,7 +536,7 @@ monitor_insert_directory(int fd, char *name, const char * path)
 		DPRINTF(E_WARN, L_INOTIFY, "Could not access %s [%s]\n", path, strerror(errno));
 		return -1;
 	}
-	if( sql_get_int_field(db, "SELECT ID from DETAILS where PATH = '%q'", path) > 0 )
+	if( sql_get_int_param(db, "SELECT ID from DETAILS where PATH = ?", "t", path) > 0 )
 	{
 		fd = 0;
 		if (!GETFLAG(RESCAN_MASK))
@@ -613,6 +622,7 @@ monitor_remove_directory(int fd, const char * path)
 
 	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
 	valid_cache = 0;
+	filecache_close(path);
 	#ifdef HAVE_INOTIFY
 	if( fd > 0 )
 	{
@@ -630,6 +640,8 @@ monitor_remove_directory(int fd, const char * path)
 			sql_exec(db, "DELETE from ALBUM_ART where ID = (SELECT ALBUM_ART from DETAILS where ID = %lld)", detailID);
 			sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
 			sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+			sql_exec(db, "DELETE from SEEK_INDEX where ID = %lld", detailID);
+			filecache_invalidate(detailID);
 			art_cache_cleanup(result[i+1]);
 		}
 		ret = 0;
@@ -674,6 +686,9 @@ start_inotify(void)
 			goto quitting;
 		sleep(1);
 	}
+	/* Our own connection, so that what we write doesn't show up in
+	 * the main loop's queries halfway through */
+	open_db(NULL);
 	inotify_create_watches(pollfds[0].fd);
 	if (setpriority(PRIO_PROCESS, 0, 19) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce inotify thread priority\n");
@@ -777,7 +792,7 @@ start_inotify(void)
 					else if( event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO) && st.st_size > 0 )
 					{
 						if( (event->mask & IN_MOVED_TO) ||
-						    (sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path_buf) != st.st_mtime) )
+						    (sql_get_int_param(db, "SELECT TIMESTAMP from DETAILS where PATH = ?", "t", path_buf) != st.st_mtime) )
 						{
 							DPRINTF(E_INFO, L_INOTIFY, "The file %s was %s.\n",
 								path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "changed"));
@@ -827,6 +842,8 @@ quitting:
 			monitor_remove_file(renpath_buf+1);
 	}
 	close(pollfds[0].fd);
+	if (db)
+		sql_close(db);
 
 	return 0;
 }
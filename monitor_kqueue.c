@@ -243,6 +243,7 @@ add_watch(int fd __unused, const char *path)
 	ev->data = wt;
 	ev->fd = wd;
 	ev->rdwr = EVENT_VNODE;
+	ev->flags = 0;
 	ev->process_vnode = dir_vnode_process;
 
 	DPRINTF(E_DEBUG, L_INOTIFY, "kqueue add_watch [%s]\n", path);
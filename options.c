@@ -75,6 +75,11 @@ static const struct {
 #endif
 	{ ENABLE_MTA, "enable_mta" },
 	{ ENABLE_SUBTITLES, "enable_subtitles" },
+	{ ENABLE_SEEK_INDEX, "enable_seek_index" },
+	{ KEEPALIVE_TIMEOUT, "keepalive_timeout" },
+	{ KEEPALIVE_REQUESTS, "keepalive_requests" },
+	{ PACING_HEADROOM, "pacing_headroom" },
+	{ ADMISSION_TIMEOUT, "admission_timeout" },
 };
 
 int
@@ -68,6 +68,11 @@ enum upnpconfigoptions {
 #endif
 	ENABLE_MTA,
 	ENABLE_SUBTITLES,		/* Enable generic subtitle support for all clients by default */
+	ENABLE_SEEK_INDEX,		/* index video keyframes at scan time for TimeSeekRange */
+	KEEPALIVE_TIMEOUT,		/* idle seconds before closing a persistent HTTP connection */
+	KEEPALIVE_REQUESTS,		/* maximum requests served on one HTTP connection */
+	PACING_HEADROOM,		/* percent above the bitrate streams are paced at */
+	ADMISSION_TIMEOUT,		/* seconds a request may wait for a free stream */
 };
 
 /* readoptionsfile()
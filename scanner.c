@@ -26,6 +26,7 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <sys/resource.h>
 
 #include "config.h"
@@ -67,15 +68,71 @@ struct virtual_item
 	char name[256];
 };
 
+/* Committing every statement costs far more than the statement, so a
+ * scan writes in transactions of SCAN_BATCH_FILES files, or whatever it
+ * got through in SCAN_BATCH_MS.  Short enough that clients watch the
+ * library fill in, and that the other writers don't wait long. */
+#define SCAN_BATCH_FILES	256
+#define SCAN_BATCH_MS		1000
+
+static struct {
+	int size;		/* files per transaction, 0 to not batch */
+	int open;
+	int files;
+	struct timespec start;
+} batch = { SCAN_BATCH_FILES };
+
+static void
+scan_batch_begin(void)
+{
+	if (!batch.size || batch.open)
+		return;
+	/* Writes made outside a batch still go in, one by one */
+	if (sql_begin(db) != SQLITE_OK)
+		return;
+	batch.open = 1;
+	batch.files = 0;
+	clock_gettime(CLOCK_MONOTONIC, &batch.start);
+}
+
+static void
+scan_batch_end(void)
+{
+	if (!batch.open)
+		return;
+	batch.open = 0;
+	if (sql_exec(db, "COMMIT") != SQLITE_OK)
+		DPRINTF(E_ERROR, L_SCANNER, "Failed to commit %d scanned files\n", batch.files);
+}
+
+/* Count a scanned file, and commit if the batch is full */
+static void
+scan_batch_file(void)
+{
+	struct timespec now;
+
+	if (!batch.open)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (++batch.files < batch.size &&
+	    (now.tv_sec - batch.start.tv_sec) * 1000 +
+	    (now.tv_nsec - batch.start.tv_nsec) / 1000000 < SCAN_BATCH_MS)
+		return;
+	scan_batch_end();
+	scan_batch_begin();
+}
+
 int64_t
 get_next_available_id(const char *table, const char *parentID)
 {
-		char *ret, *base;
+		char *ret, *base, *sql;
 		int64_t objectID = 0;
 
-		ret = sql_get_text_field(db, "SELECT OBJECT_ID from %s where ID = "
-		                             "(SELECT max(ID) from %s where PARENT_ID = '%s')",
-		                             table, table, parentID);
+		sql = sqlite3_mprintf("SELECT OBJECT_ID from %s where ID = "
+		                      "(SELECT max(ID) from %s where PARENT_ID = ?)",
+		                      table, table);
+		ret = sql ? sql_get_text_param(db, sql, "t", parentID) : NULL;
+		sqlite3_free(sql);
 		if( ret )
 		{
 			base = strrchr(ret, '$');
@@ -93,15 +150,22 @@ insert_container(const char *item, const char *rootParent, const char *refID, co
 {
 	char *result;
 	char *base;
+	char container[64], id[64];
 	int ret = 0;
 
-	result = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o "
-					"left join DETAILS d on (o.DETAIL_ID = d.ID)"
-					" where o.PARENT_ID = '%s'"
-					" and o.NAME like '%q'"
-					" and d.ARTIST %s %Q"
-					" and o.CLASS = 'container.%s' limit 1",
-					rootParent, item, artist?"like":"is", artist, class);
+	snprintf(container, sizeof(container), "container.%s", class);
+	if( artist )
+		result = sql_get_text_param(db, "SELECT OBJECT_ID from OBJECTS o "
+		                                "left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                                " where o.PARENT_ID = ? and o.NAME like ?"
+		                                " and d.ARTIST like ? and o.CLASS = ? limit 1",
+		                            "tttt", rootParent, item, artist, container);
+	else
+		result = sql_get_text_param(db, "SELECT OBJECT_ID from OBJECTS o "
+		                                "left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                                " where o.PARENT_ID = ? and o.NAME like ?"
+		                                " and d.ARTIST is NULL and o.CLASS = ? limit 1",
+		                            "ttt", rootParent, item, container);
 	if( result )
 	{
 		base = strrchr(result, '$');
@@ -118,26 +182,41 @@ insert_container(const char *item, const char *rootParent, const char *refID, co
 		*parentID = get_next_available_id("OBJECTS", rootParent);
 		if( refID )
 		{
-			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = %Q", refID);
-			if( result )
-				detailID = strtoll(result, NULL, 10);
+			detailID = sql_get_int64_param(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?", "t", refID);
+			if( detailID < 0 )
+				detailID = 0;
 		}
 		if( !detailID )
 		{
 			detailID = GetFolderMetadata(item, NULL, artist, genre, (album_art ? strtoll(album_art, NULL, 10) : 0));
 		}
-		ret = sql_exec(db, "INSERT into OBJECTS"
-		                   " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME) "
-		                   "VALUES"
-		                   " ('%s$%llX', '%s', %Q, %lld, 'container.%s', '%q')",
-		                   rootParent, (long long)*parentID, rootParent,
-		                   refID, (long long)detailID, class, item);
+		snprintf(id, sizeof(id), "%s$%llX", rootParent, (long long)*parentID);
+		ret = sql_exec_param(db, "INSERT into OBJECTS"
+		                         " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME) "
+		                         "VALUES (?, ?, ?, ?, ?, ?)",
+		                     "tttItt", id, rootParent, refID, detailID, container, item);
 	}
 	sqlite3_free(result);
 
 	return ret;
 }
 
+/* Add a reference to detailID as the next item (objectID) of parentID.
+ * One fixed statement for every row the scanner adds, so it is only
+ * prepared once. */
+static void
+insert_item(const char *parentID, long long objectID, const char *refID,
+            const char *class, int64_t detailID, const char *name)
+{
+	char id[64];
+
+	snprintf(id, sizeof(id), "%s$%llX", parentID, objectID);
+	sql_exec_param(db, "INSERT into OBJECTS"
+	                   " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
+	                   "VALUES (?, ?, ?, ?, ?, ?)",
+	               "ttttIt", id, parentID, refID, class, detailID, name);
+}
+
 static void
 insert_containers(const char *name, const char *path, const char *refID, const char *class, int64_t detailID)
 {
@@ -182,11 +261,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 			strncpyt(last_date.name, date_taken, sizeof(last_date.name));
 			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached date item: %s/%s/%X\n", last_date.name, last_date.parentID, last_date.objectID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-		             last_date.parentID, (long long)last_date.objectID, last_date.parentID, refID, class, (long long)detailID, name);
+		insert_item(last_date.parentID, last_date.objectID, refID, class, detailID, name);
 
 		if( !valid_cache || strcmp(camera, last_cam.name) != 0 )
 		{
@@ -209,21 +284,13 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 			strncpyt(last_camdate.name, date_taken, sizeof(last_camdate.name));
 			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached camdate item: %s/%s/%s/%X\n", camera, last_camdate.name, last_camdate.parentID, last_camdate.objectID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-		             last_camdate.parentID, last_camdate.objectID, last_camdate.parentID, refID, class, (long long)detailID, name);
+		insert_item(last_camdate.parentID, last_camdate.objectID, refID, class, detailID, name);
 		/* All Images */
 		if( !last_all_objectID )
 		{
 			last_all_objectID = get_next_available_id("OBJECTS", IMAGE_ALL_ID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('"IMAGE_ALL_ID"$%llX', '"IMAGE_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		insert_item(IMAGE_ALL_ID, last_all_objectID++, refID, class, detailID, name);
 	}
 	else if( strstr(class, "audioItem") )
 	{
@@ -262,17 +329,13 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 				last_album.objectID = objectID;
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached album item: %s/%s/%X\n", last_album.name, last_album.parentID, last_album.objectID);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_album.parentID, last_album.objectID, last_album.parentID, refID, class, (long long)detailID, name);
+			insert_item(last_album.parentID, last_album.objectID, refID, class, detailID, name);
 		}
 		if( artist )
 		{
 			if( !valid_cache || strcmp(artist, last_artist.name) != 0 )
 			{
-				album_art = sql_get_text_field(db, "SELECT ALBUM_ART from DETAILS where PATH not NULL and TITLE like '%%q'", artist);
+				album_art = sql_get_text_param(db, "SELECT ALBUM_ART from DETAILS where PATH not NULL and TITLE like '%' || ?", "t", artist);
 				insert_container(artist, MUSIC_ARTIST_ID, NULL, "person.musicArtist", NULL, genre, album_art, &objectID, &parentID);
 				sprintf(last_artist.parentID, MUSIC_ARTIST_ID"$%llX", (long long)parentID);
 				strncpyt(last_artist.name, artist, sizeof(last_artist.name));
@@ -301,16 +364,8 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 				strncpyt(last_artistAlbum.name, album ? album : _("Unknown Album"), sizeof(last_artistAlbum.name));
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached artist/album item: %s/%s/%X\n", last_artist.name, last_artist.parentID, last_artist.objectID);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_artistAlbum.parentID, last_artistAlbum.objectID, last_artistAlbum.parentID, refID, class, (long long)detailID, name);
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_artistAlbumAll.parentID, last_artistAlbumAll.objectID, last_artistAlbumAll.parentID, refID, class, (long long)detailID, name);
+			insert_item(last_artistAlbum.parentID, last_artistAlbum.objectID, refID, class, detailID, name);
+			insert_item(last_artistAlbumAll.parentID, last_artistAlbumAll.objectID, refID, class, detailID, name);
 		}
 		if( genre )
 		{
@@ -341,27 +396,15 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 				strncpyt(last_genreArtist.name, artist ? artist : _("Unknown Artist"), sizeof(last_genreArtist.name));
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Creating cached genre/artist item: %s/%s/%X\n", last_genreArtist.name, last_genreArtist.parentID, last_genreArtist.objectID);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_genreArtist.parentID, last_genreArtist.objectID, last_genreArtist.parentID, refID, class, (long long)detailID, name);
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-			             "VALUES"
-			             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
-			             last_genreArtistAll.parentID, last_genreArtistAll.objectID, last_genreArtistAll.parentID, refID, class, (long long)detailID, name);
+			insert_item(last_genreArtist.parentID, last_genreArtist.objectID, refID, class, detailID, name);
+			insert_item(last_genreArtistAll.parentID, last_genreArtistAll.objectID, refID, class, detailID, name);
 		}
 		/* All Music */
 		if( !last_all_objectID )
 		{
 			last_all_objectID = get_next_available_id("OBJECTS", MUSIC_ALL_ID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('"MUSIC_ALL_ID"$%llX', '"MUSIC_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		insert_item(MUSIC_ALL_ID, last_all_objectID++, refID, class, detailID, name);
 	}
 	else if( strstr(class, "videoItem") )
 	{
@@ -372,11 +415,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		{
 			last_all_objectID = get_next_available_id("OBJECTS", VIDEO_ALL_ID);
 		}
-		sql_exec(db, "INSERT into OBJECTS"
-		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-		             "VALUES"
-		             " ('"VIDEO_ALL_ID"$%llX', '"VIDEO_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		insert_item(VIDEO_ALL_ID, last_all_objectID++, refID, class, detailID, name);
 		return;
 	}
 	else
@@ -392,13 +431,14 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 {
 	int64_t detailID = 0;
 	char class[] = "container.storageFolder";
-	char *result, *p;
+	char id_buf[64], parent_buf[64];
+	char *p;
 	static char last_found[256] = "-1";
 
 	if( strcmp(base, BROWSEDIR_ID) != 0 )
 	{
 		int found = 0;
-		char id_buf[64], parent_buf[64], refID[64];
+		char refID[64];
 		char *dir_buf, *dir;
 
 		dir_buf = strdup(path);
@@ -410,23 +450,19 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 		{
 			if( valid_cache && strcmp(id_buf, last_found) == 0 )
 				break;
-			if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%s'", id_buf) > 0 )
+			if( sql_get_int_param(db, "SELECT count(*) from OBJECTS where OBJECT_ID = ?", "t", id_buf) > 0 )
 			{
 				strcpy(last_found, id_buf);
 				break;
 			}
 			/* Does not exist.  Need to create, and may need to create parents also */
-			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s'", refID);
-			if( result )
-			{
-				detailID = strtoll(result, NULL, 10);
-				sqlite3_free(result);
-			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME) "
-			             "VALUES"
-			             " ('%s', '%s', %Q, %lld, '%s', '%q')",
-			             id_buf, parent_buf, refID, detailID, class, strrchr(dir, '/')+1);
+			detailID = sql_get_int64_param(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?", "t", refID);
+			if( detailID < 0 )
+				detailID = 0;
+			sql_exec_param(db, "INSERT into OBJECTS"
+			                   " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
+			                   "VALUES (?, ?, ?, ?, ?, ?)",
+			               "ttttIt", id_buf, parent_buf, refID, class, detailID, strrchr(dir, '/')+1);
 			if( (p = strrchr(id_buf, '$')) )
 				*p = '\0';
 			if( (p = strrchr(parent_buf, '$')) )
@@ -440,11 +476,12 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 	}
 
 	detailID = GetFolderMetadata(name, path, NULL, NULL, find_album_art(path, NULL, 0));
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME) "
-	             "VALUES"
-	             " ('%s%s$%X', '%s%s', %lld, '%s', '%q')",
-	             base, parentID, objectID, base, parentID, detailID, class, name);
+	snprintf(id_buf, sizeof(id_buf), "%s%s$%X", base, parentID, objectID);
+	snprintf(parent_buf, sizeof(parent_buf), "%s%s", base, parentID);
+	sql_exec_param(db, "INSERT into OBJECTS"
+	                   " (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME) "
+	                   "VALUES (?, ?, ?, ?, ?)",
+	               "ttItt", id_buf, parent_buf, detailID, class, name);
 
 	return detailID;
 }
@@ -453,7 +490,7 @@ int
 insert_file(const char *name, const char *path, const char *parentID, int object, media_types types)
 {
 	const char *class;
-	char objectID[64];
+	char objectID[64], typedir[64];
 	int64_t detailID = 0;
 	char base[8];
 	char *typedir_parentID;
@@ -494,15 +531,12 @@ insert_file(const char *name, const char *path, const char *parentID, int object
 		return -1;
 	}
 
-	sprintf(objectID, "%s%s$%X", BROWSEDIR_ID, parentID, object);
+	snprintf(objectID, sizeof(objectID), "%s%s$%X", BROWSEDIR_ID, parentID, object);
 	objname = strdup(name);
 	strip_ext(objname);
 
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME) "
-	             "VALUES"
-	             " ('%s', '%s%s', '%s', %lld, '%q')",
-	             objectID, BROWSEDIR_ID, parentID, class, detailID, objname);
+	snprintf(typedir, sizeof(typedir), "%s%s", BROWSEDIR_ID, parentID);
+	insert_item(typedir, object, NULL, class, detailID, objname);
 
 	if( *parentID )
 	{
@@ -517,14 +551,12 @@ insert_file(const char *name, const char *path, const char *parentID, int object
 		insert_directory(objname, path, base, typedir_parentID, typedir_objectID);
 		free(typedir_parentID);
 	}
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-	             "VALUES"
-	             " ('%s%s$%X', '%s%s', '%s', '%s', %lld, '%q')",
-	             base, parentID, object, base, parentID, objectID, class, detailID, objname);
+	snprintf(typedir, sizeof(typedir), "%s%s", base, parentID);
+	insert_item(typedir, object, objectID, class, detailID, objname);
 
 	insert_containers(objname, path, objectID, class, detailID);
 	free(objname);
+	scan_batch_file();
 
 	return 0;
 }
@@ -579,6 +611,21 @@ CreateDatabase(void)
 	ret = sql_exec(db, create_settingsTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
+	ret = sql_exec(db, create_seekIndexTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_childCountTriggers_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	/* Quietly, since not every SQLite can */
+	if( sqlite3_exec(db, create_fulltextTable_sqlite, NULL, NULL, NULL) == SQLITE_OK )
+	{
+		ret = sql_exec(db, create_fulltextTriggers_sqlite);
+		if( ret != SQLITE_OK )
+			goto sql_failed;
+	}
+	else
+		DPRINTF(E_INFO, L_DB_SQL, "SQLite has no FTS5 trigram tokenizer; \"contains\" searches will scan\n");
 	ret = sql_exec(db, "INSERT into SETTINGS values ('UPDATE_ID', '0')");
 	if( ret != SQLITE_OK )
 		goto sql_failed;
@@ -984,6 +1031,7 @@ start_rescan(void)
 	}
 
 	/* Rescan media_paths for new and/or modified files */
+	scan_batch_begin();
 	for (media_path = media_dirs; media_path != NULL; media_path = media_path->next)
 	{
 		char path[MAXPATHLEN], buf[MAXPATHLEN];
@@ -993,6 +1041,7 @@ start_rescan(void)
 		monitor_insert_directory(0, esc_name, path);
 		free(esc_name);
 	}
+	scan_batch_end();
 	fill_playlists();
 
 	if (sqlite3_total_changes(db) != changes)
@@ -1010,6 +1059,7 @@ start_rebuild()
 	char path[MAXPATHLEN];
 	char *parent_id = NULL;
 
+	scan_batch_begin();
 	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
 	{
 		int64_t id;
@@ -1041,6 +1091,7 @@ start_rebuild()
 			parent_id = NULL;
 		}
 	}
+	scan_batch_end();
 	/* Create this index after scanning, so it doesn't slow down the scanning process.
 	 * This index is very useful for large libraries used with an XBox360 (or any
 	 * client that uses UPnPSearch on large containers). */
@@ -1061,7 +1112,7 @@ start_scanner()
 	DPRINTF(E_DEBUG, L_SCANNER,  "Starting Media Scan\n");
 #if USE_FORK
 	SETFLAG(SCANNING_MASK);
-	sqlite3_close(db);
+	sql_close(db);
 	scanner_pid = fork();
 	open_db(&db);
 	if(scanner_pid > 0) { // parent process (doesn't need to do anything)
@@ -1087,9 +1138,87 @@ start_scanner()
 
 #if USE_FORK
 	if(scanner_pid == 0) { // child (scanner) process
-		sqlite3_close(db);
+		sql_close(db);
 		log_close();
 		exit(EXIT_SUCCESS);
 	}
 #endif
 }
+
+/* Time a full rebuild of the media_dirs into a scratch database, once
+ * committing every statement on its own and once in batches.  Each
+ * runs in a process of its own like the real scanner.  The first pass
+ * also pulls the files into the page cache, which flatters the second;
+ * run it again to compare warm numbers. */
+int
+scan_bench(void)
+{
+	static const struct {
+		const char *name;
+		int size;
+	} runs[] = {
+		{ "unbatched", 0 },
+		{ "batched", SCAN_BATCH_FILES },
+	};
+	char dir[] = "/tmp/minidlna-bench.XXXXXX";
+	char cmd[PATH_MAX];
+	struct timespec start, end;
+	double secs;
+	int files, status;
+	unsigned int i;
+	pid_t pid;
+
+	if (!mkdtemp(dir))
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Failed to create a scratch directory: %s\n", strerror(errno));
+		return 1;
+	}
+	strncpyt(db_path, dir, sizeof(db_path));
+	setlocale(LC_COLLATE, "");
+
+	for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+	{
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db* %s/art_cache", dir, dir);
+		if (system(cmd) != 0)
+			break;
+		open_db(NULL);
+		if (CreateDatabase() != 0)
+		{
+			DPRINTF(E_ERROR, L_SCANNER, "Failed to create the scratch database\n");
+			sql_close(db);
+			break;
+		}
+		sql_close(db);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pid = fork();
+		if (pid == 0)
+		{
+			open_db(NULL);
+			batch.size = runs[i].size;
+			start_rebuild();
+			sql_close(db);
+			exit(EXIT_SUCCESS);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			DPRINTF(E_ERROR, L_SCANNER, "The %s scan failed\n", runs[i].name);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		open_db(NULL);
+		files = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME is not NULL");
+		sql_close(db);
+		secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%-10s %d files in %.2f seconds: %.1f files/sec\n",
+		       runs[i].name, files, secs, secs > 0 ? files / secs : 0.0);
+	}
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		DPRINTF(E_WARN, L_SCANNER, "Failed to remove %s\n", dir);
+
+	return (i == sizeof(runs) / sizeof(runs[0])) ? 0 : 1;
+}
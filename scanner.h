@@ -83,6 +83,12 @@ CreateDatabase(void);
 void
 start_scanner();
 
+/* scan_bench()
+ * rebuild the media_dirs into a scratch database with and without
+ * batched transactions, and print how many files/sec each managed */
+int
+scan_bench(void);
+
 void
 GenerateMTA(const char *videopath);
 
@@ -29,9 +29,28 @@ char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"REF_ID TEXT DEFAULT NULL, "
 					"CLASS TEXT NOT NULL, "
 					"DETAIL_ID INTEGER DEFAULT NULL, "
-					"NAME TEXT DEFAULT NULL"
+					"NAME TEXT DEFAULT NULL, "
+					"CHILD_COUNT INTEGER DEFAULT 0"
 					");";
 
+/* Containers carry their number of children, for childCount and
+ * TotalMatches.  SQLite keeps it in step with every insert and delete,
+ * in the same transaction, whichever code path made them.  A container
+ * can be added after its children (insert_directory() creates missing
+ * parents bottom up), so a new one counts what is already there. */
+char create_childCountTriggers_sqlite[] =
+					"CREATE TRIGGER OBJECTS_CHILD_ADD AFTER INSERT ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1 where OBJECT_ID = new.PARENT_ID; "
+					"END; "
+					"CREATE TRIGGER OBJECTS_CONTAINER_ADD AFTER INSERT ON OBJECTS "
+					"WHEN new.CLASS glob 'container*' BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = (SELECT count(*) from OBJECTS c where c.PARENT_ID = new.OBJECT_ID) "
+					"where ID = new.ID; "
+					"END; "
+					"CREATE TRIGGER OBJECTS_CHILD_DEL AFTER DELETE ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1 where OBJECT_ID = old.PARENT_ID; "
+					"END;";
+
 char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
 					"PATH TEXT DEFAULT NULL, "
@@ -69,6 +88,32 @@ char create_captionTable_sqlite[] = "CREATE TABLE CAPTIONS ("
 					"PATH TEXT NOT NULL"
 					");";
 
+/* Optional substring index for "contains" searches.  The trigram
+ * tokenizer answers LIKE '%x%' from the index, with the same results
+ * as on DETAILS itself.  It needs an SQLite with FTS5 (3.34 or later
+ * for trigram); without it the table isn't created and searches scan
+ * DETAILS as before. */
+char create_fulltextTable_sqlite[] = "CREATE VIRTUAL TABLE DETAILS_FTS USING fts5("
+					"TITLE, ARTIST, ALBUM, GENRE, CREATOR, COMMENT, "
+					"content='DETAILS', content_rowid='ID', tokenize='trigram'"
+					");";
+
+char create_fulltextTriggers_sqlite[] =
+					"CREATE TRIGGER DETAILS_FTS_ADD AFTER INSERT ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (rowid, TITLE, ARTIST, ALBUM, GENRE, CREATOR, COMMENT) "
+					"VALUES (new.ID, new.TITLE, new.ARTIST, new.ALBUM, new.GENRE, new.CREATOR, new.COMMENT); "
+					"END; "
+					"CREATE TRIGGER DETAILS_FTS_DEL AFTER DELETE ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, ARTIST, ALBUM, GENRE, CREATOR, COMMENT) "
+					"VALUES ('delete', old.ID, old.TITLE, old.ARTIST, old.ALBUM, old.GENRE, old.CREATOR, old.COMMENT); "
+					"END; "
+					"CREATE TRIGGER DETAILS_FTS_UPD AFTER UPDATE OF TITLE, ARTIST, ALBUM, GENRE, CREATOR, COMMENT ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, ARTIST, ALBUM, GENRE, CREATOR, COMMENT) "
+					"VALUES ('delete', old.ID, old.TITLE, old.ARTIST, old.ALBUM, old.GENRE, old.CREATOR, old.COMMENT); "
+					"INSERT into DETAILS_FTS (rowid, TITLE, ARTIST, ALBUM, GENRE, CREATOR, COMMENT) "
+					"VALUES (new.ID, new.TITLE, new.ARTIST, new.ALBUM, new.GENRE, new.CREATOR, new.COMMENT); "
+					"END;";
+
 char create_bookmarkTable_sqlite[] = "CREATE TABLE BOOKMARKS ("
 					"ID INTEGER PRIMARY KEY, "
 					"SEC INTEGER, "
@@ -89,6 +134,12 @@ char create_playlistTable_sqlite[] = "CREATE TABLE PLAYLISTS ("
 					"TIMESTAMP INTEGER DEFAULT 0"
 					");";
 
+char create_seekIndexTable_sqlite[] = "CREATE TABLE SEEK_INDEX ("
+					"ID INTEGER PRIMARY KEY, "
+					"DURATION INTEGER, "
+					"ENTRIES BLOB NOT NULL"
+					");";
+
 char create_settingsTable_sqlite[] = "CREATE TABLE SETTINGS ("
 					"KEY TEXT NOT NULL, "
 					"VALUE TEXT"
@@ -0,0 +1,575 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "search.h"
+#include "upnpglobalvars.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * SearchCriteria, as the ContentDirectory spec has it:
+ *
+ *   searchCrit ::= searchExp | '*'
+ *   searchExp  ::= relExp | searchExp logOp searchExp | '(' searchExp ')'
+ *   logOp      ::= 'and' | 'or'
+ *   relExp     ::= property binOp quotedVal | property 'exists' boolVal
+ *   binOp      ::= '=' | '!=' | '<' | '<=' | '>' | '>=' |
+ *                  'contains' | 'doesNotContain' | 'derivedfrom'
+ *
+ * with 'and' binding tighter than 'or'.  Clients send it with the XML
+ * entities still in (&quot;, &lt;, ...), and some leave class names
+ * unquoted, so the tokenizer takes both.  Values never go into the
+ * SQL; they are bound.
+ */
+
+enum token_type {
+	T_END,
+	T_ERROR,
+	T_LPAREN,
+	T_RPAREN,
+	T_WORD,
+	T_STRING,
+	T_OP
+};
+
+enum search_op {
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+	OP_CONTAINS,
+	OP_NOT_CONTAINS,
+	OP_DERIVED,
+	OP_EXISTS
+};
+
+static const char *relops[] = { "=", "!=", "<", "<=", ">", ">=" };
+
+struct lexer {
+	const char	*s;
+	enum token_type	 type;
+	enum search_op	 op;	/* T_OP */
+	char		*text;	/* T_WORD, T_STRING */
+};
+
+static const struct search_property {
+	const char *name;
+	const char *column;
+	const char *fulltext;	/* DETAILS_FTS column */
+} properties[] = {
+	{ "@id",         "OBJECT_ID", NULL },
+	{ "@refID",      "REF_ID",    NULL },
+	{ "@parentID",   "PARENT_ID", NULL },
+	{ "upnp:class",  "o.CLASS",   NULL },
+	{ "dc:title",    "d.TITLE",   "TITLE" },
+	{ "dc:creator",  "d.CREATOR", "CREATOR" },
+	{ "dc:date",     "d.DATE",    NULL },
+	{ "upnp:artist", "d.ARTIST",  "ARTIST" },
+	{ "upnp:actor",  "d.ARTIST",  "ARTIST" },
+	{ "upnp:album",  "d.ALBUM",   "ALBUM" },
+	{ "upnp:genre",  "d.GENRE",   "GENRE" },
+	{ NULL, NULL, NULL }
+};
+
+enum node_type {
+	N_AND,
+	N_OR,
+	N_REL
+};
+
+struct search_node {
+	enum node_type			 type;
+	struct search_node		*left, *right;
+	const struct search_property	*prop;
+	enum search_op			 op;
+	char				*value;
+	int				 exists;
+};
+
+/* A string that grows as needed */
+static int
+append(struct string_s *b, const char *data, int len)
+{
+	char *p;
+	int size;
+
+	if (b->off + len + 1 > b->size)
+	{
+		size = MAX(b->size * 2, b->off + len + 64);
+		p = realloc(b->data, size);
+		if (!p)
+			return -1;
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->off, data, len);
+	b->off += len;
+	b->data[b->off] = '\0';
+
+	return 0;
+}
+
+static int
+__attribute__((__format__ (__printf__, 2, 3)))
+appendf(struct string_s *b, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= sizeof(buf))
+		return -1;
+
+	return append(b, buf, len);
+}
+
+static int
+entity(const char *s, const char *name)
+{
+	int len = strlen(name);
+
+	return (strncmp(s, name, len) == 0) ? len : 0;
+}
+
+/* A quoted value, up to the closing quote.  An escaped double quote
+ * becomes &amp;quot;, as the scanner stores it. */
+static char *
+lex_string(struct lexer *lx, int apos)
+{
+	struct string_s b = { NULL, 0, 0 };
+	const char *s = lx->s;
+	int n, ret = 0;
+
+	while (ret == 0)
+	{
+		if (!*s)
+		{
+			free(b.data);
+			return NULL;
+		}
+		if (!apos && *s == '"')
+		{
+			s++;
+			break;
+		}
+		if (apos && *s == '\'')
+		{
+			s++;
+			break;
+		}
+		if ((n = entity(s, apos ? "&apos;" : "&quot;")))
+		{
+			s += n;
+			break;
+		}
+		if (*s == '\\' && s[1] == '"')
+		{
+			ret = append(&b, "&amp;quot;", 10);
+			s += 2;
+		}
+		else if (*s == '\\' && (n = entity(s + 1, "&quot;")))
+		{
+			ret = append(&b, "&amp;quot;", 10);
+			s += 1 + n;
+		}
+		else if (*s == '\\' && s[1] == '\\')
+		{
+			ret = append(&b, "\\", 1);
+			s += 2;
+		}
+		else if ((n = entity(s, "&apos;")))
+		{
+			ret = append(&b, "'", 1);
+			s += n;
+		}
+		else
+			ret = append(&b, s++, 1);
+	}
+	if (ret != 0 || (!b.data && append(&b, "", 0) != 0))
+	{
+		free(b.data);
+		return NULL;
+	}
+	lx->s = s;
+
+	return b.data;
+}
+
+static int
+is_word_end(const char *s)
+{
+	return (!*s || isspace(*s) || strchr("()\"'=!<>", *s) ||
+	        entity(s, "&quot;") || entity(s, "&apos;") ||
+	        entity(s, "&lt;") || entity(s, "&gt;"));
+}
+
+static void
+lex_next(struct lexer *lx)
+{
+	static const struct {
+		const char *text;
+		enum search_op op;
+	} ops[] = {
+		{ "!=", OP_NE }, { "<=", OP_LE }, { ">=", OP_GE },
+		{ "&lt;=", OP_LE }, { "&gt;=", OP_GE },
+		{ "=", OP_EQ }, { "<", OP_LT }, { ">", OP_GT },
+		{ "&lt;", OP_LT }, { "&gt;", OP_GT },
+		{ NULL, 0 }
+	}, words[] = {
+		{ "contains", OP_CONTAINS },
+		{ "doesNotContain", OP_NOT_CONTAINS },
+		{ "derivedfrom", OP_DERIVED },
+		{ "exists", OP_EXISTS },
+		{ NULL, 0 }
+	};
+	const char *s, *start;
+	int i, n, apos = 0;
+
+	free(lx->text);
+	lx->text = NULL;
+	s = lx->s;
+	while (isspace(*s))
+		s++;
+	lx->s = s;
+
+	if (!*s)
+	{
+		lx->type = T_END;
+		return;
+	}
+	if (*s == '(' || *s == ')')
+	{
+		lx->type = (*s == '(') ? T_LPAREN : T_RPAREN;
+		lx->s = s + 1;
+		return;
+	}
+	if (*s == '"' || *s == '\'')
+	{
+		apos = (*s == '\'');
+		n = 1;
+	}
+	else if ((n = entity(s, "&quot;")) == 0 && (n = entity(s, "&apos;")))
+		apos = 1;
+	if (n)
+	{
+		lx->s = s + n;
+		lx->text = lex_string(lx, apos);
+		lx->type = lx->text ? T_STRING : T_ERROR;
+		return;
+	}
+	for (i = 0; ops[i].text; i++)
+	{
+		if ((n = entity(s, ops[i].text)))
+		{
+			lx->type = T_OP;
+			lx->op = ops[i].op;
+			lx->s = s + n;
+			return;
+		}
+	}
+
+	start = s;
+	while (!is_word_end(s))
+		s++;
+	if (s == start)
+	{
+		lx->type = T_ERROR;
+		return;
+	}
+	lx->s = s;
+	for (i = 0; words[i].text; i++)
+	{
+		if (strlen(words[i].text) == s - start &&
+		    strncasecmp(start, words[i].text, s - start) == 0)
+		{
+			lx->type = T_OP;
+			lx->op = words[i].op;
+			return;
+		}
+	}
+	lx->type = T_WORD;
+	lx->text = strndup(start, s - start);
+	if (!lx->text)
+		lx->type = T_ERROR;
+}
+
+static int
+is_word(struct lexer *lx, const char *word)
+{
+	return (lx->type == T_WORD && strcasecmp(lx->text, word) == 0);
+}
+
+static void
+free_node(struct search_node *n)
+{
+	if (!n)
+		return;
+	free_node(n->left);
+	free_node(n->right);
+	free(n->value);
+	free(n);
+}
+
+static struct search_node *parse_or(struct lexer *lx, int depth);
+
+static struct search_node *
+parse_rel(struct lexer *lx)
+{
+	struct search_node *n;
+	int i;
+
+	if (lx->type != T_WORD)
+		return NULL;
+	for (i = 0; properties[i].name; i++)
+		if (strcmp(lx->text, properties[i].name) == 0)
+			break;
+	if (!properties[i].name)
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Unhandled search property [%s]\n", lx->text);
+		return NULL;
+	}
+	n = calloc(1, sizeof(struct search_node));
+	if (!n)
+		return NULL;
+	n->type = N_REL;
+	n->prop = &properties[i];
+
+	lex_next(lx);
+	if (lx->type != T_OP)
+		goto error;
+	n->op = lx->op;
+	lex_next(lx);
+	if (n->op == OP_EXISTS)
+	{
+		if (is_word(lx, "true"))
+			n->exists = 1;
+		else if (!is_word(lx, "false"))
+			goto error;
+	}
+	/* Class names are often sent unquoted */
+	else if (lx->type == T_STRING ||
+	         (lx->type == T_WORD && strcmp(n->prop->name, "upnp:class") == 0))
+	{
+		n->value = lx->text;
+		lx->text = NULL;
+	}
+	else
+		goto error;
+	lex_next(lx);
+
+	return n;
+error:
+	free_node(n);
+	return NULL;
+}
+
+static struct search_node *
+parse_primary(struct lexer *lx, int depth)
+{
+	struct search_node *n;
+
+	if (lx->type != T_LPAREN)
+		return parse_rel(lx);
+	if (depth >= SEARCH_MAX_DEPTH)
+		return NULL;
+	lex_next(lx);
+	n = parse_or(lx, depth + 1);
+	if (!n || lx->type != T_RPAREN)
+	{
+		free_node(n);
+		return NULL;
+	}
+	lex_next(lx);
+
+	return n;
+}
+
+static struct search_node *
+parse_binary(struct lexer *lx, int depth, const char *word, enum node_type type)
+{
+	struct search_node *n, *right, *op;
+
+	n = (type == N_OR) ? parse_binary(lx, depth, "and", N_AND) : parse_primary(lx, depth);
+	while (n && is_word(lx, word))
+	{
+		lex_next(lx);
+		right = (type == N_OR) ? parse_binary(lx, depth, "and", N_AND) : parse_primary(lx, depth);
+		op = right ? calloc(1, sizeof(struct search_node)) : NULL;
+		if (!op)
+		{
+			free_node(right);
+			free_node(n);
+			return NULL;
+		}
+		op->type = type;
+		op->left = n;
+		op->right = right;
+		n = op;
+	}
+
+	return n;
+}
+
+static struct search_node *
+parse_or(struct lexer *lx, int depth)
+{
+	return parse_binary(lx, depth, "or", N_OR);
+}
+
+static int
+emit(const struct search_node *n, struct search_criteria *sc, struct string_s *sql)
+{
+	const char *col, *value;
+	const char *not = (n->op == OP_NOT_CONTAINS) ? "not " : "";
+	char *bound;
+	int idx, ret;
+
+	if (n->type != N_REL)
+	{
+		if (append(sql, "(", 1) != 0 || emit(n->left, sc, sql) != 0)
+			return -1;
+		if (appendf(sql, " %s ", (n->type == N_AND) ? "and" : "or") != 0)
+			return -1;
+		if (emit(n->right, sc, sql) != 0 || append(sql, ")", 1) != 0)
+			return -1;
+		return 0;
+	}
+
+	col = n->prop->column;
+	if (strcmp(n->prop->name, "@parentID") == 0)
+		sc->parent = 1;
+	if (n->op == OP_EXISTS)
+		return appendf(sql, "%s is %sNULL", col, n->exists ? "not " : "");
+
+	value = n->value;
+	/* We store classes without the "object." */
+	if (strcmp(n->prop->name, "upnp:class") == 0)
+	{
+		if (strncmp(value, "object.", 7) == 0)
+			value += 7;
+		else if (strcmp(value, "object") == 0)
+			value += 6;
+	}
+	if (sc->nvalues >= SEARCH_MAX_VALUES)
+		return -1;
+	idx = sc->nvalues + 1;
+
+	switch (n->op)
+	{
+	case OP_CONTAINS:
+	case OP_NOT_CONTAINS:
+		if (xasprintf(&bound, "%%%s%%", value) < 0)
+			return -1;
+		/* DETAILS_FTS answers the same LIKE from its trigram index.
+		 * Not for doesNotContain: that reads nearly every row anyway,
+		 * and "not in" over the index is slower than the scan. */
+		if (n->prop->fulltext && GETFLAG(FULLTEXT_MASK) && !*not)
+			ret = appendf(sql, "o.DETAIL_ID in (SELECT rowid from DETAILS_FTS where %s like :v%d)",
+			              n->prop->fulltext, idx);
+		else
+			ret = appendf(sql, "%s %slike :v%d", col, not, idx);
+		break;
+	case OP_DERIVED:
+		if (xasprintf(&bound, "%s%%", value) < 0)
+			return -1;
+		ret = appendf(sql, "%s like :v%d", col, idx);
+		break;
+	default:
+		if (!(bound = strdup(value)))
+			return -1;
+		ret = appendf(sql, "%s %s :v%d", col, relops[n->op], idx);
+		break;
+	}
+	sc->values[sc->nvalues++] = bound;
+
+	return ret;
+}
+
+int
+search_compile(const char *criteria, struct search_criteria *out)
+{
+	struct lexer lx;
+	struct search_node *root;
+	struct string_s sql = { NULL, 0, 0 };
+	const char *s = criteria;
+	int ret = -1;
+
+	memset(out, 0, sizeof(*out));
+	while (s && isspace(*s))
+		s++;
+	if (!s || (*s == '*' && !s[1 + strspn(s + 1, " \t\r\n")]))
+	{
+		out->where = strdup("1 = 1");
+		return out->where ? 0 : -1;
+	}
+
+	memset(&lx, 0, sizeof(lx));
+	lx.s = s;
+	lex_next(&lx);
+	root = parse_or(&lx, 0);
+	if (root && lx.type == T_END && emit(root, out, &sql) == 0)
+	{
+		out->where = sql.data;
+		ret = 0;
+	}
+	else
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Invalid SearchCriteria at [%s]\n", lx.s);
+		free(sql.data);
+		search_free(out);
+	}
+	free(lx.text);
+	free_node(root);
+
+	return ret;
+}
+
+void
+search_bind(const struct search_criteria *sc, sqlite3_stmt *stmt)
+{
+	char name[16];
+	int i, idx;
+
+	for (i = 0; i < sc->nvalues; i++)
+	{
+		snprintf(name, sizeof(name), ":v%d", i + 1);
+		if ((idx = sqlite3_bind_parameter_index(stmt, name)))
+			sqlite3_bind_text(stmt, idx, sc->values[i], -1, SQLITE_TRANSIENT);
+	}
+}
+
+void
+search_free(struct search_criteria *sc)
+{
+	int i;
+
+	for (i = 0; i < sc->nvalues; i++)
+		free(sc->values[i]);
+	free(sc->where);
+	memset(sc, 0, sizeof(*sc));
+}
@@ -0,0 +1,47 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+#include <sqlite3.h>
+
+/* Don't let a client build arbitrarily deep or long queries */
+#define SEARCH_MAX_DEPTH	32
+#define SEARCH_MAX_VALUES	64
+
+/* A compiled UPnP SearchCriteria: an SQL condition on OBJECTS o and
+ * DETAILS d with the values left out as :v1, :v2, ...  Searches of the
+ * same shape give the same SQL, so the prepared statement is reused. */
+struct search_criteria {
+	char	*where;
+	int	 nvalues;
+	char	*values[SEARCH_MAX_VALUES];
+	int	 parent;	/* compares @parentID */
+};
+
+/* search_compile()
+ * parse criteria (NULL or "*" for everything).  Returns 0, or -1 if
+ * it isn't valid or uses a property we don't know. */
+int search_compile(const char *criteria, struct search_criteria *out);
+
+/* search_bind()
+ * bind the values to a statement using the condition */
+void search_bind(const struct search_criteria *sc, sqlite3_stmt *stmt);
+
+void search_free(struct search_criteria *sc);
+
+#endif
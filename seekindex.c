@@ -0,0 +1,184 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "seekindex.h"
+#include "sql.h"
+#include "log.h"
+
+/*
+ * Time -> byte offset index for the keyframes of a video, built by the
+ * scanner and used for DLNA TimeSeekRange requests.  It is stored in
+ * SEEK_INDEX as a blob of 16-byte little-endian records, thinned to
+ * one keyframe per SEEK_INDEX_INTERVAL.
+ *
+ * For MPEG program and transport streams the scanner also records how
+ * many bytes each keyframe spans, which is enough to send nothing but
+ * the I-frames for PlaySpeed trick mode.
+ */
+#define RECORD_SIZE 16
+
+static void
+put_le(unsigned char *p, uint64_t v, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static uint64_t
+get_le(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+
+	while (bytes--)
+		v = (v << 8) | p[bytes];
+	return v;
+}
+
+int
+seekindex_add(struct seek_index *idx, uint32_t ms, int64_t offset, uint32_t len)
+{
+	struct seek_entry *e;
+
+	if (idx->count &&
+	    (ms < idx->entries[idx->count-1].ms + SEEK_INDEX_INTERVAL ||
+	     offset <= idx->entries[idx->count-1].offset))
+		return 0;
+	if (idx->count >= idx->alloc)
+	{
+		e = realloc(idx->entries, (idx->alloc ? idx->alloc * 2 : 64) * sizeof(*e));
+		if (!e)
+			return 0;
+		idx->entries = e;
+		idx->alloc = idx->alloc ? idx->alloc * 2 : 64;
+	}
+	e = &idx->entries[idx->count++];
+	e->ms = ms;
+	e->len = len;
+	e->offset = offset;
+
+	return 1;
+}
+
+int
+seekindex_save(sqlite3 *db, int64_t detailID, const struct seek_index *idx)
+{
+	sqlite3_stmt *stmt;
+	unsigned char *blob, *p;
+	int i, ret;
+
+	if (!idx->count)
+		return 0;
+	blob = malloc(idx->count * RECORD_SIZE);
+	if (!blob)
+		return -1;
+	for (i = 0, p = blob; i < idx->count; i++, p += RECORD_SIZE)
+	{
+		put_le(p, idx->entries[i].ms, 4);
+		put_le(p + 4, idx->entries[i].len, 4);
+		put_le(p + 8, idx->entries[i].offset, 8);
+	}
+
+	ret = sqlite3_prepare_v2(db, "INSERT OR REPLACE into SEEK_INDEX (ID, DURATION, ENTRIES)"
+	                             " values (?, ?, ?)", -1, &stmt, NULL);
+	if (ret == SQLITE_OK)
+	{
+		sqlite3_bind_int64(stmt, 1, detailID);
+		sqlite3_bind_int64(stmt, 2, idx->duration);
+		sqlite3_bind_blob(stmt, 3, blob, idx->count * RECORD_SIZE, SQLITE_STATIC);
+		ret = sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	}
+	free(blob);
+	if (ret != SQLITE_DONE)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Error saving seek index for %lld: %s\n",
+			(long long)detailID, sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+seekindex_load(sqlite3 *db, int64_t detailID, struct seek_index *idx)
+{
+	sqlite3_stmt *stmt;
+	const unsigned char *p;
+	int i, len, ret = -1;
+
+	memset(idx, 0, sizeof(*idx));
+	if (sqlite3_prepare_v2(db, "SELECT DURATION, ENTRIES from SEEK_INDEX where ID = ?",
+	                       -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+	sqlite3_bind_int64(stmt, 1, detailID);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		p = sqlite3_column_blob(stmt, 1);
+		len = sqlite3_column_bytes(stmt, 1) / RECORD_SIZE;
+		if (p && len > 0 && (idx->entries = malloc(len * sizeof(struct seek_entry))))
+		{
+			idx->duration = sqlite3_column_int64(stmt, 0);
+			idx->count = idx->alloc = len;
+			for (i = 0; i < len; i++, p += RECORD_SIZE)
+			{
+				idx->entries[i].ms = get_le(p, 4);
+				idx->entries[i].len = get_le(p + 4, 4);
+				idx->entries[i].offset = get_le(p + 8, 8);
+			}
+			ret = 0;
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+int
+seekindex_find(const struct seek_index *idx, uint32_t ms)
+{
+	int lo = 0, hi = idx->count - 1, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi + 1) / 2;
+		if (idx->entries[mid].ms <= ms)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+void
+seekindex_free(struct seek_index *idx)
+{
+	free(idx->entries);
+	memset(idx, 0, sizeof(*idx));
+}
+
+int
+seekindex_trickmode(const char *mime)
+{
+	return (strcmp(mime, "video/mpeg") == 0 ||
+	        strcmp(mime, "video/vnd.dlna.mpeg-tts") == 0);
+}
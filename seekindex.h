@@ -0,0 +1,66 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SEEKINDEX_H__
+#define __SEEKINDEX_H__
+
+#include <stdint.h>
+#include <sqlite3.h>
+
+/* Keep at most one keyframe per interval (milliseconds) */
+#define SEEK_INDEX_INTERVAL	1000
+
+/* PlaySpeeds offered for I-frame trick mode (DLNA.ORG_PS) */
+#define SEEK_INDEX_SPEEDS	"-16,-8,-4,-2,2,4,8,16"
+
+/* A keyframe: where it starts in the file, and how many bytes it
+ * spans (0 if unknown). */
+struct seek_entry {
+	uint32_t	ms;
+	uint32_t	len;
+	int64_t		offset;
+};
+
+struct seek_index {
+	uint32_t		 duration;	/* milliseconds */
+	int			 count;
+	int			 alloc;
+	struct seek_entry	*entries;
+};
+
+/* seekindex_add()
+ * append a keyframe found while scanning, in presentation order.
+ * Returns 1 if it was kept, 0 if it was too close to the last one. */
+int seekindex_add(struct seek_index *idx, uint32_t ms, int64_t offset, uint32_t len);
+
+/* seekindex_save() / seekindex_load()
+ * store the index for a DETAILS row, or read it back.  load() returns
+ * 0 on success, -1 if there is no index. */
+int seekindex_save(sqlite3 *db, int64_t detailID, const struct seek_index *idx);
+int seekindex_load(sqlite3 *db, int64_t detailID, struct seek_index *idx);
+
+/* seekindex_find()
+ * the last keyframe at or before ms (the first one if there is none) */
+int seekindex_find(const struct seek_index *idx, uint32_t ms);
+
+void seekindex_free(struct seek_index *idx);
+
+/* seekindex_trickmode()
+ * whether the index for this MIME type knows how long each keyframe
+ * is, so fast forward and rewind can be served from it */
+int seekindex_trickmode(const char *mime);
+
+#endif
@@ -16,9 +16,11 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "sql.h"
@@ -262,10 +264,319 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	return str;
 }
 
+/*
+ * Prepared statements for the fixed-shape queries, kept by connection
+ * and SQL text so SQLite doesn't parse and plan them again on every
+ * use.  Each thread has its own connection, so an entry is only ever
+ * found by the thread that prepared it; the cache itself is shared,
+ * hence the lock.  A statement is handed to one user at a time; if it
+ * is already out (a streamed Browse holds one while the client reads)
+ * the caller gets a private one, finalized on release.
+ */
+struct sql_stmt_entry {
+	sqlite3		*db;
+	char		*sql;
+	sqlite3_stmt	*stmt;
+	int		 busy;
+	unsigned int	 used;		/* for LRU */
+};
+
+static struct sql_stmt_entry stmt_cache[SQL_STMT_CACHE];
+static unsigned int stmt_clock;
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+sqlite3_stmt *
+sql_prepare(sqlite3 *db, const char *sql)
+{
+	struct sql_stmt_entry *e, *victim = NULL;
+	sqlite3_stmt *stmt;
+	int i, out = 0;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		e = &stmt_cache[i];
+		if (e->stmt && e->db == db && strcmp(e->sql, sql) == 0)
+		{
+			if (e->busy)
+			{
+				out = 1;
+				break;
+			}
+			e->busy = 1;
+			e->used = ++stmt_clock;
+			pthread_mutex_unlock(&stmt_lock);
+			return e->stmt;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		return NULL;
+	}
+	if (out)
+		return stmt;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		e = &stmt_cache[i];
+		if (!e->stmt)
+		{
+			victim = e;
+			break;
+		}
+		if (!e->busy && (!victim || e->used < victim->used))
+			victim = e;
+	}
+	if (victim)
+	{
+		char *copy = strdup(sql);
+		if (copy)
+		{
+			if (victim->stmt)
+			{
+				sqlite3_finalize(victim->stmt);
+				free(victim->sql);
+			}
+			victim->db = db;
+			victim->sql = copy;
+			victim->stmt = stmt;
+			victim->busy = 1;
+			victim->used = ++stmt_clock;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+
+	return stmt;
+}
+
+void
+sql_release(sqlite3_stmt *stmt)
+{
+	int i;
+
+	if (!stmt)
+		return;
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (stmt_cache[i].stmt == stmt)
+		{
+			stmt_cache[i].busy = 0;
+			pthread_mutex_unlock(&stmt_lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+	sqlite3_finalize(stmt);
+}
+
+void
+sql_close(sqlite3 *db)
+{
+	int i;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (!stmt_cache[i].stmt || stmt_cache[i].db != db)
+			continue;
+		if (stmt_cache[i].busy)
+			DPRINTF(E_WARN, L_DB_SQL, "closing with a statement in use: %s\n", stmt_cache[i].sql);
+		sqlite3_finalize(stmt_cache[i].stmt);
+		free(stmt_cache[i].sql);
+		memset(&stmt_cache[i], 0, sizeof(stmt_cache[i]));
+	}
+	pthread_mutex_unlock(&stmt_lock);
+	sqlite3_close(db);
+}
+
+/* Bind the arguments to the statement's parameters in order, as
+ * described by types: 't' a string (NULL binds NULL), 'i' an int,
+ * 'I' an int64_t. */
+static int
+sql_bind(sqlite3_stmt *stmt, const char *types, va_list ap)
+{
+	int i, ret = SQLITE_OK;
+
+	for (i = 1; types[i-1] && ret == SQLITE_OK; i++)
+	{
+		switch (types[i-1])
+		{
+		case 't':
+			ret = sqlite3_bind_text(stmt, i, va_arg(ap, const char *), -1, SQLITE_STATIC);
+			break;
+		case 'i':
+			ret = sqlite3_bind_int(stmt, i, va_arg(ap, int));
+			break;
+		case 'I':
+			ret = sqlite3_bind_int64(stmt, i, va_arg(ap, int64_t));
+			break;
+		default:
+			ret = SQLITE_MISUSE;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/* Prepare (or reuse) sql, bind the arguments and take the first step.
+ * Returns the sqlite3_step() result, with *stmt to be released by the
+ * caller, or -1 with *stmt NULL. */
+static int
+sql_query_param(sqlite3 *db, sqlite3_stmt **stmt, const char *sql, const char *types, va_list ap)
+{
+	int counter, result;
+
+	*stmt = sql_prepare(db, sql);
+	if (!*stmt)
+		return -1;
+	if (sql_bind(*stmt, types, ap) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "bind failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		sql_release(*stmt);
+		*stmt = NULL;
+		return -1;
+	}
+
+	for (counter = 0;
+	     ((result = sqlite3_step(*stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
+	     counter++)
+	{
+		/* While SQLITE_BUSY has a built in timeout,
+		 * SQLITE_LOCKED does not, so sleep */
+		if (result == SQLITE_LOCKED)
+			sleep(1);
+	}
+	if (result != SQLITE_ROW && result != SQLITE_DONE)
+		DPRINTF(E_WARN, L_DB_SQL, "step failed: %d - %s\n%s\n", result, sqlite3_errmsg(db), sql);
+
+	return result;
+}
+
+int
+sql_exec_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int ret;
+
+	va_start(ap, types);
+	ret = sql_query_param(db, &stmt, sql, types, ap);
+	va_end(ap);
+	sql_release(stmt);
+
+	return (ret == SQLITE_DONE || ret == SQLITE_ROW) ? SQLITE_OK : ret;
+}
+
+int
+sql_get_int_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int ret;
+
+	va_start(ap, types);
+	ret = sql_query_param(db, &stmt, sql, types, ap);
+	va_end(ap);
+	if (ret == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	else
+		ret = (ret == SQLITE_DONE) ? 0 : -1;
+	sql_release(stmt);
+
+	return ret;
+}
+
+int64_t
+sql_get_int64_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int64_t ret;
+	int result;
+
+	va_start(ap, types);
+	result = sql_query_param(db, &stmt, sql, types, ap);
+	va_end(ap);
+	if (result == SQLITE_ROW)
+		ret = sqlite3_column_int64(stmt, 0);
+	else
+		ret = (result == SQLITE_DONE) ? 0 : -1;
+	sql_release(stmt);
+
+	return ret;
+}
+
+char *
+sql_get_text_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	char *str = NULL;
+	int ret;
+
+	va_start(ap, types);
+	ret = sql_query_param(db, &stmt, sql, types, ap);
+	va_end(ap);
+	if (ret == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		str = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(stmt, 0));
+	sql_release(stmt);
+
+	return str;
+}
+
+int
+sql_begin(sqlite3 *db)
+{
+	int ret, tries = 0;
+
+	/* The busy handler isn't consulted for a write that finds its
+	 * snapshot out of date (SQLITE_BUSY_SNAPSHOT), so take the write
+	 * lock before the first read; only this wait can be retried. */
+	do
+		ret = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, NULL);
+	while (ret == SQLITE_BUSY && ++tries < SQL_BEGIN_TRIES);
+	if (ret != SQLITE_OK)
+		DPRINTF(E_WARN, L_DB_SQL, "BEGIN failed: %s\n", sqlite3_errmsg(db));
+
+	return ret;
+}
+
+int
+sql_changes(sqlite3 *db)
+{
+	int version;
+
+	/* data_version only moves for commits by other connections */
+	version = sql_get_int_field(db, "PRAGMA data_version");
+	if (version < 0)
+		version = 0;
+
+	return sqlite3_total_changes(db) + version;
+}
+
+int
+sql_fulltext(sqlite3 *db)
+{
+	if (sql_get_int_field(db, "SELECT count(*) from sqlite_master"
+	                          " where type = 'table' and name = 'DETAILS_FTS'") != 1)
+		return 0;
+	/* Created by an SQLite that had FTS5, but do we? */
+	return (sql_get_int_field(db, "SELECT count(*) from DETAILS_FTS where rowid = 0") >= 0);
+}
+
 int
 open_db(sqlite3 **sq3)
 {
 	char path[PATH_MAX];
+	char *mode;
 	int new_db = 0;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
@@ -280,8 +591,23 @@ open_db(sqlite3 **sq3)
 		*sq3 = db;
 	sqlite3_busy_timeout(db, 5000);
 	sql_exec(db, "pragma page_size = 4096");
-	sql_exec(db, "pragma journal_mode = OFF");
-	sql_exec(db, "pragma synchronous = OFF;");
+	/* With a write-ahead log, a reader keeps a consistent snapshot
+	 * while the scanner or inotify writes, and doesn't hold them up.
+	 * Fall back to no journal where WAL can't work (no shared memory
+	 * on network filesystems, or an SQLite before 3.7.0). */
+	mode = sql_get_text_field(db, "pragma journal_mode = WAL");
+	if (mode && strcmp(mode, "wal") == 0)
+	{
+		SETFLAG(WAL_MASK);
+		sql_exec(db, "pragma synchronous = NORMAL;");
+	}
+	else
+	{
+		CLEARFLAG(WAL_MASK);
+		sql_exec(db, "pragma journal_mode = OFF");
+		sql_exec(db, "pragma synchronous = OFF;");
+	}
+	sqlite3_free(mode);
 	sql_exec(db, "pragma default_cache_size = 8192;");
 
 	return new_db;
@@ -317,6 +643,22 @@ db_upgrade(sqlite3 *db)
 		if (ret != SQLITE_OK)
 			return 10;
 	}
+	if (db_vers < 12)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 12);
+		ret = sql_exec(db, "CREATE TABLE SEEK_INDEX ("
+		                   "ID INTEGER PRIMARY KEY, "
+		                   "DURATION INTEGER, "
+		                   "ENTRIES BLOB NOT NULL);");
+		if (ret != SQLITE_OK)
+			return 11;
+	}
+	/* OBJECTS.CHILD_COUNT and its triggers need every row counted */
+	if (db_vers < 13)
+		return 12;
+	/* DETAILS_FTS has to be filled from every DETAILS row */
+	if (db_vers < 14)
+		return 13;
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
 	return 0;
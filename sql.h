@@ -34,11 +34,39 @@
 #define sqlite3_prepare_v2 sqlite3_prepare
 #endif
 
+#define SQL_STMT_CACHE	32
+#define SQL_BEGIN_TRIES	3
+
 int sql_exec(sqlite3 *db, const char *fmt, ...);
 int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow, int *pnColumn);
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
 int64_t sql_get_int64_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
+
+/* Cached prepared statements.  sql_prepare() hands out a statement for
+ * sql ready to bind; sql_release() resets it for the next user.  The
+ * _param() variants take '?' parameters, bound from the arguments as
+ * described by types ('t' string, 'i' int, 'I' int64_t). */
+sqlite3_stmt *sql_prepare(sqlite3 *db, const char *sql);
+void sql_release(sqlite3_stmt *stmt);
+int sql_exec_param(sqlite3 *db, const char *sql, const char *types, ...);
+int sql_get_int_param(sqlite3 *db, const char *sql, const char *types, ...);
+int64_t sql_get_int64_param(sqlite3 *db, const char *sql, const char *types, ...);
+char * sql_get_text_param(sqlite3 *db, const char *sql, const char *types, ...);
+/* sql_begin()
+ * open a write transaction, waiting for the write lock up to
+ * SQL_BEGIN_TRIES busy timeouts.  Returns the SQLite result. */
+int sql_begin(sqlite3 *db);
+/* sql_fulltext()
+ * whether the database has the DETAILS_FTS index and we can use it */
+int sql_fulltext(sqlite3 *db);
+/* sql_changes()
+ * a count that moves whenever the database is written, through db or
+ * through any other connection */
+int sql_changes(sqlite3 *db);
+/* sql_close()
+ * finalize the cached statements for db, then close it */
+void sql_close(sqlite3 *db);
 int open_db(sqlite3 **sq3);
 int db_upgrade(sqlite3 *db);
 int db_clear(sqlite3* db);
@@ -0,0 +1,876 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
+#include "event.h"
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "streamer.h"
+#include "log.h"
+#include "sendfile.h"
+
+#define MAX_BUFFER_SIZE 2147483647
+#define MIN_BUFFER_SIZE 65536
+#define RING_SIZE 64
+#define STREAM_QUANTUM 65536	/* file bytes per turn at weight 1 */
+#define STREAM_PREBUFFER 8	/* seconds sent ahead before pacing starts */
+#define STREAM_BURST 2		/* seconds of credit a stream may save up */
+
+/*
+ * Media responses are pushed by a small, fixed pool of threads
+ * instead of a fork() per request.  The main loop parses the request,
+ * queries the database and builds the header, then passes the
+ * struct upnphttp down a pipe to the least loaded thread.  Each
+ * thread poll()s all of its (non-blocking) sockets and passes every
+ * finished transfer back up a shared pipe, so the connection
+ * accounting and the close happen on the main thread.
+ *
+ * With io_uring, each thread queues the file reads for all of its
+ * streams on its own ring and reaps them from the same poll() loop,
+ * so a slow disk only holds up the streams waiting on it.
+ *
+ * Streams take turns: each one that is writable gets a quantum of
+ * file data per round, weighted by its class and split between the
+ * streams of the same client.  Media with a known bitrate is also
+ * paced by a token bucket, at the bitrate plus pacing_headroom, after
+ * STREAM_PREBUFFER seconds sent at full speed.  A stream without
+ * credit is left out of the poll() until it has earned some.
+ *
+ * Beyond max_connections, the main loop never sends media itself.
+ * Streams wait in a bounded queue instead, and whenever a thread
+ * finishes one, the waiting client with the fewest streams running
+ * goes next.  Whoever waits past admission_timeout gets a 503.
+ */
+struct streamer {
+	pthread_t	 thread;
+	int		 pipe[2];
+	int		 load;		/* main thread only */
+#ifdef HAVE_LIBURING
+	struct io_uring	 ring;
+	int		 ring_fd;	/* eventfd for completions, -1 without a ring */
+	int		 inflight;
+#endif
+};
+
+static struct streamer *streamers;
+static int nstreamers;
+static int done_pipe[2] = { -1, -1 };
+static struct event done_ev;
+static LIST_HEAD(, upnphttp) active_streams = LIST_HEAD_INITIALIZER(active_streams);
+static TAILQ_HEAD(, upnphttp) queued_streams = TAILQ_HEAD_INITIALIZER(queued_streams);
+static int nqueued;
+
+static const int class_weight[] = { 2, 4, 1 };
+static const char *class_name[] = { "Streaming", "Interactive", "Background" };
+
+int number_of_streams = 0;
+
+void
+stream_init(struct stream *s)
+{
+	memset(s, 0, sizeof(struct stream));
+	s->fd = -1;
+	s->worker = -1;
+	s->budget = -1;
+}
+
+void
+stream_reset(struct stream *s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+	free(s->hdr);
+	free(s->body);
+	free(s->buf);
+	if (s->release)
+		s->release(s->data);
+	else
+		free(s->data);
+	free(s->ranges);
+	free(s->seps);
+	stream_init(s);
+}
+
+int
+stream_set_header(struct stream *s, const char *hdr, size_t len)
+{
+	free(s->hdr);
+	s->hdr = malloc(len);
+	if (!s->hdr)
+	{
+		s->hdr_len = 0;
+		return -1;
+	}
+	memcpy(s->hdr, hdr, len);
+	s->hdr_len = len;
+	s->hdr_off = 0;
+
+	return 0;
+}
+
+int
+stream_set_body(struct stream *s, const char *body, size_t len)
+{
+	free(s->body);
+	s->body = malloc(len);
+	if (!s->body)
+	{
+		s->body_len = 0;
+		return -1;
+	}
+	memcpy(s->body, body, len);
+	s->body_len = len;
+	s->body_off = 0;
+
+	return 0;
+}
+
+/* Move on to the next file range once the current one is sent.
+ * Returns 1 while there is file data or a separator left. */
+static int
+stream_more(struct stream *s)
+{
+	struct stream_range *r;
+
+	if (s->fd < 0)
+		return 0;
+	while (s->offset > s->end && s->range < s->nranges)
+	{
+		r = &s->ranges[s->range++];
+		s->offset = r->offset;
+		s->end = r->end;
+		s->sep = s->seps + r->sep;
+		s->sep_len = r->sep_len;
+		s->sep_off = 0;
+		/* The separator has to go out first */
+		if (s->sep_len)
+			break;
+	}
+
+	return s->offset <= s->end || s->sep_off < s->sep_len;
+}
+
+static int64_t
+stream_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Account for file data that went out */
+static void
+stream_charge(struct stream *s, off_t n)
+{
+	s->sent += n;
+	if (s->budget > 0)
+		s->budget -= MIN(n, s->budget);
+	if (s->rate)
+		s->credit -= n;
+}
+
+static int
+stream_error(void)
+{
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return EAGAIN;
+	DPRINTF(E_DEBUG, L_HTTP, "send error :: error no. %d [%s]\n", errno, strerror(errno));
+	return -1;
+}
+
+/* Send the header, the body, the current separator and whatever file
+ * data is waiting in the bounce buffer. */
+static int
+stream_send_buffers(struct stream *s, int sock)
+{
+	ssize_t n;
+
+	while (s->hdr_off < s->hdr_len)
+	{
+		n = send(sock, s->hdr + s->hdr_off, s->hdr_len - s->hdr_off,
+		         (s->body_len || s->fd >= 0 || s->fill) ? MSG_MORE : 0);
+		if (n < 0)
+			return stream_error();
+		s->hdr_off += n;
+	}
+	while (s->body_off < s->body_len)
+	{
+		n = send(sock, s->body + s->body_off, s->body_len - s->body_off, 0);
+		if (n < 0)
+			return stream_error();
+		s->body_off += n;
+	}
+	while (s->sep_off < s->sep_len)
+	{
+		n = send(sock, s->sep + s->sep_off, s->sep_len - s->sep_off,
+		         s->offset <= s->end ? MSG_MORE : 0);
+		if (n < 0)
+			return stream_error();
+		s->sep_off += n;
+	}
+	while (s->buf_off < s->buf_len)
+	{
+		n = send(sock, s->buf + s->buf_off, s->buf_len - s->buf_off, 0);
+		if (n < 0)
+			return stream_error();
+		s->buf_off += n;
+	}
+
+	return 0;
+}
+
+int
+stream_send(struct stream *s, int sock)
+{
+	ssize_t n;
+	off_t len;
+	int ret;
+
+	for (;;)
+	{
+		ret = stream_send_buffers(s, sock);
+		if (ret != 0)
+			return ret;
+		if (s->fill)
+		{
+			ret = s->fill(s);
+			if (ret > 0)
+				continue;
+			if (ret < 0)
+				return -1;
+			s->fill = NULL;
+		}
+		if (!stream_more(s))
+			break;
+		if (s->sep_off < s->sep_len)
+			continue;
+		/* This stream's turn is over */
+		if (s->budget == 0)
+			return EAGAIN;
+		len = MIN(s->end - s->offset + 1, MAX_BUFFER_SIZE);
+		if (s->budget > 0)
+			len = MIN(len, s->budget);
+		if (!s->no_sendfile)
+		{
+			n = sys_sendfile(sock, s->fd, &s->offset, len);
+			if (n > 0)
+			{
+				stream_charge(s, n);
+				continue;
+			}
+			if (n == 0)
+			{
+				DPRINTF(E_WARN, L_HTTP, "sendfile: unexpected end of file\n");
+				return -1;
+			}
+			/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
+			if (errno == EOVERFLOW || errno == EINVAL)
+				s->no_sendfile = 1;
+			else
+				return stream_error();
+		}
+		/* Fall back to regular I/O */
+		if (!s->buf && !(s->buf = malloc(MIN_BUFFER_SIZE)))
+			return -1;
+		n = pread(s->fd, s->buf, MIN(len, MIN_BUFFER_SIZE), s->offset);
+		if (n <= 0)
+		{
+			DPRINTF(E_WARN, L_HTTP, "read error :: %s\n",
+				n ? strerror(errno) : "unexpected end of file");
+			return -1;
+		}
+		s->offset += n;
+		s->buf_len = n;
+		s->buf_off = 0;
+		stream_charge(s, n);
+	}
+
+	return 0;
+}
+
+static void
+stream_finish(struct upnphttp *h)
+{
+	if (write(done_pipe[1], &h, sizeof(h)) != sizeof(h))
+		DPRINTF(E_ERROR, L_HTTP, "streamer: write(done): %s\n", strerror(errno));
+}
+
+#ifdef HAVE_LIBURING
+/* Set up the thread's ring, or leave ring_fd at -1 to stay with
+ * sendfile when the kernel can't do it. */
+static void
+streamer_ring_init(struct streamer *st)
+{
+	struct io_uring_probe *probe;
+	int ret;
+
+	st->ring_fd = -1;
+	st->inflight = 0;
+	ret = io_uring_queue_init(RING_SIZE, &st->ring, 0);
+	if (ret < 0)
+	{
+		DPRINTF(E_INFO, L_HTTP, "streamer: io_uring not available [%s], using sendfile\n", strerror(-ret));
+		return;
+	}
+	probe = io_uring_get_probe_ring(&st->ring);
+	if (!probe || !io_uring_opcode_supported(probe, IORING_OP_READ))
+	{
+		DPRINTF(E_INFO, L_HTTP, "streamer: io_uring can't read files, using sendfile\n");
+		goto error;
+	}
+	st->ring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (st->ring_fd < 0 || io_uring_register_eventfd(&st->ring, st->ring_fd) < 0)
+	{
+		DPRINTF(E_WARN, L_HTTP, "streamer: io_uring eventfd: %s\n", strerror(errno));
+		goto error;
+	}
+	io_uring_free_probe(probe);
+	return;
+error:
+	if (probe)
+		io_uring_free_probe(probe);
+	if (st->ring_fd >= 0)
+		close(st->ring_fd);
+	st->ring_fd = -1;
+	io_uring_queue_exit(&st->ring);
+}
+
+static void
+streamer_ring_reap(struct streamer *st, int wait)
+{
+	struct io_uring_cqe *cqe;
+	struct upnphttp *h;
+	struct stream *s;
+	eventfd_t n;
+
+	eventfd_read(st->ring_fd, &n);
+	while (st->inflight)
+	{
+		if (wait ? io_uring_wait_cqe(&st->ring, &cqe) : io_uring_peek_cqe(&st->ring, &cqe))
+			break;
+		h = io_uring_cqe_get_data(cqe);
+		s = &h->stream;
+		s->reading = 0;
+		st->inflight--;
+		if (cqe->res > 0)
+		{
+			s->offset += cqe->res;
+			s->buf_len = cqe->res;
+			s->buf_off = 0;
+			stream_charge(s, cqe->res);
+		}
+		else
+		{
+			DPRINTF(E_WARN, L_HTTP, "read error :: %s\n",
+				cqe->res ? strerror(-cqe->res) : "unexpected end of file");
+			/* Let the stream end here and drop the connection */
+			h->reqflags &= ~FLAG_KEEPALIVE;
+			close(s->fd);
+			s->fd = -1;
+		}
+		io_uring_cqe_seen(&st->ring, cqe);
+	}
+}
+
+static void
+streamer_ring_fini(struct streamer *st)
+{
+	if (st->ring_fd < 0)
+		return;
+	/* The buffers belong to connections the main thread frees */
+	io_uring_submit(&st->ring);
+	streamer_ring_reap(st, 1);
+	close(st->ring_fd);
+	io_uring_queue_exit(&st->ring);
+}
+#endif
+
+/* Top up the credit of a paced stream.  Returns how many ms to wait
+ * before it may send again, or 0 if it may send now. */
+static int
+stream_pace(struct stream *s, int64_t now)
+{
+	int64_t cap, low;
+
+	if (!s->rate)
+		return 0;
+	/* Whatever is left of the prebuffer isn't topped up */
+	cap = (int64_t)s->rate * STREAM_BURST;
+	if (s->credit < cap)
+		s->credit = MIN(s->credit + (now - s->stamp) * s->rate / 1000, cap);
+	s->stamp = now;
+	/* Not much point waking up for less than a quarter second's worth */
+	low = MAX(MIN(STREAM_QUANTUM, s->rate / 4), 1);
+	if (s->credit >= low)
+		return 0;
+
+	return (low - s->credit) * 1000 / s->rate + 1;
+}
+
+/* How much file data the stream may send this round */
+static off_t
+stream_quantum(struct upnphttp *h)
+{
+	struct stream *s = &h->stream;
+	off_t quantum;
+	int n;
+
+	quantum = STREAM_QUANTUM * class_weight[s->class];
+	/* The count is kept by the main thread; a stale value only
+	 * skews the share for a moment. */
+	n = h->req_client ? h->req_client->connections : 1;
+	if (n > 1)
+		quantum = MAX(quantum / n, STREAM_QUANTUM / 4);
+	if (s->rate)
+		quantum = MIN(quantum, MAX(s->credit, 1));
+
+	return quantum;
+}
+
+/* stream_send() for a streaming thread.  With a ring the file data is
+ * read asynchronously, and EINPROGRESS means a read is queued. */
+static int
+streamer_send(struct streamer *st, struct upnphttp *h)
+{
+#ifdef HAVE_LIBURING
+	struct stream *s = &h->stream;
+	struct io_uring_sqe *sqe;
+	int ret;
+#endif
+
+	h->stream.budget = stream_quantum(h);
+#ifdef HAVE_LIBURING
+	if (st->ring_fd >= 0)
+	{
+		if (s->reading)
+			return EINPROGRESS;
+		do {
+			ret = stream_send_buffers(s, h->ev.fd);
+			if (ret != 0 || !stream_more(s))
+				return ret;
+		} while (s->sep_off < s->sep_len);
+		if (s->budget == 0)
+			return EAGAIN;
+		if (!s->buf && !(s->buf = malloc(MIN_BUFFER_SIZE)))
+			return -1;
+		/* With the ring full this one just goes the old way */
+		sqe = io_uring_get_sqe(&st->ring);
+		if (sqe)
+		{
+			io_uring_prep_read(sqe, s->fd, s->buf,
+			    MIN(MIN(s->end - s->offset + 1, MIN_BUFFER_SIZE), s->budget), s->offset);
+			io_uring_sqe_set_data(sqe, h);
+			s->reading = 1;
+			st->inflight++;
+			return EINPROGRESS;
+		}
+	}
+#endif
+	return stream_send(&h->stream, h->ev.fd);
+}
+
+static void *
+streamer_thread(void *arg)
+{
+	struct streamer *st = arg;
+	struct upnphttp **active = NULL, **tmp, *h;
+	struct pollfd *pfd = NULL, *ptmp;
+	int nactive = 0, size = 0;
+	int i, n, wait, timeout;
+	int64_t now;
+
+#ifdef HAVE_LIBURING
+	streamer_ring_init(st);
+#endif
+	for (;;)
+	{
+		if (size < nactive + 1)
+		{
+			size = (nactive + 1) * 2;
+			tmp = realloc(active, size * sizeof(*active));
+			ptmp = realloc(pfd, (size + 2) * sizeof(*pfd));
+			if (tmp)
+				active = tmp;
+			if (ptmp)
+				pfd = ptmp;
+			if (!tmp || !ptmp)
+				DPRINTF(E_FATAL, L_HTTP, "streamer: out of memory. EXITING\n");
+		}
+		pfd[0].fd = st->pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = -1;
+		pfd[1].events = POLLIN;
+#ifdef HAVE_LIBURING
+		if (st->ring_fd >= 0)
+		{
+			/* One submission for everything queued last round */
+			if (io_uring_sq_ready(&st->ring))
+				io_uring_submit(&st->ring);
+			pfd[1].fd = st->ring_fd;
+		}
+#endif
+		now = stream_clock();
+		timeout = -1;
+		for (i = 0; i < nactive; i++)
+		{
+			/* Nothing to do for a stream until its read is done,
+			 * or until it has earned some credit */
+			wait = stream_pace(&active[i]->stream, now);
+			if (wait && (timeout < 0 || wait < timeout))
+				timeout = wait;
+			pfd[i+2].fd = (active[i]->stream.reading || wait) ? -1 : active[i]->ev.fd;
+			pfd[i+2].events = POLLOUT;
+		}
+
+		n = poll(pfd, nactive + 2, timeout);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			DPRINTF(E_ERROR, L_HTTP, "streamer: poll(): %s\n", strerror(errno));
+			break;
+		}
+#ifdef HAVE_LIBURING
+		if (pfd[1].revents & POLLIN)
+			streamer_ring_reap(st, 0);
+#endif
+
+		/* Walk backwards, so a finished stream can be replaced by the
+		 * tail entry, which has already been serviced. */
+		for (i = nactive - 1; i >= 0; i--)
+		{
+			if (!pfd[i+2].revents)
+				continue;
+			h = active[i];
+			n = streamer_send(st, h);
+			if (n == EAGAIN || n == EINPROGRESS)
+				continue;
+			if (n != 0)
+				h->reqflags &= ~FLAG_KEEPALIVE;
+			stream_finish(h);
+			active[i] = active[--nactive];
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		while (nactive < size && read(st->pipe[0], &h, sizeof(h)) == sizeof(h))
+		{
+			if (!h)
+				goto quit;
+			if (h->stream.prepare && h->stream.prepare(h) != 0)
+			{
+				h->reqflags &= ~FLAG_KEEPALIVE;
+				stream_finish(h);
+				continue;
+			}
+			n = streamer_send(st, h);
+			if (n != EAGAIN && n != EINPROGRESS)
+			{
+				if (n != 0)
+					h->reqflags &= ~FLAG_KEEPALIVE;
+				stream_finish(h);
+				continue;
+			}
+			active[nactive++] = h;
+		}
+	}
+quit:
+	/* Whatever is left is torn down with the connection list. */
+#ifdef HAVE_LIBURING
+	streamer_ring_fini(st);
+#endif
+	free(active);
+	free(pfd);
+
+	return NULL;
+}
+
+static void
+stream_dispatch(struct upnphttp *h)
+{
+	struct upnphttp *p = h;
+	int i, w;
+
+	for (w = 0, i = 1; i < nstreamers; i++)
+		if (streamers[i].load < streamers[w].load)
+			w = i;
+
+	h->state = 3;
+	h->stream.worker = w;
+	h->stream.started = time(NULL);
+	h->stream.stamp = stream_clock();
+	h->stream.credit = (int64_t)h->stream.rate * STREAM_PREBUFFER;
+	LIST_INSERT_HEAD(&active_streams, h, stream.active);
+	streamers[w].load++;
+	number_of_streams++;
+	if (h->req_client)
+		h->req_client->connections++;
+	if (write(streamers[w].pipe[1], &p, sizeof(p)) != sizeof(p))
+		DPRINTF(E_FATAL, L_HTTP, "streamer: write(): %s. EXITING\n", strerror(errno));
+}
+
+/* Start queued streams while there are free slots, the client with
+ * the fewest streams running first, and in order of arrival. */
+static void
+stream_admit(void)
+{
+	struct upnphttp *h, *best;
+
+	while (nqueued && number_of_streams < runtime_vars.max_connections)
+	{
+		best = NULL;
+		TAILQ_FOREACH(h, &queued_streams, stream.queue)
+		{
+			if (!best)
+				best = h;
+			else if (h->req_client && best->req_client &&
+			         h->req_client->connections < best->req_client->connections)
+				best = h;
+		}
+		TAILQ_REMOVE(&queued_streams, best, stream.queue);
+		nqueued--;
+		stream_dispatch(best);
+	}
+}
+
+/* Give a queued connection back to the main loop with a 503 */
+static void
+stream_reject(struct upnphttp *h)
+{
+	h->state = 0;
+	event_module.add(&h->ev);
+	Send503(h);
+}
+
+int
+stream_expire(void)
+{
+	struct upnphttp *h;
+	time_t now;
+
+	if (!nqueued)
+		return -1;
+	now = time(NULL);
+	while ((h = TAILQ_FIRST(&queued_streams)) && h->stream.deadline <= now)
+	{
+		DPRINTF(E_WARN, L_HTTP, "No free stream after %d seconds, responding ERROR 503\n",
+			runtime_vars.admission_timeout);
+		TAILQ_REMOVE(&queued_streams, h, stream.queue);
+		nqueued--;
+		stream_reject(h);
+	}
+	if (!h)
+		return -1;
+
+	return (h->stream.deadline - now) * 1000;
+}
+
+static void
+stream_done(struct event *ev)
+{
+	struct upnphttp *h;
+
+	while (read(done_pipe[0], &h, sizeof(h)) == sizeof(h))
+	{
+		streamers[h->stream.worker].load--;
+		number_of_streams--;
+		LIST_REMOVE(h, stream.active);
+		if (h->req_client)
+			h->req_client->connections--;
+		stream_reset(&h->stream);
+		/* Back to the main loop, which either waits for the next
+		 * request or closes the connection. */
+		h->state = 0;
+		event_module.add(&h->ev);
+		CloseSocket_upnphttp(h);
+	}
+	stream_admit();
+}
+
+void
+stream_start(struct upnphttp *h)
+{
+	/* Without any threads there is no other way */
+	if (!nstreamers)
+	{
+		if (!h->stream.prepare || h->stream.prepare(h) == 0)
+			SendStream_upnphttp(h);
+		else
+		{
+			h->reqflags &= ~FLAG_KEEPALIVE;
+			stream_reset(&h->stream);
+		}
+		CloseSocket_upnphttp(h);
+		return;
+	}
+
+	if (number_of_streams >= runtime_vars.max_connections)
+	{
+		if (nqueued >= runtime_vars.max_connections || runtime_vars.admission_timeout <= 0)
+		{
+			DPRINTF(E_WARN, L_HTTP, "Exceeded max connections [%d], responding ERROR 503\n",
+				runtime_vars.max_connections);
+			Send503(h);
+			return;
+		}
+		DPRINTF(E_INFO, L_HTTP, "Exceeded max connections [%d], queueing\n",
+			runtime_vars.max_connections);
+		event_module.del(&h->ev, 0);
+		h->state = 5;
+		h->stream.deadline = time(NULL) + runtime_vars.admission_timeout;
+		TAILQ_INSERT_TAIL(&queued_streams, h, stream.queue);
+		nqueued++;
+		return;
+	}
+
+	event_module.del(&h->ev, 0);
+	stream_dispatch(h);
+}
+
+uint32_t
+stream_rate(uint32_t bitrate)
+{
+	if (!bitrate || runtime_vars.pacing_headroom <= 0)
+		return 0;
+
+	return MIN((uint64_t)bitrate * (100 + runtime_vars.pacing_headroom) / 100, UINT32_MAX);
+}
+
+int
+stream_stats(struct stream_stat *stats, int n)
+{
+	struct upnphttp *h;
+	time_t now = time(NULL);
+	int i = 0;
+
+	LIST_FOREACH(h, &active_streams, stream.active)
+	{
+		if (i < n)
+		{
+			stats[i].h = h;
+			stats[i].class = h->stream.class;
+			stats[i].rate = h->stream.rate;
+			stats[i].sent = h->stream.sent;
+			stats[i].average = stats[i].sent / MAX(now - h->stream.started, 1);
+		}
+		i++;
+	}
+
+	return i;
+}
+
+const char *
+stream_class_name(enum stream_class class)
+{
+	return class_name[class];
+}
+
+static int
+streamer_pipe(int fds[2])
+{
+	if (pipe(fds) < 0)
+		return -1;
+	/* Readers drain until EAGAIN */
+	if (fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK) < 0 ||
+	    fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0 ||
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0)
+		return -1;
+	return 0;
+}
+
+int
+streamer_init(void)
+{
+	sigset_t set, oset;
+	int i;
+
+	nstreamers = MIN(STREAMER_THREADS, runtime_vars.max_connections);
+	if (nstreamers <= 0)
+		nstreamers = 1;
+	streamers = calloc(nstreamers, sizeof(struct streamer));
+	if (!streamers)
+		return ENOMEM;
+
+	if (streamer_pipe(done_pipe) < 0)
+		return errno;
+	done_ev = (struct event ){ .fd = done_pipe[0], .rdwr = EVENT_READ,
+	    .flags = EV_FLAG_EDGE, .process = stream_done };
+	event_module.add(&done_ev);
+
+	/* Signals are for the main loop; keep them out of the workers. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	for (i = 0; i < nstreamers; i++)
+	{
+		if (streamer_pipe(streamers[i].pipe) < 0 ||
+		    pthread_create(&streamers[i].thread, NULL, streamer_thread, &streamers[i]) != 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "streamer: failed to start thread %d\n", i);
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	nstreamers = i;
+	DPRINTF(E_DEBUG, L_HTTP, "Started %d streaming threads\n", nstreamers);
+
+	return nstreamers ? 0 : EAGAIN;
+}
+
+void
+streamer_fini(void)
+{
+	struct upnphttp *h = NULL;
+	int i;
+
+	for (i = 0; i < nstreamers; i++)
+	{
+		if (write(streamers[i].pipe[1], &h, sizeof(h)) == sizeof(h))
+			pthread_join(streamers[i].thread, NULL);
+		close(streamers[i].pipe[0]);
+		close(streamers[i].pipe[1]);
+	}
+	free(streamers);
+	streamers = NULL;
+	nstreamers = 0;
+
+	if (done_pipe[0] >= 0)
+	{
+		event_module.del(&done_ev, EV_FLAG_CLOSING);
+		close(done_pipe[0]);
+		close(done_pipe[1]);
+		done_pipe[0] = done_pipe[1] = -1;
+	}
+}
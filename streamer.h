@@ -0,0 +1,162 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __STREAMER_H__
+#define __STREAMER_H__
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <stdint.h>
+#include <time.h>
+
+#define STREAMER_THREADS	4
+
+struct upnphttp;
+struct stream;
+
+/* Priority classes, from the DLNA transfer mode */
+enum stream_class {
+	STREAM_STREAMING = 0,
+	STREAM_INTERACTIVE,
+	STREAM_BACKGROUND
+};
+
+/* Called from the worker thread before the transfer starts, for
+ * responses which need slow work (image scaling) first.  Must not
+ * touch the database or the event module.  Returns 0 to send whatever
+ * is set up in the stream, -1 to drop the connection. */
+typedef int stream_prepare_t(struct upnphttp *);
+
+/* Called from the main loop once the body has gone out, for responses
+ * generated as they are sent.  Puts the next piece in the body and
+ * returns 1, or returns 0 when there is no more, -1 to drop the
+ * connection.  Main thread only, so it may use the database. */
+typedef int stream_fill_t(struct stream *);
+
+/* Releases stream.data for a stream with a fill() */
+typedef void stream_release_t(void *);
+
+/* A further piece of the file, sent after the current one, with an
+ * optional separator (a multipart boundary) in front of it */
+struct stream_range {
+	off_t		 offset;
+	off_t		 end;		/* inclusive */
+	size_t		 sep;		/* position in stream.seps */
+	size_t		 sep_len;
+};
+
+/* One response transfer: header, optional in-memory body, optional
+ * file ranges.  Everything is owned by the stream. */
+struct stream {
+	char		*hdr;
+	size_t		 hdr_len;
+	size_t		 hdr_off;
+	char		*body;
+	size_t		 body_len;
+	size_t		 body_off;
+	int		 fd;		/* file to send, or -1 */
+	off_t		 offset;	/* next byte to send */
+	off_t		 end;		/* last byte to send, inclusive */
+	struct stream_range *ranges;	/* malloc()ed, sent after offset..end */
+	int		 nranges;
+	int		 range;		/* next entry of ranges */
+	char		*seps;		/* malloc()ed separators for ranges */
+	const char	*sep;		/* separator of the current range */
+	size_t		 sep_len;
+	size_t		 sep_off;
+	int		 no_sendfile;
+	char		*buf;		/* bounce buffer without sendfile */
+	size_t		 buf_len;
+	size_t		 buf_off;
+	int		 reading;	/* read into buf in flight */
+	int		 worker;
+	stream_prepare_t *prepare;
+	stream_fill_t	*fill;
+	stream_release_t *release;
+	void		*data;		/* for prepare() or fill(), free()d with the stream */
+	/* Pacing, see streamer.c */
+	enum stream_class class;
+	uint32_t	 rate;		/* bytes per second, 0 for no limit */
+	int64_t		 credit;	/* bytes that may go out now */
+	int64_t		 stamp;		/* ms when credit was last topped up */
+	off_t		 budget;	/* file bytes for this turn, -1 for no limit */
+	off_t		 sent;		/* file bytes sent so far */
+	time_t		 started;
+	time_t		 deadline;	/* when a queued stream gives up */
+	LIST_ENTRY(upnphttp) active;	/* main thread only */
+	TAILQ_ENTRY(upnphttp) queue;	/* main thread only */
+};
+
+/* What the status page shows for a transfer in flight */
+struct stream_stat {
+	struct upnphttp	*h;
+	enum stream_class class;
+	uint32_t	 rate;		/* target, bytes per second */
+	uint32_t	 average;	/* bytes per second so far */
+	off_t		 sent;
+};
+
+extern int number_of_streams;
+
+int streamer_init(void);
+void streamer_fini(void);
+
+/* stream_init() / stream_reset()
+ * set up an empty stream, or release everything it owns. */
+void stream_init(struct stream *s);
+void stream_reset(struct stream *s);
+
+/* stream_set_header()
+ * copy the response header (or a complete small response) */
+int stream_set_header(struct stream *s, const char *hdr, size_t len);
+
+/* stream_set_body()
+ * copy a small in-memory response body */
+int stream_set_body(struct stream *s, const char *body, size_t len);
+
+/* stream_send()
+ * push as much as the socket takes.  Returns 0 when done, EAGAIN
+ * when the socket is full, -1 on error. */
+int stream_send(struct stream *s, int sock);
+
+/* stream_start()
+ * hand h->stream off to a streaming thread.  The main loop must not
+ * touch h until the thread gives it back, at which point the
+ * connection is closed or kept for the next request.  When
+ * max_connections streams are already running h waits in a queue
+ * for up to admission_timeout seconds, and is answered with 503 if
+ * no thread frees up in time or the queue is full. */
+void stream_start(struct upnphttp *h);
+
+/* stream_expire()
+ * answer queued streams whose deadline has passed.  Returns the ms
+ * until the next deadline, or -1 if nothing is queued. */
+int stream_expire(void);
+
+/* stream_rate()
+ * the pacing target for an item of the given bitrate in bytes per
+ * second (DETAILS has audio in bits), or 0 to send as fast as possible */
+uint32_t stream_rate(uint32_t bitrate);
+
+/* stream_stats()
+ * fill in up to n entries for the transfers in flight, and return how
+ * many there are.  Main thread only; the numbers are a snapshot of
+ * what the streaming threads are doing. */
+int stream_stats(struct stream_stat *stats, int n);
+
+const char *stream_class_name(enum stream_class class);
+
+#endif
@@ -293,14 +293,15 @@ upnp_event_create_notify(struct subscriber *sub)
 	DPRINTF(E_DEBUG, L_HTTP, "%s: '%s' %hu '%s'\n", "upnp_event_notify_connect",
 	       obj->addrstr, port, obj->path);
 	obj->state = EConnecting;
-	if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		if(errno != EINPROGRESS && errno != EWOULDBLOCK) {
-			DPRINTF(E_ERROR, L_HTTP, "%s: connect(): %s\n", "upnp_event_notify_connect", strerror(errno));
-			obj->state = EError;
-		}
+	obj->ev = (struct event ){ .fd = s, .rdwr = EVENT_WRITE,
+	    .flags = EV_FLAG_EDGE, .process = upnp_event_process_notify,
+	    .data = obj };
+	/* a pending non-blocking connect completes when we become writable */
+	if(connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+	   errno != EINPROGRESS && errno != EWOULDBLOCK) {
+		DPRINTF(E_ERROR, L_HTTP, "%s: connect(): %s\n", "upnp_event_notify_connect", strerror(errno));
+		obj->state = EError;
 	} else {
-		obj->ev = (struct event ){ .fd = s, .rdwr = EVENT_WRITE,
-		    .process = upnp_event_process_notify, .data = obj };
 		event_module.add(&obj->ev);
 	}
 
@@ -363,6 +364,9 @@ static void upnp_event_send(struct upnp_event_notify * obj)
 	while( obj->sent < obj->tosend ) {
 		i = send(obj->ev.fd, obj->buffer + obj->sent, obj->tosend - obj->sent, 0);
 		if(i<0) {
+			/* socket buffer full, wait for the next write event */
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
 			DPRINTF(E_WARN, L_HTTP, "%s: send(): %s\n", "upnp_event_send", strerror(errno));
 			obj->state = EError;
 			event_module.del(&obj->ev, 0);
@@ -383,6 +387,8 @@ static void upnp_event_recv(struct upnp_event_notify * obj)
 	int n;
 	n = recv(obj->ev.fd, obj->buffer, obj->buffersize, 0);
 	if(n<0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
 		DPRINTF(E_ERROR, L_HTTP, "%s: recv(): %s\n", "upnp_event_recv", strerror(errno));
 		obj->state = EError;
 		event_module.del(&obj->ev, 0);
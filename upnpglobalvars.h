@@ -67,7 +67,7 @@
 #endif
 
 #define USE_FORK 1
-#define DB_VERSION 11
+#define DB_VERSION 14
 
 #ifdef READYNAS
 # define LOGFILE_NAME "upnp-av.log"
@@ -208,6 +208,9 @@ extern uint32_t runtime_flags;
 #define RESCAN_MASK           0x0200
 #define SUBTITLES_MASK        0x0400
 #define FORCE_ALPHASORT_MASK  0x0800
+#define SEEK_INDEX_MASK       0x1000
+#define FULLTEXT_MASK         0x2000
+#define WAL_MASK              0x4000
 
 #define SETFLAG(mask)	runtime_flags |= mask
 #define GETFLAG(mask)	(runtime_flags & mask)
@@ -242,7 +245,8 @@ extern int sssdp;
 extern const char *minissdpdsocketpath;
 
 /* UPnP-A/V [DLNA] */
-extern sqlite3 *db;
+/* Each thread that uses the database opens its own connection */
+extern __thread sqlite3 *db;
 #define FRIENDLYNAME_MAX_LEN 64
 extern char friendly_name[];
 extern char db_path[PATH_MAX];
@@ -81,14 +81,15 @@
 #include "tivo_utils.h"
 #include "tivo_commands.h"
 #include "clients.h"
-#include "process.h"
-#include "sendfile.h"
+#include "streamer.h"
+#include "filecache.h"
+#include "browsecache.h"
+#include "seekindex.h"
 #include "scanner.h"
-
-#define MAX_BUFFER_SIZE 2147483647
-#define MIN_BUFFER_SIZE 65536
+#include "dbwriter.h"
 
 #define INIT_STR(s, d) { s.data = d; s.size = sizeof(d); s.off = 0; }
+#define BYTERANGES_BOUNDARY "MINIDLNA-7c3e91a4d2b85f60"
 
 #include "icons.c"
 
@@ -98,6 +99,17 @@ enum event_type {
 	E_RENEW
 };
 
+static const char body404[] =
+	"<!DOCTYPE html>"
+	"<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>"
+	"<BODY><H1>Not Found</H1>The requested URL was not found"
+	" on this server.</BODY></HTML>\r\n";
+static const char body500[] =
+	"<!DOCTYPE html>"
+	"<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>"
+	"<BODY><H1>Internal Server Error</H1>Server encountered "
+	"and Internal Error.</BODY></HTML>\r\n";
+
 static void SendResp_icon(struct upnphttp *, char * url);
 static void SendResp_albumArt(struct upnphttp *, char * url);
 static void SendResp_mta(struct upnphttp *, char * url);
@@ -118,15 +130,54 @@ New_upnphttp(int s)
 		return NULL;
 	memset(ret, 0, sizeof(struct upnphttp));
 	ret->ev = (struct event ){ .fd = s, .rdwr = EVENT_READ, .process = Process_upnphttp, .data = ret };
+	ret->idle = time(NULL);
+	stream_init(&ret->stream);
 	event_module.add(&ret->ev);
 	return ret;
 }
 
-void
-CloseSocket_upnphttp(struct upnphttp * h)
+/* Get ready for the next request on a persistent connection */
+static void
+Recycle_upnphttp(struct upnphttp * h)
 {
+	/* The buffer stays, sized for what this client sends */
+	if(h->req_buf)
+		h->req_buf[0] = '\0';
+	h->req_buflen = 0;
+	h->req_scanoff = 0;
+	h->req_contentlen = 0;
+	h->req_contentoff = 0;
+	h->req_command = EUnknown;
+	h->req_client = NULL;
+	memset(&h->req_soapAction, 0, sizeof(h->req_soapAction));
+	memset(&h->req_Callback, 0, sizeof(h->req_Callback));
+	memset(&h->req_NT, 0, sizeof(h->req_NT));
+	h->req_Timeout = 0;
+	memset(&h->req_SID, 0, sizeof(h->req_SID));
+	h->req_RangeStart = 0;
+	h->req_RangeEnd = 0;
+	h->req_nRanges = 0;
+	h->req_TimeSeekStart = 0;
+	h->req_TimeSeekEnd = 0;
+	h->req_PlaySpeed = 0;
+	h->req_chunklen = 0;
+	h->reqflags = 0;
+	h->res_buflen = 0;
+	h->respflags = 0;
+	h->res_SID = NULL;
+	h->res_SIDLen = 0;
+	h->HttpVer[0] = '\0';
+	h->requests++;
+	h->idle = time(NULL);
+	h->state = 0;
+}
 
-	event_module.del(&h->ev, EV_FLAG_CLOSING);
+static void
+Close_upnphttp(struct upnphttp * h)
+{
+	/* A streaming thread's or a queued connection has no event registered */
+	if(h->state != 3 && h->state != 5)
+		event_module.del(&h->ev, EV_FLAG_CLOSING);
 	if(close(h->ev.fd) < 0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "CloseSocket_upnphttp: close(%d): %s\n", h->ev.fd, strerror(errno));
@@ -135,19 +186,147 @@ CloseSocket_upnphttp(struct upnphttp * h)
 	h->state = 100;
 }
 
+void
+CloseSocket_upnphttp(struct upnphttp * h)
+{
+	/* Still sending; SendStream_upnphttp() comes back here when done */
+	if( h->state == 4 )
+		return;
+	/* Only keep the connection if we consumed exactly one request;
+	 * anything pipelined behind it is left for the client to retry. */
+	if( (h->reqflags & FLAG_KEEPALIVE) && h->state < 100 &&
+	    h->req_buflen == h->req_contentoff + (h->req_command == EPost ? h->req_contentlen : 0) )
+	{
+		Recycle_upnphttp(h);
+		return;
+	}
+
+	Close_upnphttp(h);
+}
+
 void
 Delete_upnphttp(struct upnphttp * h)
 {
 	if(h)
 	{
 		if(h->ev.fd >= 0)
-			CloseSocket_upnphttp(h);
+			Close_upnphttp(h);
+		stream_reset(&h->stream);
 		free(h->req_buf);
 		free(h->res_buf);
 		free(h);
 	}
 }
 
+/* Parse a DLNA npt-time, in seconds ("335.11") or as H:MM:SS
+ * ("0:05:35.11"), into milliseconds.  Returns -1 if there is none. */
+static int
+parse_npt(const char *p, char **end)
+{
+	long secs, m, s;
+	int ms = 0, scale = 100;
+	char *q;
+
+	if(!isdigit(*p))
+		return -1;
+	secs = strtol(p, &q, 10);
+	if(*q == ':')
+	{
+		m = strtol(q+1, &q, 10);
+		if(*q != ':' || m > 59)
+			return -1;
+		s = strtol(q+1, &q, 10);
+		if(s > 59)
+			return -1;
+		secs = secs * 3600 + m * 60 + s;
+	}
+	if(*q == '.')
+	{
+		for(q++; isdigit(*q); q++, scale /= 10)
+			ms += (*q - '0') * scale;
+	}
+	if(secs > INT_MAX / 1000 - 1)
+		return -1;
+	*end = q;
+
+	return secs * 1000 + ms;
+}
+
+/* The request headers we look at.  Each one sits in http_headers[] at
+ * its HTTP_HEADER_HASH(), which has no collisions for this set, so a
+ * header name is matched with a single string compare.  A new header
+ * needs a slot that is still free (or a new hash). */
+enum http_header {
+	HDR_UNKNOWN = 0,
+	HDR_CONTENT_LENGTH,
+	HDR_CONNECTION,
+	HDR_SOAPACTION,
+	HDR_CALLBACK,
+	HDR_SID,
+	HDR_NT,
+	HDR_TIMEOUT,
+	HDR_RANGE,
+	HDR_HOST,
+	HDR_USER_AGENT,
+	HDR_X_AV_CLIENT_INFO,
+	HDR_TRANSFER_ENCODING,
+	HDR_ACCEPT_LANGUAGE,
+	HDR_CONTENTFEATURES,
+	HDR_TIMESEEKRANGE,
+	HDR_PLAYSPEED,
+	HDR_REALTIMEINFO,
+	HDR_SEEKRANGE,
+	HDR_TRANSFERMODE,
+	HDR_CAPTIONINFO,
+	HDR_FRIENDLYNAME,
+	HDR_UCTT,
+};
+
+#define HTTP_HEADER_HASH(c0, cn, len) (((c0) + 2 * (cn) + 5 * (len)) & 63)
+
+static const struct {
+	const char *name;
+	int len;
+	enum http_header id;
+} http_headers[64] = {
+	[1] = { "SOAPAction", 10, HDR_SOAPACTION },
+	[4] = { "uctt.upnp.org", 13, HDR_UCTT },
+	[7] = { "getCaptionInfo.sec", 18, HDR_CAPTIONINFO },
+	[10] = { "SID", 3, HDR_SID },
+	[11] = { "getAvailableSeekRange.dlna.org", 30, HDR_SEEKRANGE },
+	[15] = { "User-Agent", 10, HDR_USER_AGENT },
+	[21] = { "Range", 5, HDR_RANGE },
+	[23] = { "Transfer-Encoding", 17, HDR_TRANSFER_ENCODING },
+	[24] = { "PlaySpeed.dlna.org", 18, HDR_PLAYSPEED },
+	[29] = { "FriendlyName.DLNA.ORG", 21, HDR_FRIENDLYNAME },
+	[32] = { "NT", 2, HDR_NT },
+	[33] = { "Callback", 8, HDR_CALLBACK },
+	[36] = { "Host", 4, HDR_HOST },
+	[38] = { "X-AV-Client-Info", 16, HDR_X_AV_CLIENT_INFO },
+	[41] = { "realTimeInfo.dlna.org", 21, HDR_REALTIMEINFO },
+	[43] = { "transferMode.dlna.org", 21, HDR_TRANSFERMODE },
+	[48] = { "TimeSeekRange.dlna.org", 22, HDR_TIMESEEKRANGE },
+	[49] = { "Connection", 10, HDR_CONNECTION },
+	[54] = { "Accept-Language", 15, HDR_ACCEPT_LANGUAGE },
+	[57] = { "Content-Length", 14, HDR_CONTENT_LENGTH },
+	[60] = { "getcontentFeatures.dlna.org", 27, HDR_CONTENTFEATURES },
+	[63] = { "Timeout", 7, HDR_TIMEOUT },
+};
+
+static enum http_header
+http_header_lookup(const char *name, int len)
+{
+	int i;
+
+	if(len < 1)
+		return HDR_UNKNOWN;
+	i = HTTP_HEADER_HASH(tolower(name[0]), tolower(name[len-1]), len);
+	if(http_headers[i].len == len && strncasecmp(http_headers[i].name, name, len) == 0)
+		return http_headers[i].id;
+
+	return HDR_UNKNOWN;
+}
+
 /* parse HttpHeaders of the REQUEST */
 static void
 ParseHttpHeaders(struct upnphttp * h)
@@ -157,300 +336,365 @@ ParseHttpHeaders(struct upnphttp * h)
 	char * colon;
 	char * p;
 	int n;
+	int keepalive;
+	/* HTTP/1.1 connections are persistent unless the client says otherwise */
+	keepalive = (runtime_vars.keepalive_timeout > 0 &&
+	             h->requests + 1 < runtime_vars.keepalive_requests);
+	if(keepalive && strcmp(h->HttpVer, "HTTP/1.1") == 0)
+		h->reqflags |= FLAG_KEEPALIVE;
 	line = h->req_buf;
 	/* TODO : check if req_buf, contentoff are ok */
 	while(line < (h->req_buf + h->req_contentoff))
 	{
-		colon = strchr(line, ':');
-		if(colon)
-		{
-			if(strncasecmp(line, "Content-Length", 14)==0)
+		colon = memchr(line, ':', h->req_buf + h->req_contentoff - line);
+		if(!colon)
+			goto next_header;
+		for(n = colon - line; n > 0 && isspace(line[n-1]); n--)
+			;
+		switch(http_header_lookup(line, n))
+		{
+		case HDR_CONTENT_LENGTH:
+			p = colon;
+			while(*p && (*p < '0' || *p > '9'))
+				p++;
+			h->req_contentlen = atoi(p);
+			if(h->req_contentlen < 0) {
+				DPRINTF(E_WARN, L_HTTP, "Invalid Content-Length %d", h->req_contentlen);
+				h->req_contentlen = 0;
+			}
+			break;
+		case HDR_CONNECTION:
+			if(strcasestrc(colon, "close", '\r'))
+				h->reqflags &= ~FLAG_KEEPALIVE;
+			else if(keepalive && strcasestrc(colon, "keep-alive", '\r'))
+				h->reqflags |= FLAG_KEEPALIVE;
+			break;
+		case HDR_SOAPACTION:
+			p = colon;
+			n = 0;
+			while(*p == ':' || *p == ' ' || *p == '\t')
+				p++;
+			while(p[n] >= ' ')
+				n++;
+			if(n >= 2 &&
+			   ((p[0] == '"' && p[n-1] == '"') ||
+			    (p[0] == '\'' && p[n-1] == '\'')))
 			{
-				p = colon;
-				while(*p && (*p < '0' || *p > '9'))
-					p++;
-				h->req_contentlen = atoi(p);
-				if(h->req_contentlen < 0) {
-					DPRINTF(E_WARN, L_HTTP, "Invalid Content-Length %d", h->req_contentlen);
-					h->req_contentlen = 0;
-				}
+				p++;
+				n -= 2;
+			}
+			h->req_soapAction.off = p - h->req_buf;
+			h->req_soapAction.len = n;
+			break;
+		case HDR_CALLBACK:
+			p = colon;
+			while(*p && *p != '<' && *p != '\r' )
+				p++;
+			n = 0;
+			while(p[n] && p[n] != '>' && p[n] != '\r' )
+				n++;
+			h->req_Callback.off = p + 1 - h->req_buf;
+			h->req_Callback.len = MAX(0, n - 1);
+			break;
+		case HDR_SID:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			n = 0;
+			while(p[n] && !isspace(p[n]))
+				n++;
+			h->req_SID.off = p - h->req_buf;
+			h->req_SID.len = n;
+			break;
+		case HDR_NT:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			n = 0;
+			while(p[n] && !isspace(p[n]))
+				n++;
+			h->req_NT.off = p - h->req_buf;
+			h->req_NT.len = n;
+			break;
+		/* Timeout: Seconds-nnnn */
+		/* TIMEOUT
+		Recommended. Requested duration until subscription expires,
+		either number of seconds or infinite. Recommendation
+		by a UPnP Forum working committee. Defined by UPnP vendor.
+		Consists of the keyword "Second-" followed (without an
+		intervening space) by either an integer or the keyword "infinite". */
+		case HDR_TIMEOUT:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			if(strncasecmp(p, "Second-", 7)==0) {
+				h->req_Timeout = atoi(p+7);
 			}
-			else if(strncasecmp(line, "SOAPAction", 10)==0)
+			break;
+		// Range: bytes=xxx-yyy
+		case HDR_RANGE:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+
+			if(strncasecmp(p, "bytes=", 6)==0)
 			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n] >= ' ')
-					n++;
-				if(n >= 2 &&
-				   ((p[0] == '"' && p[n-1] == '"') ||
-				    (p[0] == '\'' && p[n-1] == '\'')))
+				/* init values */
+				h->req_RangeStart = -1;
+				h->req_RangeEnd = -1;
+
+				p += 6;
+				while(isspace(*p))
 				{
 					p++;
-					n -= 2;
 				}
-				h->req_soapAction = p;
-				h->req_soapActionLen = n;
-			}
-			else if(strncasecmp(line, "Callback", 8)==0)
-			{
-				p = colon;
-				while(*p && *p != '<' && *p != '\r' )
-					p++;
-				n = 0;
-				while(p[n] && p[n] != '>' && p[n] != '\r' )
-					n++;
-				h->req_Callback = p + 1;
-				h->req_CallbackLen = MAX(0, n - 1);
-			}
-			else if(strncasecmp(line, "SID", 3)==0)
-			{
-				//zqiu: fix bug for test 4.0.5
-				//Skip extra headers like "SIDHEADER: xxxxxx xxx"
-				for(p=line+3;p<colon;p++)
+				if(isdigit(*p))
 				{
-					if(!isspace(*p))
-					{
-						p = NULL; //unexpected header
-						break;
-					}
+					h->req_RangeStart = strtoll(p, &colon, 10);
 				}
-				if(p) {
-					p = colon + 1;
-					while(isspace(*p))
-						p++;
-					n = 0;
-					while(p[n] && !isspace(p[n]))
-						n++;
-					h->req_SID = p;
-					h->req_SIDLen = n;
+				else if(*p == '-')
+				{
+					colon = p;
 				}
-			}
-			else if(strncasecmp(line, "NT", 2)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				n = 0;
-				while(p[n] && !isspace(p[n]))
-					n++;
-				h->req_NT = p;
-				h->req_NTLen = n;
-			}
-			/* Timeout: Seconds-nnnn */
-			/* TIMEOUT
-			Recommended. Requested duration until subscription expires,
-			either number of seconds or infinite. Recommendation
-			by a UPnP Forum working committee. Defined by UPnP vendor.
-			Consists of the keyword "Second-" followed (without an
-			intervening space) by either an integer or the keyword "infinite". */
-			else if(strncasecmp(line, "Timeout", 7)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "Second-", 7)==0) {
-					h->req_Timeout = atoi(p+7);
+				else
+				{
+					// malformed 'Range:' attribute
+					colon = NULL;
 				}
-			}
-			// Range: bytes=xxx-yyy
-			else if(strncasecmp(line, "Range", 5)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
 
-				if(strncasecmp(p, "bytes=", 6)==0)
+				if(colon && colon+1 && isdigit(*(colon+1)))
 				{
-					/* init values */
-					h->req_RangeStart = -1;
-					h->req_RangeEnd = -1;
+					h->req_RangeEnd = atoll(colon+1);
+				}
 
-					p += 6;
-					while(isspace(*p))
-					{
-						p++;
-					}
-					if(isdigit(*p))
-					{
-						h->req_RangeStart = strtoll(p, &colon, 10);
-					}
-					else if(*p == '-')
-					{
-						colon = p;
-					}
-					else
-					{
-						// malformed 'Range:' attribute
-						colon = NULL;
-					}
+				if(!(h->req_RangeStart == -1 && h->req_RangeEnd == -1))
+				{
+					h->reqflags |= FLAG_RANGE;
+				}
+				else
+				{
+					h->req_RangeStart = 0;
+				}
 
-					if(colon && colon+1 && isdigit(*(colon+1)))
-					{
-						h->req_RangeEnd = atoll(colon+1);
-					}
+				DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
+					(long long)h->req_RangeStart, (long long)h->req_RangeEnd);
 
-					if(!(h->req_RangeStart == -1 && h->req_RangeEnd == -1))
-					{
-						h->reqflags |= FLAG_RANGE;
-					}
-					else
+				// More ranges: bytes=0-499,-500
+				h->req_nRanges = 0;
+				while(h->reqflags & FLAG_RANGE)
+				{
+					struct http_range *r = &h->req_Ranges[h->req_nRanges];
+
+					while(*p && *p != ',' && *p != '\r' && *p != '\n')
+						p++;
+					if(*p != ',')
+						break;
+					if(h->req_nRanges == HTTP_MAX_RANGES)
 					{
+						DPRINTF(E_WARN, L_HTTP, "Too many ranges, ignoring Range header\n");
+						h->reqflags &= ~FLAG_RANGE;
 						h->req_RangeStart = 0;
+						h->req_RangeEnd = -1;
+						h->req_nRanges = 0;
+						break;
 					}
-
- 					DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
-						(long long)h->req_RangeStart, (long long)h->req_RangeEnd);
- 				}
-			}
-			else if(strncasecmp(line, "Host", 4)==0)
-			{
-				int i;
-				h->reqflags |= FLAG_HOST;
-				p = colon + 1;
-				while(isspace(*p))
 					p++;
-				for(n = 0; n < n_lan_addr; n++)
-				{
-					for(i = 0; lan_addr[n].str[i]; i++)
-					{
-						if(lan_addr[n].str[i] != p[i])
-							break;
-					}
-					if(i && !lan_addr[n].str[i])
+					while(isspace(*p))
+						p++;
+					r->start = -1;
+					r->end = -1;
+					if(isdigit(*p))
+						r->start = strtoll(p, &p, 10);
+					if(*p == '-' && isdigit(p[1]))
+						r->end = strtoll(p+1, &p, 10);
+					if(*p != '-' && r->end == -1)
+						r->start = -1;
+					if(r->start == -1 && r->end == -1)
 					{
-						h->iface = n;
+						DPRINTF(E_WARN, L_HTTP, "Invalid Range header\n");
+						h->reqflags |= FLAG_INVALID_REQ;
 						break;
 					}
+					h->req_nRanges++;
 				}
 			}
-			else if(strncasecmp(line, "User-Agent", 10)==0)
+			break;
+		case HDR_HOST:
+		{
+			int i;
+			h->reqflags |= FLAG_HOST;
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			for(n = 0; n < n_lan_addr; n++)
 			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
+				for(i = 0; lan_addr[n].str[i]; i++)
 				{
-					if (client_types[i].match_type != EUserAgent)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
+					if(lan_addr[n].str[i] != p[i])
 						break;
-					}
+				}
+				if(i && !lan_addr[n].str[i])
+				{
+					h->iface = n;
+					break;
 				}
 			}
-			else if(strncasecmp(line, "X-AV-Client-Info", 16)==0)
+			break;
+		}
+		case HDR_USER_AGENT:
+		{
+			int i;
+			/* Skip client detection if we already detected it. */
+			if( client )
+				goto next_header;
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			for (i = 0; client_types[i].name; i++)
 			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client && client_types[client].type < EStandardDLNA150 )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
+				if (client_types[i].match_type != EUserAgent)
+					continue;
+				if (strstrc(p, client_types[i].match, '\r') != NULL)
 				{
-					if (client_types[i].match_type != EXAVClientInfo)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
+					client = i;
+					break;
 				}
 			}
-			else if(strncasecmp(line, "Transfer-Encoding", 17)==0)
+			break;
+		}
+		case HDR_X_AV_CLIENT_INFO:
+		{
+			int i;
+			/* Skip client detection if we already detected it. */
+			if( client && client_types[client].type < EStandardDLNA150 )
+				goto next_header;
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			for (i = 0; client_types[i].name; i++)
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "chunked", 7)==0)
+				if (client_types[i].match_type != EXAVClientInfo)
+					continue;
+				if (strstrc(p, client_types[i].match, '\r') != NULL)
 				{
-					h->reqflags |= FLAG_CHUNKED;
+					client = i;
+					break;
 				}
 			}
-			else if(strncasecmp(line, "Accept-Language", 15)==0)
+			break;
+		}
+		case HDR_TRANSFER_ENCODING:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			if(strncasecmp(p, "chunked", 7)==0)
 			{
-				h->reqflags |= FLAG_LANGUAGE;
+				h->reqflags |= FLAG_CHUNKED;
 			}
-			else if(strncasecmp(line, "getcontentFeatures.dlna.org", 27)==0)
+			break;
+		case HDR_ACCEPT_LANGUAGE:
+			h->reqflags |= FLAG_LANGUAGE;
+			break;
+		case HDR_CONTENTFEATURES:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			if( (*p != '1') || !isspace(p[1]) )
+				h->reqflags |= FLAG_INVALID_REQ;
+			break;
+		case HDR_TIMESEEKRANGE:
+			h->reqflags |= FLAG_TIMESEEK;
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			if(strncasecmp(p, "npt=", 4) == 0)
+				p += 4;
+			h->req_TimeSeekStart = parse_npt(p, &p);
+			h->req_TimeSeekEnd = -1;
+			if(h->req_TimeSeekStart < 0 || *p != '-')
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
+				DPRINTF(E_WARN, L_HTTP, "Invalid TimeSeekRange header\n");
+				h->reqflags |= FLAG_INVALID_REQ;
 			}
-			else if(strncasecmp(line, "TimeSeekRange.dlna.org", 22)==0)
+			else if(isdigit(p[1]))
 			{
-				h->reqflags |= FLAG_TIMESEEK;
+				h->req_TimeSeekEnd = parse_npt(p+1, &p);
+				if(h->req_TimeSeekEnd >= 0 && h->req_TimeSeekEnd < h->req_TimeSeekStart)
+					h->reqflags |= FLAG_INVALID_REQ;
 			}
-			else if(strncasecmp(line, "PlaySpeed.dlna.org", 18)==0)
+			break;
+		case HDR_PLAYSPEED:
+			h->reqflags |= FLAG_PLAYSPEED;
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			if(strncasecmp(p, "speed=", 6) == 0)
 			{
-				h->reqflags |= FLAG_PLAYSPEED;
+				h->req_PlaySpeed = strtol(p+6, &p, 10);
+				/* Slow motion isn't something we can do */
+				if(*p == '/')
+					h->req_PlaySpeed = 0;
 			}
-			else if(strncasecmp(line, "realTimeInfo.dlna.org", 21)==0)
+			if(h->req_PlaySpeed == 0 && *p != '/')
 			{
-				h->reqflags |= FLAG_REALTIMEINFO;
+				DPRINTF(E_WARN, L_HTTP, "Invalid PlaySpeed header\n");
+				h->reqflags |= FLAG_INVALID_REQ;
 			}
-			else if(strncasecmp(line, "getAvailableSeekRange.dlna.org", 21)==0)
+			break;
+		case HDR_REALTIMEINFO:
+			h->reqflags |= FLAG_REALTIMEINFO;
+			break;
+		case HDR_SEEKRANGE:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			if( (*p != '1') || !isspace(p[1]) )
+				h->reqflags |= FLAG_INVALID_REQ;
+			break;
+		case HDR_TRANSFERMODE:
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			if(strncasecmp(p, "Streaming", 9)==0)
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
+				h->reqflags |= FLAG_XFERSTREAMING;
 			}
-			else if(strncasecmp(line, "transferMode.dlna.org", 21)==0)
+			if(strncasecmp(p, "Interactive", 11)==0)
 			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "Streaming", 9)==0)
-				{
-					h->reqflags |= FLAG_XFERSTREAMING;
-				}
-				if(strncasecmp(p, "Interactive", 11)==0)
-				{
-					h->reqflags |= FLAG_XFERINTERACTIVE;
-				}
-				if(strncasecmp(p, "Background", 10)==0)
-				{
-					h->reqflags |= FLAG_XFERBACKGROUND;
-				}
+				h->reqflags |= FLAG_XFERINTERACTIVE;
 			}
-			else if(strncasecmp(line, "getCaptionInfo.sec", 18)==0)
+			if(strncasecmp(p, "Background", 10)==0)
 			{
-				h->reqflags |= FLAG_CAPTION;
+				h->reqflags |= FLAG_XFERBACKGROUND;
 			}
-			else if(strncasecmp(line, "FriendlyName", 12)==0)
+			break;
+		case HDR_CAPTIONINFO:
+			h->reqflags |= FLAG_CAPTION;
+			break;
+		case HDR_FRIENDLYNAME:
+		{
+			int i;
+			p = colon + 1;
+			while(isspace(*p))
+				p++;
+			for (i = 0; client_types[i].name; i++)
 			{
-				int i;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
+				if (client_types[i].match_type != EFriendlyName)
+					continue;
+				if (strstrc(p, client_types[i].match, '\r') != NULL)
 				{
-					if (client_types[i].match_type != EFriendlyName)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
+					client = i;
+					break;
 				}
 			}
-			else if(strncasecmp(line, "uctt.upnp.org:", 14)==0)
-			{
-				/* Conformance testing */
-				SETFLAG(DLNA_STRICT_MASK);
-			}
+			break;
+		}
+		case HDR_UCTT:
+			/* Conformance testing */
+			SETFLAG(DLNA_STRICT_MASK);
+			break;
+		default:
+			break;
 		}
 next_header:
 		line = strstr(line, "\r\n");
@@ -461,6 +705,8 @@ next_header:
 	if( h->reqflags & FLAG_CHUNKED )
 	{
 		char *endptr;
+		/* the body is decoded in place, so we can't tell where it ended */
+		h->reqflags &= ~FLAG_KEEPALIVE;
 		h->req_chunklen = -1;
 		if( h->req_buflen <= h->req_contentoff )
 			return;
@@ -515,6 +761,7 @@ Send400(struct upnphttp * h)
 		"<BODY><H1>Bad Request</H1>The request is invalid"
 		" for this HTTP version.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 400, "Bad Request",
 	                    body400, sizeof(body400) - 1);
 	SendResp_upnphttp(h);
@@ -541,11 +788,6 @@ Send403(struct upnphttp * h)
 static void
 Send404(struct upnphttp * h)
 {
-	static const char body404[] =
-		"<!DOCTYPE html>"
-		"<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>"
-		"<BODY><H1>Not Found</H1>The requested URL was not found"
-		" on this server.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
 	BuildResp2_upnphttp(h, 404, "Not Found",
 	                    body404, sizeof(body404) - 1);
@@ -589,11 +831,6 @@ Send416(struct upnphttp * h)
 void
 Send500(struct upnphttp * h)
 {
-	static const char body500[] = 
-		"<!DOCTYPE html>"
-		"<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>"
-		"<BODY><H1>Internal Server Error</H1>Server encountered "
-		"and Internal Error.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
 	BuildResp2_upnphttp(h, 500, "Internal Server Errror",
 	                    body500, sizeof(body500) - 1);
@@ -611,12 +848,29 @@ Send501(struct upnphttp * h)
 		"<BODY><H1>Not Implemented</H1>The HTTP Method "
 		"is not implemented by this server.</BODY></HTML>\r\n";
 	h->respflags = FLAG_HTML;
+	h->reqflags &= ~FLAG_KEEPALIVE;
 	BuildResp2_upnphttp(h, 501, "Not Implemented",
 	                    body501, sizeof(body501) - 1);
 	SendResp_upnphttp(h);
 	CloseSocket_upnphttp(h);
 }
 
+/* very minimalistic 503 error message */
+void
+Send503(struct upnphttp * h)
+{
+	static const char body503[] =
+		"<!DOCTYPE html>"
+		"<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>"
+		"<BODY><H1>Service Unavailable</H1>Too many streams are running,"
+		" please try again later.</BODY></HTML>\r\n";
+	h->respflags = FLAG_HTML | FLAG_RETRY_AFTER;
+	BuildResp2_upnphttp(h, 503, "Service Unavailable",
+	                    body503, sizeof(body503) - 1);
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
 /* Sends the description generated by the parameter */
 static void
 sendXMLdesc(struct upnphttp * h, char * (f)(int *))
@@ -657,8 +911,10 @@ static void
 SendResp_presentation(struct upnphttp * h)
 {
 	struct string_s str;
-	char body[4096];
-	int a, v, p, i;
+	char body[8192];
+	struct stream_stat stats[16];
+	struct browsecache_stat cache;
+	int a, v, p, i, n;
 
 	INIT_STR(str, body);
 
@@ -809,7 +1065,36 @@ SendResp_presentation(struct upnphttp * h)
 	}
 	strcatf(&str, "</table>");
 
-	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_children, (number_of_children == 1 ? "" : "s"));
+	n = stream_stats(stats, 16);
+	if (n)
+	{
+		strcatf(&str,
+			"<h3>Active streams</h3>"
+			"<table>"
+			"<tr><th>IP Address</th><th>Class</th><th>Paced at (kB/s)</th><th>Average (kB/s)</th><th>Sent (MB)</th></tr>");
+		for (i = 0; i < MIN(n, 16); i++)
+		{
+			strcatf(&str, "<tr><td>%s</td><td>%s</td>", inet_ntoa(stats[i].h->clientaddr),
+					stream_class_name(stats[i].class));
+			if (stats[i].rate)
+				strcatf(&str, "<td class=\"numeric\">%u</td>", stats[i].rate / 1000);
+			else
+				strcatf(&str, "<td>-</td>");
+			strcatf(&str, "<td class=\"numeric\">%u</td><td class=\"numeric\">%jd</td></tr>",
+					stats[i].average / 1000, (intmax_t)(stats[i].sent >> 20));
+		}
+		strcatf(&str, "</table>");
+	}
+
+	browsecache_stats(&cache);
+	strcatf(&str,
+		"<h3>Browse cache</h3>"
+		"<table>"
+		"<tr><th>Hits</th><th>Misses</th><th>Entries</th><th>Size (kB)</th><th>Resumed pages</th></tr>"
+		"<tr><td class=\"numeric\">%u</td><td class=\"numeric\">%u</td><td class=\"numeric\">%d</td><td class=\"numeric\">%d</td><td class=\"numeric\">%u</td></tr>"
+		"</table>", cache.hits, cache.misses, cache.entries, cache.bytes / 1024, cache.cursor_hits);
+
+	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_streams, (number_of_streams == 1 ? "" : "s"));
 	strcatf(&str, "</div></BODY></HTML>\r\n");
 
 	BuildResp_upnphttp(h, str.data, str.off);
@@ -860,13 +1145,14 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 {
 	if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 	{
-		if(h->req_soapAction)
+		if(h->req_soapAction.off)
 		{
 			/* we can process the request */
-			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapActionLen, h->req_soapAction);
+			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n",
+				h->req_soapAction.len, HTTP_SLICE(h, h->req_soapAction));
 			ExecuteSoapAction(h, 
-				h->req_soapAction,
-				h->req_soapActionLen);
+				HTTP_SLICE(h, h->req_soapAction),
+				h->req_soapAction.len);
 		}
 		else {
 			const char* query = strchr(h->req_buf, '?');
@@ -905,17 +1191,17 @@ check_event(struct upnphttp *h)
 {
 	enum event_type type;
 
-	if (h->req_Callback)
+	if (h->req_Callback.off)
 	{
-		if (h->req_SID || !h->req_NT)
+		if (h->req_SID.off || !h->req_NT.off)
 		{
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 				            "<!DOCTYPE html>"
 				            "<HTML><BODY>Bad request</BODY></HTML>", 37);
 			type = E_INVALID;
 		}
-		else if (strncmp(h->req_Callback, "http://", 7) != 0 ||
-		         strncmp(h->req_NT, "upnp:event", h->req_NTLen) != 0)
+		else if (strncmp(HTTP_SLICE(h, h->req_Callback), "http://", 7) != 0 ||
+		         strncmp(HTTP_SLICE(h, h->req_NT), "upnp:event", h->req_NT.len) != 0)
 		{
 			/* Missing or invalid CALLBACK : 412 Precondition Failed.
 			 * If CALLBACK header is missing or does not contain a valid HTTP URL,
@@ -926,10 +1212,10 @@ check_event(struct upnphttp *h)
 		else
 			type = E_SUBSCRIBE;
 	}
-	else if (h->req_SID)
+	else if (h->req_SID.off)
 	{
 		/* subscription renew */
-		if (h->req_NT)
+		if (h->req_NT.off)
 		{
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 				            "<!DOCTYPE html>"
@@ -955,8 +1241,8 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 	enum event_type type;
 	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPSubscribe %s\n", path);
 	DPRINTF(E_DEBUG, L_HTTP, "Callback '%.*s' Timeout=%d\n",
-		h->req_CallbackLen, h->req_Callback, h->req_Timeout);
-	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+		h->req_Callback.len, HTTP_SLICE(h, h->req_Callback), h->req_Timeout);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SID.len, HTTP_SLICE(h, h->req_SID));
 
 	type = check_event(h);
 	if (type == E_SUBSCRIBE)
@@ -965,22 +1251,22 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 		 * - respond HTTP/x.x 200 OK 
 		 * - Send the initial event message */
 		/* Server:, SID:; Timeout: Second-(xx|infinite) */
-		sid = upnpevents_addSubscriber(path, h->req_Callback,
-		                               h->req_CallbackLen, h->req_Timeout);
+		sid = upnpevents_addSubscriber(path, HTTP_SLICE(h, h->req_Callback),
+		                               h->req_Callback.len, h->req_Timeout);
 		h->respflags = FLAG_TIMEOUT;
 		if (sid)
 		{
 			DPRINTF(E_DEBUG, L_HTTP, "generated sid=%s\n", sid);
 			h->respflags |= FLAG_SID;
-			h->req_SID = sid;
-			h->req_SIDLen = strlen(sid);
+			h->res_SID = sid;
+			h->res_SIDLen = strlen(sid);
 		}
 		BuildResp_upnphttp(h, 0, 0);
 	}
 	else if (type == E_RENEW)
 	{
 		/* subscription renew */
-		if (renewSubscription(h->req_SID, h->req_SIDLen, h->req_Timeout) < 0)
+		if (renewSubscription(HTTP_SLICE(h, h->req_SID), h->req_SID.len, h->req_Timeout) < 0)
 		{
 			/* Invalid SID
 			   412 Precondition Failed. If a SID does not correspond to a known,
@@ -994,6 +1280,8 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 			h->respflags = FLAG_TIMEOUT;
 			h->req_Timeout = 300;
 			h->respflags |= FLAG_SID;
+			h->res_SID = HTTP_SLICE(h, h->req_SID);
+			h->res_SIDLen = h->req_SID.len;
 			BuildResp_upnphttp(h, 0, 0);
 		}
 	}
@@ -1006,12 +1294,12 @@ ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
 {
 	enum event_type type;
 	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPUnSubscribe %s\n", path);
-	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SID.len, HTTP_SLICE(h, h->req_SID));
 	/* Remove from the list */
 	type = check_event(h);
 	if (type != E_INVALID)
 	{
-		if(upnpevents_removeSubscriber(h->req_SID, h->req_SIDLen) < 0)
+		if(upnpevents_removeSubscriber(HTTP_SLICE(h, h->req_SID), h->req_SID.len) < 0)
 			BuildResp2_upnphttp(h, 412, "Precondition Failed", 0, 0);
 		else
 			BuildResp_upnphttp(h, 0, 0);
@@ -1061,6 +1349,14 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 
 	ParseHttpHeaders(h);
 
+	/* the body is held in req_buf, so keep it to what the headers may use */
+	if(h->req_contentoff + h->req_contentlen + 1 >= 1024 * 1024)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Request body too large (Content-Length %d)\n", h->req_contentlen);
+		Send400(h);
+		return;
+	}
+
 	/* see if we need to wait for remaining data */
 	if( (h->reqflags & FLAG_CHUNKED) )
 	{
@@ -1112,7 +1408,8 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 			return;
 		}
 		/* 7.3.33.4 */
-		else if( (h->reqflags & (FLAG_TIMESEEK|FLAG_PLAYSPEED)) &&
+		else if( (h->reqflags & (FLAG_PLAYSPEED|FLAG_TIMESEEK)) &&
+		         strncmp(HttpUrl, "/MediaItems/", 12) != 0 &&
 		         !(h->reqflags & FLAG_RANGE) )
 		{
 			DPRINTF(E_WARN, L_HTTP, "DLNA %s requested, responding ERROR 406\n",
@@ -1258,65 +1555,109 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 	}
 }
 
+/* Make room for at least want bytes plus a terminating NUL in req_buf.
+ * The buffer grows by doubling and is kept across keep-alive requests. */
+static int
+Reserve_upnphttp(struct upnphttp * h, int want)
+{
+	char *buf;
+	int size;
+
+	if(want < h->req_bufsize)
+		return 0;
+	if(want >= INT_MAX / 2)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	size = h->req_bufsize ? h->req_bufsize : 2048;
+	while(size <= want)
+		size *= 2;
+	buf = realloc(h->req_buf, size);
+	if(!buf)
+		return -1;
+	h->req_buf = buf;
+	h->req_bufsize = size;
+
+	return 0;
+}
+
 static void
 Process_upnphttp(struct event *ev)
 {
-	char buf[2048];
 	struct upnphttp *h = ev->data;
+	const char * endheaders;
 	int n;
 
 	switch(h->state)
 	{
 	case 0:
-		n = recv(h->ev.fd, buf, 2048, 0);
+		if(Reserve_upnphttp(h, h->req_buflen + 2048) != 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Receive headers: %s\n", strerror(errno));
+			h->state = 100;
+			break;
+		}
+		n = recv(h->ev.fd, h->req_buf + h->req_buflen,
+		         h->req_bufsize - h->req_buflen - 1, 0);
 		if(n<0)
 		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
 			DPRINTF(E_ERROR, L_HTTP, "recv (state0): %s\n", strerror(errno));
 			h->state = 100;
 		}
 		else if(n==0)
 		{
-			DPRINTF(E_WARN, L_HTTP, "HTTP Connection closed unexpectedly\n");
+			if(h->requests && !h->req_buflen)
+				DPRINTF(E_DEBUG, L_HTTP, "HTTP Connection closed by client after %d requests\n", h->requests);
+			else
+				DPRINTF(E_WARN, L_HTTP, "HTTP Connection closed unexpectedly\n");
 			h->state = 100;
 		}
 		else
 		{
-			int new_req_buflen;
-			const char * endheaders;
-			/* if 1st arg of realloc() is null,
-			 * realloc behaves the same as malloc() */
-			new_req_buflen = n + h->req_buflen + 1;
-			if (new_req_buflen >= 1024 * 1024)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", new_req_buflen);
-				h->state = 100;
-				break;
-			}
-			h->req_buf = (char *)realloc(h->req_buf, new_req_buflen);
-			if (!h->req_buf)
+			h->req_buflen += n;
+			h->req_buf[h->req_buflen] = '\0';
+			if (h->req_buflen + 1 >= 1024 * 1024)
 			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers: %s\n", strerror(errno));
+				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", h->req_buflen);
 				h->state = 100;
 				break;
 			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
-			h->req_buflen += n;
-			h->req_buf[h->req_buflen] = '\0';
-			/* search for the string "\r\n\r\n" */
-			endheaders = strstr(h->req_buf, "\r\n\r\n");
+			/* search for the string "\r\n\r\n", skipping what was
+			 * already searched on previous reads */
+			endheaders = strstr(h->req_buf + h->req_scanoff, "\r\n\r\n");
 			if(endheaders)
 			{
 				h->req_contentoff = endheaders - h->req_buf + 4;
 				h->req_contentlen = h->req_buflen - h->req_contentoff;
 				ProcessHttpQuery_upnphttp(h);
 			}
+			else
+				h->req_scanoff = MAX(h->req_buflen - 3, 0);
 		}
 		break;
 	case 1:
 	case 2:
-		n = recv(h->ev.fd, buf, sizeof(buf), 0);
+		if(h->req_buflen + 1 >= 1024 * 1024)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Receive request body too large (received %d bytes)\n", h->req_buflen);
+			h->state = 100;
+			break;
+		}
+		if(Reserve_upnphttp(h, h->req_buflen + 2048) != 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
+			h->state = 100;
+			break;
+		}
+		n = recv(h->ev.fd, h->req_buf + h->req_buflen,
+		         h->req_bufsize - h->req_buflen - 1, 0);
 		if(n < 0)
 		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
 			DPRINTF(E_ERROR, L_HTTP, "recv (state%d): %s\n", h->state, strerror(errno));
 			h->state = 100;
 		}
@@ -1327,23 +1668,14 @@ Process_upnphttp(struct event *ev)
 		}
 		else
 		{
-			buf[sizeof(buf)-1] = '\0';
-			/*fwrite(buf, 1, n, stdout);*/	/* debug */
-			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
+			h->req_buf[h->req_buflen] = '\0';
 			if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 			{
-				/* Need the struct to point to the realloc'd memory locations */
+				/* Header values are offsets into req_buf, so they
+				 * are still good after it has grown */
 				if( h->state == 1 )
 				{
-					ParseHttpHeaders(h);
 					ProcessHTTPPOST_upnphttp(h);
 				}
 				else if( h->state == 2 )
@@ -1353,6 +1685,9 @@ Process_upnphttp(struct event *ev)
 			}
 		}
 		break;
+	case 4:
+		SendStream_upnphttp(h);
+		break;
 	default:
 		DPRINTF(E_WARN, L_HTTP, "Unexpected state: %d\n", h->state);
 	}
@@ -1369,16 +1704,15 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	static const char httpresphead[] =
 		"%s %d %s\r\n"
 		"Content-Type: text/%s; charset=\"utf-8\"\r\n"
-		"Connection: close\r\n"
-		"Content-Length: %d\r\n"
-		"Server: " MINIDLNA_SERVER_STRING "\r\n";
+		"Connection: %s\r\n";
 	time_t curtime = time(NULL);
+	struct tm tm;
 	char date[30];
 	int templen;
 	struct string_s res;
 	if(!h->res_buf)
 	{
-		templen = sizeof(httpresphead) + 256 + bodylen;
+		templen = sizeof(httpresphead) + 256 + MAX(bodylen, 0);
 		h->res_buf = (char *)malloc(templen);
 		h->res_buf_alloclen = templen;
 	}
@@ -1388,7 +1722,13 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	strcatf(&res, httpresphead, "HTTP/1.1",
 	              respcode, respmsg,
 	              (h->respflags&FLAG_HTML)?"html":"xml",
-							 bodylen);
+	              (h->reqflags&FLAG_KEEPALIVE)?"keep-alive":"close");
+	/* A body of unknown length is either chunked or runs until we close */
+	if(bodylen >= 0)
+		strcatf(&res, "Content-Length: %d\r\n", bodylen);
+	else if(h->respflags & FLAG_CHUNKED)
+		strcatf(&res, "Transfer-Encoding: chunked\r\n");
+	strcatf(&res, "Server: " MINIDLNA_SERVER_STRING "\r\n");
 	/* Additional headers */
 	if(h->respflags & FLAG_TIMEOUT) {
 		strcatf(&res, "Timeout: Second-");
@@ -1399,17 +1739,20 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 		}
 	}
 	if(h->respflags & FLAG_SID) {
-		strcatf(&res, "SID: %.*s\r\n", h->req_SIDLen, h->req_SID);
+		strcatf(&res, "SID: %.*s\r\n", h->res_SIDLen, h->res_SID);
 	}
 	if(h->reqflags & FLAG_LANGUAGE) {
 		strcatf(&res, "Content-Language: en\r\n");
 	}
-	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&curtime));
+	if(h->respflags & FLAG_RETRY_AFTER) {
+		strcatf(&res, "Retry-After: %d\r\n", MAX(runtime_vars.admission_timeout, 1));
+	}
+	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime_r(&curtime, &tm));
 	strcatf(&res, "Date: %s\r\n", date);
 	strcatf(&res, "EXT:\r\n");
 	strcatf(&res, "\r\n");
 	h->res_buflen = res.off;
-	if(h->res_buf_alloclen < (h->res_buflen + bodylen))
+	if(bodylen > 0 && h->res_buf_alloclen < (h->res_buflen + bodylen))
 	{
 		h->res_buf = (char *)realloc(h->res_buf, (h->res_buflen + bodylen));
 		h->res_buf_alloclen = h->res_buflen + bodylen;
@@ -1436,133 +1779,122 @@ BuildResp_upnphttp(struct upnphttp *h, const char *body, int bodylen)
 	BuildResp2_upnphttp(h, 200, "OK", body, bodylen);
 }
 
-void
-SendResp_upnphttp(struct upnphttp * h)
+/* Hand res_buf over to the stream rather than copying it */
+static void
+StartStream_upnphttp(struct upnphttp * h)
 {
-	int n;
 	DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
-	n = send(h->ev.fd, h->res_buf, h->res_buflen, 0);
-	if(n<0)
-	{
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
-	}
-	else if(n < h->res_buflen)
-	{
-		/* TODO : handle correctly this case */
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
-	}
+	stream_reset(&h->stream);
+	h->stream.hdr = h->res_buf;
+	h->stream.hdr_len = h->res_buflen;
+	h->res_buf = NULL;
+	h->res_buflen = 0;
+	h->res_buf_alloclen = 0;
 }
 
-static int
-send_data(struct upnphttp * h, char * header, size_t size, int flags)
-{
-	int n;
+void
+SendResp_upnphttp(struct upnphttp * h)
+{
+	StartStream_upnphttp(h);
+	SendStream_upnphttp(h);
+}
 
-	n = send(h->ev.fd, header, size, flags);
-	if(n<0)
-	{
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
-	} 
-	else if(n < h->res_buflen)
-	{
-		/* TODO : handle correctly this case */
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
-	}
-	else
-	{
-		return 0;
-	}
-	return 1;
+void
+SendFill_upnphttp(struct upnphttp * h, stream_fill_t *fill,
+                  stream_release_t *release, void *data)
+{
+	StartStream_upnphttp(h);
+	h->stream.fill = fill;
+	h->stream.release = release;
+	h->stream.data = data;
+	SendStream_upnphttp(h);
 }
 
-static void
-send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
+void
+SendStream_upnphttp(struct upnphttp * h)
 {
-	off_t send_size;
-	off_t ret;
-	char *buf = NULL;
-#if HAVE_SENDFILE
-	int try_sendfile = 1;
-#endif
+	int ret;
 
-	while( offset <= end_offset )
+	h->idle = time(NULL);
+	ret = stream_send(&h->stream, h->ev.fd);
+	if( ret == EAGAIN )
 	{
-#if HAVE_SENDFILE
-		if( try_sendfile )
+		if( h->state != 4 )
 		{
-			send_size = ( ((end_offset - offset) < MAX_BUFFER_SIZE) ? (end_offset - offset + 1) : MAX_BUFFER_SIZE);
-			ret = sys_sendfile(h->ev.fd, sendfd, &offset, send_size);
-			if( ret == -1 )
-			{
-				DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
-				/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
-				if( errno == EOVERFLOW || errno == EINVAL )
-					try_sendfile = 0;
-				else if( errno != EAGAIN )
-					break;
-			}
-			else
-			{
-				//DPRINTF(E_DEBUG, L_HTTP, "sent %lld bytes to %d. offset is now %lld.\n", ret, h->socket, offset);
-				continue;
-			}
-		}
-#endif
-		/* Fall back to regular I/O */
-		if( !buf )
-			buf = malloc(MIN_BUFFER_SIZE);
-		send_size = (((end_offset - offset) < MIN_BUFFER_SIZE) ? (end_offset - offset + 1) : MIN_BUFFER_SIZE);
-		lseek(sendfd, offset, SEEK_SET);
-		ret = read(sendfd, buf, send_size);
-		if( ret == -1 ) {
-			DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
-				continue;
-			else
-				break;
+			event_module.del(&h->ev, 0);
+			h->ev.rdwr = EVENT_WRITE;
+			event_module.add(&h->ev);
+			h->state = 4;
 		}
-		ret = write(h->ev.fd, buf, ret);
-		if( ret == -1 ) {
-			DPRINTF(E_DEBUG, L_HTTP, "write error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
-				continue;
-			else
-				break;
+		return;
+	}
+	if( ret != 0 )
+		h->reqflags &= ~FLAG_KEEPALIVE;
+	stream_reset(&h->stream);
+	if( h->state == 4 )
+	{
+		/* The handler already called CloseSocket_upnphttp() */
+		h->state = 0;
+		if( h->reqflags & FLAG_KEEPALIVE )
+		{
+			event_module.del(&h->ev, 0);
+			h->ev.rdwr = EVENT_READ;
+			event_module.add(&h->ev);
 		}
-		offset += ret;
+		CloseSocket_upnphttp(h);
+	}
+}
+
+/* Queue an error page on the stream instead of sending it right away,
+ * for use from stream_prepare_t callbacks. */
+static int
+StreamError_upnphttp(struct upnphttp * h, int respcode, const char * respmsg,
+                     const char * body, int bodylen)
+{
+	h->respflags = FLAG_HTML;
+	BuildResp2_upnphttp(h, respcode, respmsg, body, bodylen);
+	if( h->stream.fd >= 0 )
+	{
+		close(h->stream.fd);
+		h->stream.fd = -1;
 	}
-	free(buf);
+	return stream_set_header(&h->stream, h->res_buf, h->res_buflen);
 }
 
 static void
-start_dlna_header(struct string_s *str, int respcode, const char *tmode, const char *mime)
+start_dlna_header(struct upnphttp *h, struct string_s *str, int respcode, const char *tmode, const char *mime)
 {
 	char date[30];
+	struct tm tm;
 	time_t now;
 
 	now = time(NULL);
-	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&now));
+	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime_r(&now, &tm));
 	strcatf(str, "HTTP/1.1 %d OK\r\n"
-	             "Connection: close\r\n"
+	             "Connection: %s\r\n"
 	             "Date: %s\r\n"
 	             "Server: " MINIDLNA_SERVER_STRING "\r\n"
 	             "EXT:\r\n"
 	             "realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n"
 	             "transferMode.dlna.org: %s\r\n"
 	             "Content-Type: %s\r\n",
-	             respcode, date, tmode, mime);
+	             respcode, (h->reqflags & FLAG_KEEPALIVE) ? "keep-alive" : "close",
+	             date, tmode, mime);
 }
 
 static int
-_open_file(const char *orig_path)
+_open_file(const char *orig_path, off_t *size)
 {
 	struct media_dir_s *media_path;
 	char buf[PATH_MAX];
 	const char *path;
+	struct stat st;
 	int fd;
 
+	fd = filecache_open(orig_path, size);
+	if (fd != -1)
+		return fd;
+
 	if (!GETFLAG(WIDE_LINKS_MASK))
 	{
 		path = realpath(orig_path, buf);
@@ -1582,6 +1914,8 @@ _open_file(const char *orig_path)
 		{
 			DPRINTF(E_ERROR, L_HTTP, "Rejecting wide link %s -> %s\n",
 						orig_path, path);
+			if (stat(path, &st) == 0)
+				filecache_add(orig_path, -1, &st);
 			return -403;
 		}
 	}
@@ -1590,7 +1924,17 @@ _open_file(const char *orig_path)
 
 	fd = open(path, O_RDONLY);
 	if (fd < 0)
+	{
 		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", path);
+		return fd;
+	}
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	filecache_add(orig_path, fd, &st);
 
 	return fd;
 }
@@ -1669,37 +2013,115 @@ SendResp_icon(struct upnphttp * h, char * icon)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", mime);
+	start_dlna_header(h, &str, 200, "Interactive", mime);
 	strcatf(&str, "Content-Length: %ld\r\n\r\n", size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	stream_set_header(&h->stream, str.data, str.off);
+	if( h->req_command != EHead )
 	{
-		if( h->req_command != EHead )
+		if(fd<0)
 		{
-			if(fd<0)
-			{
-				send_data(h, data, size, 0);
-			}
-			else
-			{
-				send_file(h, fd, 0, size-1);
-			}
+			stream_set_body(&h->stream, data, size);
+		}
+		else
+		{
+			h->stream.fd = fd;
+			h->stream.end = size-1;
+			fd = -1;
 		}
 	}
-	CloseSocket_upnphttp(h);
 	if(fd>=0) {
 		close(fd);
 	}
+	SendStream_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
+struct albumart_job {
+	const image_size_type_t *image_size_type;
+	char path[PATH_MAX];
+	char albumart_path[PATH_MAX];
+};
+
+static int
+albumart_stream(struct upnphttp * h, int fd, off_t size, const image_size_type_t *image_size_type)
+{
+	char header[512];
+	const char *tmode;
+	struct string_s str;
+
+	INIT_STR(str, header);
+
+	if( h->reqflags & FLAG_XFERBACKGROUND )
+	{
+		tmode = "Background";
+		h->stream.class = STREAM_BACKGROUND;
+	}
+	else
+	{
+		tmode = "Interactive";
+		h->stream.class = STREAM_INTERACTIVE;
+	}
+	start_dlna_header(h, &str, 200, tmode, "image/jpeg");
+	strcatf(&str, "Content-Length: %jd\r\n"
+	              "contentFeatures.dlna.org: DLNA.ORG_PN=%s\r\n\r\n",
+	              (intmax_t)size, image_size_type->name);
+
+	if( stream_set_header(&h->stream, str.data, str.off) != 0 )
+	{
+		close(fd);
+		return -1;
+	}
+	if( h->req_command != EHead )
+	{
+		h->stream.fd = fd;
+		h->stream.offset = 0;
+		h->stream.end = size - 1;
+	}
+	else
+		close(fd);
+
+	return 0;
+}
+
+/* Runs on a streaming thread: scale the full-size cached album art
+ * down to the requested size, then send it. */
+static int
+albumart_prepare(struct upnphttp * h)
+{
+	struct albumart_job *job = h->stream.data;
+	char *fullsize_albumart_path = NULL;
+	int fd;
+
+	if( !art_cache_path(NULL, ".jpg", job->path, &fullsize_albumart_path) )
+	{
+		DPRINTF(E_WARN, L_HTTP, "ALBUM_ART %s: Could not format path to full-size album art for '%s', responding ERROR 404\n", job->image_size_type->name, job->path);
+		return StreamError_upnphttp(h, 404, "Not Found", body404, sizeof(body404) - 1);
+	}
+	if( save_resized_album_art_from_file_to_file(fullsize_albumart_path, job->albumart_path, job->image_size_type) != 0 )
+	{
+		DPRINTF(E_WARN, L_HTTP, "ALBUM_ART %s-%s not found, responding ERROR 404\n", job->path, job->image_size_type->name);
+		free(fullsize_albumart_path);
+		return StreamError_upnphttp(h, 404, "Not Found", body404, sizeof(body404) - 1);
+	}
+	free(fullsize_albumart_path);
+
+	fd = open(job->albumart_path, O_RDONLY);
+	if( fd < 0 )
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", job->albumart_path);
+		return StreamError_upnphttp(h, 404, "Not Found", body404, sizeof(body404) - 1);
+	}
+	DPRINTF(E_INFO, L_HTTP, "Serving album art [%s]\n", job->albumart_path);
+
+	return albumart_stream(h, fd, lseek(fd, 0, SEEK_END), job->image_size_type);
 }
 
 static void
 SendResp_albumArt(struct upnphttp * h, char * url)
 {
-	char header[512];
 	char *path, *albumart_path;
-	char *tmode;
-	off_t size;
-	struct string_s str;
+	struct albumart_job *job;
 
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
 	{
@@ -1711,7 +2133,7 @@ SendResp_albumArt(struct upnphttp * h, char * url)
 	long long id = strtoll(url, NULL, 10);
 	const char *suffix = strrchr(url, '-');
 
-	path = sql_get_text_field(db, "SELECT PATH from DETAILS where ID = %lld", id);
+	path = sql_get_text_param(db, "SELECT PATH from DETAILS where ID = ?", "I", (int64_t)id);
 	if( !path || !suffix)
 	{
 		DPRINTF(E_WARN, L_HTTP, "ALBUM_ART ID %s not found, responding ERROR 404\n", url);
@@ -1719,96 +2141,56 @@ SendResp_albumArt(struct upnphttp * h, char * url)
 		return;
 	}
 
-#if USE_FORK
-	pid_t newpid = -1;
-#endif /* USE_FORK */
-
 	long long size_type = strtoll(suffix + 1, NULL, 10);
 	const image_size_type_t *image_size_type = get_image_size_type((image_size_type_enum)size_type);
 	if(image_size_type->type == JPEG_INV)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "Invalid image size '%s' requested, responding ERROR 404\n", url);
+		sqlite3_free(path);
 		Send404(h);
 		return;
 	}
-	art_cache_path(image_size_type, ".jpg", path, &albumart_path);
+	if( !art_cache_path(image_size_type, ".jpg", path, &albumart_path) )
+	{
+		sqlite3_free(path);
+		Send500(h);
+		return;
+	}
 
-	int fd = _open_file(albumart_path);
+	off_t size;
+	int fd = _open_file(albumart_path, &size);
 	if (fd < 0) {
 		if (fd == -403) {
 			Send403(h);
 			goto albumart_error;
 		}
 		DPRINTF(E_DEBUG, L_HTTP, "Album art doesn't exist in cache, adding new entry %s\n", albumart_path);
-#if USE_FORK
-		// XXX: Don't we need to wait a bit here??
-		newpid = process_fork(h->req_client);
-		if (newpid > 0)
-		{
-			CloseSocket_upnphttp(h);
-			goto albumart_error;
-		}
-#endif
-		char *fullsize_albumart_path = NULL;
-		if(art_cache_path(NULL, ".jpg", path, &fullsize_albumart_path))
+		/* Scaling is slow; leave it to the streaming thread. */
+		job = malloc(sizeof(struct albumart_job));
+		if( !job )
 		{
-			int ret = save_resized_album_art_from_file_to_file(fullsize_albumart_path, albumart_path, image_size_type);
-			free(fullsize_albumart_path);
-			if (ret != 0)
-			{
-				DPRINTF(E_WARN, L_HTTP, "ALBUM_ART ID %s-%s not found, responding ERROR 404\n", url, image_size_type->name);
-				Send404(h);
-				goto albumart_error;
-			}
-		}
-		else
-		{
-			DPRINTF(E_WARN, L_HTTP, "ALBUM_ART ID %s-%s: Could not format path to full-size album art for '%s', responding ERROR 404\n", url, image_size_type->name, path);
-			Send404(h);
+			Send500(h);
 			goto albumart_error;
 		}
-
-		fd = open(albumart_path, O_RDONLY);
-	}
-
-	if( fd < 0 ) {
-		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", albumart_path);
-		Send404(h);
+		job->image_size_type = image_size_type;
+		strncpyt(job->path, path, sizeof(job->path));
+		strncpyt(job->albumart_path, albumart_path, sizeof(job->albumart_path));
+		h->stream.prepare = albumart_prepare;
+		h->stream.data = job;
+		stream_start(h);
 		goto albumart_error;
 	}
 
 	DPRINTF(E_INFO, L_HTTP, "Serving album art ID: %lld [%s]\n", id, albumart_path);
 
-	size = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
-
-	INIT_STR(str, header);
-
-#if USE_FORK
-	if (newpid == 0 && (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0))
-		tmode = "Background";
+	if( albumart_stream(h, fd, size, image_size_type) == 0 )
+		stream_start(h);
 	else
-#endif
-	tmode = "Interactive";
-	start_dlna_header(&str, 200, tmode, "image/jpeg");
-	strcatf(&str, "Content-Length: %jd\r\n"
-	              "contentFeatures.dlna.org: DLNA.ORG_PN=%s\r\n\r\n",
-	              (intmax_t)size, image_size_type->name);
-
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
-	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
-	}
-	close(fd);
+		Send500(h);
 
 albumart_error:
 	sqlite3_free(path);
 	free(albumart_path);
-#if USE_FORK
-	if (newpid == 0)
-		_exit(0);
-#endif
 }
 
 static void
@@ -1831,21 +2213,13 @@ SendResp_mta(struct upnphttp * h, char * object)
 
 	id = strtoll(object, NULL, 10);
 
-	path = sql_get_text_field(db, "SELECT PATH from MTA where ID = '%lld'", id);
+	path = sql_get_text_param(db, "SELECT PATH from MTA where ID = ?", "I", (int64_t)id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "MTA ID %s not found, responding ERROR 404\n", object);
 		Send404(h);
 		return;
 	}
-#if USE_FORK
-	pid_t newpid = 0;
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		goto mta_error;
-	}
-#endif
 	DPRINTF(E_INFO, L_HTTP, "Serving MTA file ID: %lld [%s]\n", id, path);
 
 	fd = open(path, O_RDONLY);
@@ -1853,39 +2227,45 @@ SendResp_mta(struct upnphttp * h, char * object)
 		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", path);
 		sqlite3_free(path);
 		Send404(h);
-		goto mta_error;
+		return;
 	}
 
 	sqlite3_free(path);
 	size = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
 
 	INIT_STR(str, header);
 
-#if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( h->reqflags & FLAG_XFERBACKGROUND )
+	{
 		tmode = "Background";
+		h->stream.class = STREAM_BACKGROUND;
+	}
 	else
-#endif
+	{
 		tmode = "Interactive";
+		h->stream.class = STREAM_INTERACTIVE;
+	}
 
-	start_dlna_header(&str, 200, tmode, "image/jpeg");
+	start_dlna_header(h, &str, 200, tmode, "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08X%024X\r\n\r\n",
 	              (intmax_t)size, DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_TM_B|DLNA_FLAG_TM_S, 0);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
-
-	close(fd);
-mta_error:
-	CloseSocket_upnphttp(h);
-#if USE_FORK
-	if( newpid == 0 )
-		_exit(0);
-#endif
-
+	if( stream_set_header(&h->stream, str.data, str.off) != 0 )
+	{
+		close(fd);
+		Send500(h);
+		return;
+	}
+	if( h->req_command != EHead )
+	{
+		h->stream.fd = fd;
+		h->stream.offset = 0;
+		h->stream.end = size - 1;
+	}
+	else
+		close(fd);
+	stream_start(h);
 }
 
 static void
@@ -1900,7 +2280,7 @@ SendResp_caption(struct upnphttp * h, char * object)
 
 	id = strtoll(object, NULL, 10);
 
-	path = sql_get_text_field(db, "SELECT PATH from CAPTIONS where ID = %lld", id);
+	path = sql_get_text_param(db, "SELECT PATH from CAPTIONS where ID = ?", "I", (int64_t)id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "CAPTION ID %s not found, responding ERROR 404\n", object);
@@ -1909,7 +2289,7 @@ SendResp_caption(struct upnphttp * h, char * object)
 	}
 	DPRINTF(E_INFO, L_HTTP, "Serving caption ID: %lld [%s]\n", id, path);
 
-	fd = _open_file(path);
+	fd = _open_file(path, &size);
 	if( fd < 0 ) {
 		sqlite3_free(path);
 		if (fd == -403)
@@ -1919,20 +2299,21 @@ SendResp_caption(struct upnphttp * h, char * object)
 		return;
 	}
 	sqlite3_free(path);
-	size = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "smi/caption");
+	start_dlna_header(h, &str, 200, "Interactive", "smi/caption");
 	strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	stream_set_header(&h->stream, str.data, str.off);
+	if( h->req_command != EHead )
 	{
-		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+		h->stream.fd = fd;
+		h->stream.end = size-1;
 	}
-	close(fd);
+	else
+		close(fd);
+	SendStream_upnphttp(h);
 	CloseSocket_upnphttp(h);
 }
 
@@ -1954,7 +2335,7 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 	}
 
 	id = strtoll(object, NULL, 10);
-	path = sql_get_text_field(db, "SELECT PATH from DETAILS where ID = '%lld'", id);
+	path = sql_get_text_param(db, "SELECT PATH from DETAILS where ID = ?", "I", (int64_t)id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "DETAIL ID %s not found, responding ERROR 404\n", object);
@@ -1987,32 +2368,85 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_dlna_header(h, &str, 200, "Interactive", "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\r\n\r\n",
 	              (intmax_t)ed->size);
 
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
-	{
-		if( h->req_command != EHead )
-			send_data(h, (char *)ed->data, ed->size, 0);
-	}
+	stream_set_header(&h->stream, str.data, str.off);
+	if( h->req_command != EHead )
+		stream_set_body(&h->stream, (char *)ed->data, ed->size);
 	exif_data_unref(ed);
+	SendStream_upnphttp(h);
 	CloseSocket_upnphttp(h);
 }
 
+struct resize_job {
+	char path[PATH_MAX];
+	int dstw, dsth;
+	int scale;
+	int rotate;
+	int hdr_len;
+	char header[512];	/* without Content-Length */
+};
+
+/* Runs on a streaming thread.  The whole image is encoded up front,
+ * so it can be sent with a Content-Length instead of chunked. */
+static int
+resizedimg_prepare(struct upnphttp * h)
+{
+	struct resize_job *job = h->stream.data;
+	image_s *imsrc, *imdst;
+	unsigned char *data = NULL;
+	struct string_s str;
+	int size;
+
+	imsrc = image_new_from_jpeg(job->path, 1, NULL, 0, job->scale, job->rotate);
+	if( !imsrc )
+	{
+		DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", job->path);
+		return StreamError_upnphttp(h, 500, "Internal Server Error", body500, sizeof(body500) - 1);
+	}
+	imdst = image_resize(imsrc, job->dstw, job->dsth);
+	if( imdst )
+	{
+		data = image_save_to_jpeg_buf(imdst, &size);
+		image_free(imdst);
+	}
+	image_free(imsrc);
+	if( !data )
+		return StreamError_upnphttp(h, 500, "Internal Server Error", body500, sizeof(body500) - 1);
+
+	str.data = job->header;
+	str.size = sizeof(job->header);
+	str.off = job->hdr_len;
+	strcatf(&str, "Content-Length: %d\r\n\r\n", size);
+	if( stream_set_header(&h->stream, str.data, str.off) != 0 )
+	{
+		free(data);
+		return -1;
+	}
+	if( h->req_command != EHead )
+	{
+		h->stream.body = (char *)data;
+		h->stream.body_len = size;
+	}
+	else
+		free(data);
+	DPRINTF(E_INFO, L_HTTP, "Done serving %s\n", job->path);
+
+	return 0;
+}
+
 static void
 SendResp_resizedimg(struct upnphttp * h, char * object)
 {
-	char header[512];
-	char buf[128];
 	struct string_s str;
-	char **result;
+	sqlite3_stmt *stmt;
 	char dlna_pn[22];
 	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I;
-	int width=640, height=480, dstw, dsth, size;
+	int width=640, height=480, dstw, dsth;
 	int srcw, srch;
-	unsigned char * data = NULL;
 	char *path, *file_path = NULL;
 	char *resolution = NULL;
 	char *key, *val;
@@ -2020,29 +2454,37 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	int rotate;
 	int pixw = 0, pixh = 0;
 	long long id;
-	int rows=0, chunked, ret;
-	image_s *imsrc = NULL, *imdst = NULL;
+	int ret;
+	struct resize_job *job;
 	int scale = 1;
 	const char *tmode;
 
 	id = strtoll(object, &saveptr, 10);
-	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION from DETAILS where ID = '%lld'", (long long)id);
-	ret = sql_get_table(db, buf, &result, &rows, NULL);
-	if( ret != SQLITE_OK )
+	/* The row's values are used until the statement is released */
+	stmt = sql_prepare(db, "SELECT PATH, RESOLUTION, ROTATION from DETAILS where ID = ?");
+	if( !stmt )
 	{
 		Send500(h);
 		return;
 	}
-	if( rows )
+	sqlite3_bind_int64(stmt, 1, id);
+	ret = sqlite3_step(stmt);
+	if( ret == SQLITE_ROW )
 	{
-		file_path = result[3];
-		resolution = result[4];
-		rotate = result[5] ? atoi(result[5]) : 0;
+		file_path = (char *)sqlite3_column_text(stmt, 0);
+		resolution = (char *)sqlite3_column_text(stmt, 1);
+		rotate = sqlite3_column_int(stmt, 2);
+	}
+	else if( ret != SQLITE_DONE )
+	{
+		sql_release(stmt);
+		Send500(h);
+		return;
 	}
 	if( !file_path || !resolution || (access(file_path, F_OK) != 0) )
 	{
 		DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
-		sqlite3_free_table(result);
+		sql_release(stmt);
 		Send404(h);
 		return;
 	}
@@ -2069,7 +2511,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		else if( strcasecmp(key, "rotation") == 0 )
 		{
 			rotate = (rotate + atoi(val)) % 360;
-			sql_exec(db, "UPDATE DETAILS set ROTATION = %d where ID = %lld", rotate, id);
+			dbwriter_rotation(id, rotate);
 		}
 		else if( strcasecmp(key, "pixelshape") == 0 )
 		{
@@ -2079,15 +2521,6 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		}
 	}
 
-#if USE_FORK
-	pid_t newpid = 0;
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		goto resized_error;
-	}
-#endif
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
 	{
 		DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
@@ -2120,7 +2553,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	if( ret != 2 )
 	{
 		Send500(h);
-		return;
+		goto resized_error;
 	}
 	/* Figure out the best destination resolution we can use */
 	dstw = width;
@@ -2155,80 +2588,274 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	else if( srcw>>2 >= dstw && srch>>2 >= dsth )
 		scale = 2;
 
-	INIT_STR(str, header);
+	job = malloc(sizeof(struct resize_job));
+	if( !job )
+	{
+		Send500(h);
+		goto resized_error;
+	}
+	strncpyt(job->path, file_path, sizeof(job->path));
+	job->dstw = dstw;
+	job->dsth = dsth;
+	job->scale = scale;
+	job->rotate = rotate;
+
+	str.data = job->header;
+	str.size = sizeof(job->header);
+	str.off = 0;
 
-#if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( h->reqflags & FLAG_XFERBACKGROUND )
+	{
 		tmode = "Background";
+		h->stream.class = STREAM_BACKGROUND;
+	}
 	else
-#endif
+	{
 		tmode = "Interactive";
-	start_dlna_header(&str, 200, tmode, "image/jpeg");
+		h->stream.class = STREAM_INTERACTIVE;
+	}
+	start_dlna_header(h, &str, 200, tmode, "image/jpeg");
 	strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
 	              dlna_pn, dlna_flags, 0);
+	job->hdr_len = str.off;
 
-	if( strcmp(h->HttpVer, "HTTP/1.0") == 0 )
+	/* Decoding and scaling is slow; leave it to the streaming thread. */
+	h->stream.prepare = resizedimg_prepare;
+	h->stream.data = job;
+	stream_start(h);
+resized_error:
+	sql_release(stmt);
+}
+
+/* Map a TimeSeekRange onto the keyframe index built at scan time.
+ * Sets the byte range and fills in the TimeSeekRange.dlna.org response
+ * value.  Returns 0, or the HTTP error to respond with. */
+static int
+TimeSeek_upnphttp(struct upnphttp *h, int64_t id, off_t size, char *buf, int len)
+{
+	struct seek_index idx;
+	uint32_t start_ms, end_ms, duration;
+	char dur[16];
+	int i;
+
+	if( seekindex_load(db, id, &idx) != 0 )
+		return 406;
+	duration = idx.duration;
+	if( duration && h->req_TimeSeekStart >= duration )
 	{
-		chunked = 0;
-		imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
+		seekindex_free(&idx);
+		return 416;
 	}
-	else
+	i = seekindex_find(&idx, h->req_TimeSeekStart);
+	start_ms = idx.entries[i].ms;
+	h->req_RangeStart = idx.entries[i].offset;
+	h->req_RangeEnd = size - 1;
+	end_ms = duration ? duration : idx.entries[idx.count-1].ms;
+	if( h->req_TimeSeekEnd >= 0 )
 	{
-		chunked = 1;
-		strcatf(&str, "Transfer-Encoding: chunked\r\n\r\n");
+		/* Up to the keyframe after the requested end */
+		i = seekindex_find(&idx, h->req_TimeSeekEnd);
+		if( i + 1 < idx.count )
+		{
+			end_ms = idx.entries[i+1].ms;
+			h->req_RangeEnd = idx.entries[i+1].offset - 1;
+		}
 	}
+	seekindex_free(&idx);
+	if( h->req_RangeStart >= size || h->req_RangeEnd < h->req_RangeStart )
+		return 416;
+
+	if( duration )
+		snprintf(dur, sizeof(dur), "%u.%03u", duration / 1000, duration % 1000);
+	else
+		strcpy(dur, "*");
+	snprintf(buf, len, "npt=%u.%03u-%u.%03u/%s bytes=%jd-%jd/%jd",
+	         start_ms / 1000, start_ms % 1000, end_ms / 1000, end_ms % 1000, dur,
+	         (intmax_t)h->req_RangeStart, (intmax_t)h->req_RangeEnd, (intmax_t)size);
+
+	return 0;
+}
 
-	if( !chunked )
+/* Resolve a range of a multi-range request against the file size, the
+ * same way a single range is.  Returns 0, or the HTTP error to respond
+ * with. */
+static int
+resolve_range(off_t *start, off_t *end, off_t size)
+{
+	if( *start == -1 )
 	{
-		if( !imsrc )
-		{
-			DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", file_path);
-			Send500(h);
-			goto resized_error;
-		}
+		*start = *end < size ? size - *end : 0;
+		*end = size - 1;
+	}
+	else if( *end == -1 || *end == size )
+		*end = size - 1;
+	if( *start > *end || *start < 0 )
+		return 400;
+	if( *end >= size )
+		return 416;
 
-		imdst = image_resize(imsrc, dstw, dsth);
-		data = image_save_to_jpeg_buf(imdst, &size);
+	return 0;
+}
 
-		strcatf(&str, "Content-Length: %d\r\n\r\n", size);
+/* Set up a multipart/byteranges body for a request with more than one
+ * range.  The first part header goes in the stream body, the others
+ * and the closing boundary are separators in front of each further
+ * file range, so every part is still sent with sendfile.  Returns 0,
+ * or the HTTP error to respond with. */
+static int
+ByteRanges_upnphttp(struct upnphttp *h, off_t size, const char *mime, off_t *total)
+{
+	struct stream_range *r;
+	struct string_s str;
+	size_t len;
+	int i, ret;
+
+	for( i = 0; i < h->req_nRanges; i++ )
+	{
+		ret = resolve_range(&h->req_Ranges[i].start, &h->req_Ranges[i].end, size);
+		if( ret )
+			return ret;
+	}
+	r = calloc(h->req_nRanges + 1, sizeof(*r));
+	str.size = (h->req_nRanges + 2) * (192 + strlen(mime));
+	str.data = malloc(str.size);
+	str.off = 0;
+	if( !r || !str.data )
+	{
+		free(r);
+		free(str.data);
+		return 500;
 	}
 
-	if( (send_data(h, str.data, str.off, 0) == 0) && (h->req_command != EHead) )
+	*total = 0;
+	for( i = -1; i < h->req_nRanges; i++ )
 	{
-		if( chunked )
+		off_t start = i < 0 ? h->req_RangeStart : h->req_Ranges[i].start;
+		off_t end = i < 0 ? h->req_RangeEnd : h->req_Ranges[i].end;
+
+		len = str.off;
+		strcatf(&str, "%s--" BYTERANGES_BOUNDARY "\r\n"
+		              "Content-Type: %s\r\n"
+		              "Content-Range: bytes %jd-%jd/%jd\r\n\r\n",
+		              i < 0 ? "" : "\r\n", mime,
+		              (intmax_t)start, (intmax_t)end, (intmax_t)size);
+		*total += str.off - len + end - start + 1;
+		if( i < 0 )
 		{
-			imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
-			if( !imsrc )
+			/* The first part header is the body */
+			if( h->req_command != EHead &&
+			    stream_set_body(&h->stream, str.data, str.off) != 0 )
 			{
-				DPRINTF(E_WARN, L_HTTP, "Unable to open image %s!\n", file_path);
-				Send500(h);
-				goto resized_error;
+				free(r);
+				free(str.data);
+				return 500;
 			}
-			imdst = image_resize(imsrc, dstw, dsth);
-			data = image_save_to_jpeg_buf(imdst, &size);
+			str.off = 0;
+			continue;
+		}
+		r[i].offset = start;
+		r[i].end = end;
+		r[i].sep = len;
+		r[i].sep_len = str.off - len;
+	}
+	/* Nothing but the closing boundary after the last part */
+	len = str.off;
+	strcatf(&str, "\r\n--" BYTERANGES_BOUNDARY "--\r\n");
+	*total += str.off - len;
+	r[i].offset = 1;
+	r[i].end = 0;
+	r[i].sep = len;
+	r[i].sep_len = str.off - len;
+	if( str.off >= str.size )
+	{
+		free(r);
+		free(str.data);
+		return 500;
+	}
+
+	free(h->stream.ranges);
+	free(h->stream.seps);
+	h->stream.ranges = r;
+	h->stream.nranges = h->req_nRanges + 1;
+	h->stream.range = 0;
+	h->stream.seps = str.data;
+
+	return 0;
+}
+
+/* Fast forward and rewind: send only the keyframes, one for every
+ * |speed| seconds of the item, starting from the TimeSeekRange if
+ * there is one.  The first keyframe becomes the byte range and the
+ * rest are queued on the stream.  Returns 0, or the HTTP error to
+ * respond with. */
+static int
+TrickPlay_upnphttp(struct upnphttp *h, int64_t id, off_t size, off_t *total)
+{
+	struct seek_index idx;
+	struct seek_entry *e;
+	struct stream_range *r;
+	uint32_t step, next;
+	int i, n = 0;
+
+	if( h->req_PlaySpeed == 0 )
+		return 406;
+	if( seekindex_load(db, id, &idx) != 0 )
+		return 406;
+	r = calloc(idx.count, sizeof(*r));
+	if( !r )
+	{
+		seekindex_free(&idx);
+		return 500;
+	}
+	step = abs(h->req_PlaySpeed) * SEEK_INDEX_INTERVAL;
+	if( h->reqflags & FLAG_TIMESEEK )
+		i = seekindex_find(&idx, h->req_TimeSeekStart);
+	else
+		i = h->req_PlaySpeed > 0 ? 0 : idx.count - 1;
 
-			ret = sprintf(buf, "%x\r\n", size);
-			send_data(h, buf, ret, MSG_MORE);
-			send_data(h, (char *)data, size, MSG_MORE);
-			send_data(h, "\r\n0\r\n\r\n", 7, 0);
+	*total = 0;
+	while( i >= 0 && i < idx.count )
+	{
+		e = &idx.entries[i];
+		/* The last keyframe may run to the end of the file */
+		if( e->len && e->offset + e->len <= size )
+		{
+			r[n].offset = e->offset;
+			r[n].end = e->offset + e->len - 1;
+			*total += e->len;
+			n++;
+		}
+		if( h->req_PlaySpeed > 0 )
+		{
+			next = e->ms + step;
+			while( i < idx.count && idx.entries[i].ms < next )
+				i++;
 		}
 		else
 		{
-			send_data(h, (char *)data, size, 0);
+			if( e->ms < step )
+				break;
+			next = e->ms - step;
+			while( i >= 0 && idx.entries[i].ms > next )
+				i--;
 		}
 	}
-	DPRINTF(E_INFO, L_HTTP, "Done serving %s\n", file_path);
-	if( imsrc )
-		image_free(imsrc);
-	if( imdst )
-		image_free(imdst);
-	CloseSocket_upnphttp(h);
-resized_error:
-	sqlite3_free_table(result);
-#if USE_FORK
-	if( newpid == 0 )
-		_exit(0);
-#endif
+	seekindex_free(&idx);
+	if( !n )
+	{
+		free(r);
+		return 406;
+	}
+
+	h->req_RangeStart = r[0].offset;
+	h->req_RangeEnd = r[0].end;
+	memmove(r, r + 1, (n - 1) * sizeof(*r));
+	free(h->stream.ranges);
+	h->stream.ranges = r;
+	h->stream.nranges = n - 1;
+	h->stream.range = 0;
+
+	return 0;
 }
 
 static void
@@ -2236,9 +2863,8 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 {
 	char header[1024];
 	struct string_s str;
-	char buf[128];
-	char **result;
-	int rows, ret;
+	sqlite3_stmt *stmt;
+	int ret;
 	off_t total, offset, size;
 	int64_t id;
 	int sendfh;
@@ -2246,15 +2872,11 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	uint32_t cflags = h->req_client ? h->req_client->type->flags : 0;
 	const char *tmode;
 	enum client_types ctype = h->req_client ? h->req_client->type->type : 0;
-	static struct { int64_t id;
-	                enum client_types client;
-	                char path[PATH_MAX];
-	                char mime[32];
-	                char dlna[96];
-	              } last_file = { 0, 0 };
-#if USE_FORK
-	pid_t newpid = 0;
-#endif
+	struct file_info last_file;
+	char npt[128] = "";
+	const char *ps = "";
+	const char *mime;
+	int trick = 0;
 
 	id = strtoll(object, NULL, 10);
 	if( cflags & FLAG_MS_PFS )
@@ -2262,7 +2884,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		if( strstr(object, "?albumArt=true") )
 		{
 			char *art;
-			art = sql_get_text_field(db, "SELECT ALBUM_ART from DETAILS where ID = '%lld'", id);
+			art = sql_get_text_param(db, "SELECT ALBUM_ART from DETAILS where ID = ?", "I", id);
 			if (art)
 			{
 				SendResp_albumArt(h, art);
@@ -2273,63 +2895,72 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			return;
 		}
 	}
-	if( id != last_file.id || ctype != last_file.client )
+	if( filecache_get(id, ctype, &last_file) != 0 )
 	{
-		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN from DETAILS where ID = '%lld'", (long long)id);
-		ret = sql_get_table(db, buf, &result, &rows, NULL);
-		if( (ret != SQLITE_OK) )
+		const char *path, *mime, *pn, *bitrate;
+
+		stmt = sql_prepare(db, "SELECT PATH, MIME, DLNA_PN,"
+		                       " (SELECT 1 from CAPTIONS c where c.ID = d.ID),"
+		                       " (SELECT 1 from SEEK_INDEX s where s.ID = d.ID), BITRATE"
+		                       " from DETAILS d where ID = ?");
+		if( !stmt )
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Didn't find valid file for %lld!\n", (long long)id);
+			Send500(h);
+			return;
+		}
+		sqlite3_bind_int64(stmt, 1, id);
+		ret = sqlite3_step(stmt);
+		if( ret != SQLITE_ROW && ret != SQLITE_DONE )
 		{
 			DPRINTF(E_ERROR, L_HTTP, "Didn't find valid file for %lld!\n", (long long)id);
+			sql_release(stmt);
 			Send500(h);
 			return;
 		}
-		if( !rows || !result[3] || !result[4] )
+		path = (ret == SQLITE_ROW) ? (const char *)sqlite3_column_text(stmt, 0) : NULL;
+		mime = (ret == SQLITE_ROW) ? (const char *)sqlite3_column_text(stmt, 1) : NULL;
+		if( !path || !mime )
 		{
 			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
-			sqlite3_free_table(result);
+			sql_release(stmt);
 			Send404(h);
 			return;
 		}
+		memset(&last_file, 0, sizeof(last_file));
+		strncpy(last_file.path, path, sizeof(last_file.path)-1);
+		strncpy(last_file.mime, mime, sizeof(last_file.mime)-1);
+		/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
+		if( cflags & FLAG_SAMSUNG )
+		{
+			if( strcmp(last_file.mime+6, "x-matroska") == 0 )
+				strcpy(last_file.mime+8, "mkv");
+			/* Samsung TV's such as the A750 can natively support many
+			   Xvid/DivX AVI's however, the DLNA server needs the 
+			   mime type to say video/mpeg */
+			else if( ctype == ESamsungSeriesA && strcmp(last_file.mime+6, "x-msvideo") == 0 )
+				strcpy(last_file.mime+6, "mpeg");
+		}
+		/* ... and Sony BDP-S370 won't play MKV unless we pretend it's a DiVX file */
+		else if( ctype == ESonyBDP )
+		{
+			if( strcmp(last_file.mime+6, "x-matroska") == 0 ||
+			    strcmp(last_file.mime+6, "mpeg") == 0 )
+				strcpy(last_file.mime+6, "divx");
+		}
+		if( (pn = (const char *)sqlite3_column_text(stmt, 2)) )
+			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;", pn);
+		last_file.captions = (sqlite3_column_type(stmt, 3) != SQLITE_NULL);
+		last_file.seek = (sqlite3_column_type(stmt, 4) != SQLITE_NULL);
+		if( (bitrate = (const char *)sqlite3_column_text(stmt, 5)) )
+			last_file.bitrate = strtoul(bitrate, NULL, 10);
+		/* The scanner stores audio bitrates in bits per second */
+		if( strncmp(last_file.mime, "audio", 5) == 0 )
+			last_file.bitrate /= 8;
+		sql_release(stmt);
 		/* Cache the result */
-		last_file.id = id;
-		last_file.client = ctype;
-		strncpy(last_file.path, result[3], sizeof(last_file.path)-1);
-		if( result[4] )
-		{
-			strncpy(last_file.mime, result[4], sizeof(last_file.mime)-1);
-			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
-			if( cflags & FLAG_SAMSUNG )
-			{
-				if( strcmp(last_file.mime+6, "x-matroska") == 0 )
-					strcpy(last_file.mime+8, "mkv");
-				/* Samsung TV's such as the A750 can natively support many
-				   Xvid/DivX AVI's however, the DLNA server needs the 
-				   mime type to say video/mpeg */
-				else if( ctype == ESamsungSeriesA && strcmp(last_file.mime+6, "x-msvideo") == 0 )
-					strcpy(last_file.mime+6, "mpeg");
-			}
-			/* ... and Sony BDP-S370 won't play MKV unless we pretend it's a DiVX file */
-			else if( ctype == ESonyBDP )
-			{
-				if( strcmp(last_file.mime+6, "x-matroska") == 0 ||
-				    strcmp(last_file.mime+6, "mpeg") == 0 )
-					strcpy(last_file.mime+6, "divx");
-			}
-		}
-		if( result[5] )
-			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;", result[5]);
-		else
-			last_file.dlna[0] = '\0';
-		sqlite3_free_table(result);
+		filecache_put(id, ctype, &last_file);
 	}
-#if USE_FORK
-	newpid = process_fork(h->req_client);
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		return;
-	}
-#endif
 
 	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file.path);
 
@@ -2363,7 +2994,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		}
 	}
 
-	sendfh = _open_file(last_file.path);
+	sendfh = _open_file(last_file.path, &size);
 	if( sendfh < 0 ) {
 		if (sendfh == -403)
 			Send403(h);
@@ -2371,8 +3002,6 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			Send404(h);
 		goto error;
 	}
-	size = lseek(sendfh, 0, SEEK_END);
-	lseek(sendfh, 0, SEEK_SET);
 
 	/* Special case: 'Range: bytes=-500' --> get final 500 bytes (inclusive) */
 	if(h->req_RangeStart == -1 && h->req_RangeEnd > 0)
@@ -2380,22 +3009,75 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		h->req_RangeStart = size - h->req_RangeEnd;
 		h->req_RangeEnd = size - 1;
 	}
+	/* A byte range wins over a time range or a play speed */
+	else if( (h->reqflags & FLAG_PLAYSPEED) && h->req_PlaySpeed != 1 &&
+	         !(h->reqflags & FLAG_RANGE) )
+	{
+		ret = 406;
+		if( last_file.seek && seekindex_trickmode(last_file.mime) )
+			ret = TrickPlay_upnphttp(h, id, size, &total);
+		if( ret )
+		{
+			DPRINTF(E_WARN, L_HTTP, "PlaySpeed %d not possible, responding ERROR %d\n",
+				h->req_PlaySpeed, ret);
+			if( ret == 500 )
+				Send500(h);
+			else
+				Send406(h);
+			close(sendfh);
+			goto error;
+		}
+		trick = 1;
+	}
+	else if( (h->reqflags & FLAG_TIMESEEK) && !(h->reqflags & FLAG_RANGE) )
+	{
+		ret = TimeSeek_upnphttp(h, id, size, npt, sizeof(npt));
+		if( ret )
+		{
+			DPRINTF(E_WARN, L_HTTP, "TimeSeek to %d ms failed, responding ERROR %d\n",
+				h->req_TimeSeekStart, ret);
+			if( ret == 416 )
+				Send416(h);
+			else
+				Send406(h);
+			close(sendfh);
+			goto error;
+		}
+	}
 
 	offset = h->req_RangeStart;
 
 	INIT_STR(str, header);
 
-#if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( h->reqflags & FLAG_XFERBACKGROUND )
+	{
 		tmode = "Background";
-	else
-#endif
-	if( strncmp(last_file.mime, "image", 5) == 0 )
+		h->stream.class = STREAM_BACKGROUND;
+	}
+	else if( strncmp(last_file.mime, "image", 5) == 0 )
+	{
 		tmode = "Interactive";
+		h->stream.class = STREAM_INTERACTIVE;
+	}
+	else if( h->reqflags & FLAG_XFERINTERACTIVE )
+	{
+		/* Answered as Streaming (see above), but not paced as such */
+		tmode = "Streaming";
+		h->stream.class = STREAM_INTERACTIVE;
+	}
 	else
+	{
 		tmode = "Streaming";
+		/* Trick mode skips most of the file, so the bitrate means nothing */
+		if( !trick )
+			h->stream.rate = stream_rate(last_file.bitrate);
+	}
 
-	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
+	if( (h->reqflags & FLAG_RANGE) && h->req_nRanges )
+		mime = "multipart/byteranges; boundary=" BYTERANGES_BOUNDARY;
+	else
+		mime = last_file.mime;
+	start_dlna_header(h, &str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, mime);
 
 	if( h->reqflags & FLAG_RANGE )
 	{
@@ -2419,11 +3101,44 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			goto error;
 		}
 
+		if( h->req_nRanges )
+		{
+			ret = ByteRanges_upnphttp(h, size, last_file.mime, &total);
+			if( ret )
+			{
+				DPRINTF(E_WARN, L_HTTP, "Specified ranges were invalid, responding ERROR %d\n", ret);
+				if( ret == 416 )
+					Send416(h);
+				else if( ret == 400 )
+					Send400(h);
+				else
+					Send500(h);
+				close(sendfh);
+				goto error;
+			}
+			strcatf(&str, "Content-Length: %jd\r\n", (intmax_t)total);
+		}
+		else
+		{
+			total = h->req_RangeEnd - h->req_RangeStart + 1;
+			strcatf(&str, "Content-Length: %jd\r\n"
+			              "Content-Range: bytes %jd-%jd/%jd\r\n",
+			              (intmax_t)total, (intmax_t)h->req_RangeStart,
+			              (intmax_t)h->req_RangeEnd, (intmax_t)size);
+		}
+	}
+	else if( trick )
+	{
+		strcatf(&str, "Content-Length: %jd\r\n"
+		              "PlaySpeed.dlna.org: speed=%d\r\n",
+		              (intmax_t)total, h->req_PlaySpeed);
+	}
+	else if( *npt )
+	{
 		total = h->req_RangeEnd - h->req_RangeStart + 1;
 		strcatf(&str, "Content-Length: %jd\r\n"
-		              "Content-Range: bytes %jd-%jd/%jd\r\n",
-		              (intmax_t)total, (intmax_t)h->req_RangeStart,
-		              (intmax_t)h->req_RangeEnd, (intmax_t)size);
+		              "TimeSeekRange.dlna.org: %s\r\n",
+		              (intmax_t)total, npt);
 	}
 	else
 	{
@@ -2448,27 +3163,32 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	{
 		char buf[LOCATION_URL_MAX_LEN] = {};
 		const char* host = get_location_url_by_lan_addr(buf, h->iface);
-		if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%lld'", (long long)id) > 0 )
+		if( last_file.captions )
 			strcatf(&str, "CaptionInfo.sec: %s/Captions/%lld.srt\r\n", host, (long long)id);
 	}
 
+	if( last_file.seek && seekindex_trickmode(last_file.mime) )
+		ps = "DLNA.ORG_PS=" SEEK_INDEX_SPEEDS ";";
 	strcatf(&str, "Accept-Ranges: bytes\r\n"
-	              "contentFeatures.dlna.org: %sDLNA.ORG_OP=%02X;DLNA.ORG_CI=%X;DLNA.ORG_FLAGS=%08X%024X\r\n\r\n",
-	              last_file.dlna, 1, 0, dlna_flags, 0);
+	              "contentFeatures.dlna.org: %sDLNA.ORG_OP=%02X;%sDLNA.ORG_CI=%X;DLNA.ORG_FLAGS=%08X%024X\r\n\r\n",
+	              last_file.dlna, last_file.seek ? 0x11 : 0x01, ps, 0, dlna_flags, 0);
 
 	//DEBUG DPRINTF(E_DEBUG, L_HTTP, "RESPONSE: %s\n", str.data);
-	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
+	if( stream_set_header(&h->stream, str.data, str.off) != 0 )
 	{
-		if( h->req_command != EHead )
-			send_file(h, sendfh, offset, h->req_RangeEnd);
+		close(sendfh);
+		Send500(h);
+		goto error;
 	}
-	close(sendfh);
-
-	CloseSocket_upnphttp(h);
+	if( h->req_command != EHead )
+	{
+		h->stream.fd = sendfh;
+		h->stream.offset = offset;
+		h->stream.end = h->req_RangeEnd;
+	}
+	else
+		close(sendfh);
+	stream_start(h);
 error:
-#if USE_FORK
-	if( newpid == 0 )
-		_exit(0);
-#endif
 	return;
 }
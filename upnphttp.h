@@ -51,8 +51,10 @@
 
 #include <netinet/in.h>
 #include <sys/queue.h>
+#include <time.h>
 
 #include "minidlnatypes.h"
+#include "streamer.h"
 #include "config.h"
 
 /* server: HTTP header returned in all HTTP responses : */
@@ -62,6 +64,10 @@
  states :
   0 - waiting for data to read
   1 - waiting for HTTP Post Content.
+  2 - waiting for HTTP chunked body.
+  3 - response owned by a streaming thread
+  4 - waiting for the socket to take the rest of the response
+  5 - response queued for a streaming thread
   ...
   >= 100 - to be deleted
 */
@@ -74,30 +80,53 @@ enum httpCommands {
 	EUnSubscribe
 };
 
+/* Byte ranges past the first one in a single request; any more than
+ * this and the Range header is ignored */
+#define HTTP_MAX_RANGES 16
+
+struct http_range {
+	off_t start;	/* -1 for a suffix range */
+	off_t end;	/* -1 if open ended */
+};
+
+/* A header value, as its position in req_buf.  The buffer moves as
+ * the request body comes in, so nothing keeps pointers into it. */
+struct http_slice {
+	int off;	/* 0 if the header wasn't there */
+	int len;
+};
+#define HTTP_SLICE(h, s) ((h)->req_buf + (s).off)
+
 struct upnphttp {
 	struct event ev;
 	struct in_addr clientaddr;	/* client address */
 	int iface;
 	int state;
+	int requests;		/* requests served on this connection */
+	time_t idle;		/* when we started waiting for a request,
+				 * or last had the socket take more */
 	char HttpVer[16];
 	/* request */
-	char * req_buf;
+	char * req_buf;		/* kept for the next request on the connection */
 	int req_buflen;
+	int req_bufsize;
+	int req_scanoff;	/* where to resume looking for the end of the headers */
 	int req_contentlen;
 	int req_contentoff;     /* header length */
 	enum httpCommands req_command;
 	struct client_cache_s * req_client;
-	const char * req_soapAction;
-	int req_soapActionLen;
-	const char * req_Callback;	/* For SUBSCRIBE */
-	int req_CallbackLen;
-	const char * req_NT;
-	int req_NTLen;
+	struct http_slice req_soapAction;
+	struct http_slice req_Callback;	/* For SUBSCRIBE */
+	struct http_slice req_NT;
 	int req_Timeout;
-	const char * req_SID;		/* For UNSUBSCRIBE */
-	int req_SIDLen;
+	struct http_slice req_SID;	/* For UNSUBSCRIBE */
 	off_t req_RangeStart;
 	off_t req_RangeEnd;
+	struct http_range req_Ranges[HTTP_MAX_RANGES];	/* after the first */
+	int req_nRanges;
+	int req_TimeSeekStart;		/* milliseconds */
+	int req_TimeSeekEnd;		/* milliseconds, or -1 */
+	int req_PlaySpeed;		/* 0 for fractional speeds */
 	long int req_chunklen;
 	uint32_t reqflags;
 	/* response */
@@ -105,8 +134,11 @@ struct upnphttp {
 	int res_buflen;
 	int res_buf_alloclen;
 	uint32_t respflags;
+	const char * res_SID;	/* with FLAG_SID */
+	int res_SIDLen;
 	/*int res_contentlen;*/
 	/*int res_contentoff;*/		/* header length */
+	struct stream stream;
 	LIST_ENTRY(upnphttp) entries;
 };
 
@@ -115,6 +147,7 @@ struct upnphttp {
 #define FLAG_RANGE              0x00000004
 #define FLAG_HOST               0x00000008
 #define FLAG_LANGUAGE           0x00000010
+#define FLAG_RETRY_AFTER        0x00000020
 
 #define FLAG_INVALID_REQ        0x00000040
 #define FLAG_HTML               0x00000080
@@ -127,6 +160,7 @@ struct upnphttp {
 #define FLAG_XFERINTERACTIVE    0x00002000
 #define FLAG_XFERBACKGROUND     0x00004000
 #define FLAG_CAPTION            0x00008000
+#define FLAG_KEEPALIVE          0x00010000
 
 #ifndef MSG_MORE
 #define MSG_MORE 0
@@ -136,7 +170,9 @@ struct upnphttp {
 struct upnphttp *
 New_upnphttp(int);
 
-/* CloseSocket_upnphttp() */
+/* CloseSocket_upnphttp()
+ * done with the current response: either get ready for the next
+ * request on a persistent connection, or close the socket */
 void
 CloseSocket_upnphttp(struct upnphttp *);
 
@@ -146,7 +182,9 @@ Delete_upnphttp(struct upnphttp *);
 
 /* BuildHeader_upnphttp()
  * build the header for the HTTP Response
- * also allocate the buffer for body data */
+ * also allocate the buffer for body data.  A bodylen of -1 leaves
+ * out Content-Length, for a body that is chunked (FLAG_CHUNKED in
+ * respflags) or ends when the connection closes. */
 void
 BuildHeader_upnphttp(struct upnphttp * h, int respcode,
                      const char * respmsg,
@@ -170,10 +208,26 @@ void
 Send500(struct upnphttp *);
 void
 Send501(struct upnphttp *);
+void
+Send503(struct upnphttp *);
 
 /* SendResp_upnphttp() */
 void
 SendResp_upnphttp(struct upnphttp *);
 
+/* SendFill_upnphttp()
+ * send the header in res_buf, followed by whatever fill() produces.
+ * The stream owns data from here on and hands it to release(). */
+void
+SendFill_upnphttp(struct upnphttp *, stream_fill_t *fill,
+                  stream_release_t *release, void *data);
+
+/* SendStream_upnphttp()
+ * send what is set up in h->stream from the main loop, going back to
+ * the event loop whenever the socket is full.  A following
+ * CloseSocket_upnphttp() is deferred until the transfer is done. */
+void
+SendStream_upnphttp(struct upnphttp *);
+
 #endif
 
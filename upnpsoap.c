@@ -60,6 +60,9 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include "event.h"
 #include "upnpglobalvars.h"
@@ -70,6 +73,10 @@
 #include "upnpreplyparse.h"
 #include "getifaddr.h"
 #include "scanner.h"
+#include "seekindex.h"
+#include "browsecache.h"
+#include "search.h"
+#include "dbwriter.h"
 #include "sql.h"
 #include "log.h"
 
@@ -131,20 +138,20 @@ _SoapError(struct upnphttp * h, int errCode, const char * errDesc, const char *f
 	CloseSocket_upnphttp(h);
 }
 
+static const char beforebody[] =
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>";
+
+static const char afterbody[] =
+	"</s:Body>"
+	"</s:Envelope>\r\n";
+
 static void
 BuildSendAndCloseSoapResp(struct upnphttp * h,
                           const char * body, int bodylen)
 {
-	static const char beforebody[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-		"<s:Body>";
-
-	static const char afterbody[] =
-		"</s:Body>"
-		"</s:Envelope>\r\n";
-
 	if (!body || bodylen < 0)
 	{
 		Send500(h);
@@ -729,6 +736,22 @@ _alphasort_alt_title(char **title, char **alt_title, int requested, int returned
 	free(old_title);
 }
 
+/* The base of our URLs for this response, worked out on first use */
+static const char *
+response_host(struct Response *args)
+{
+	const char *host;
+
+	if( !args->host[0] )
+	{
+		host = get_location_url_by_lan_addr(args->host, args->iface);
+		if( host != args->host )
+			strncpyt(args->host, host, sizeof(args->host));
+	}
+
+	return args->host;
+}
+
 inline static void
 add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
                 char *detailID, struct Response *args)
@@ -751,8 +774,7 @@ add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
 		strcatf(args->str, "resolution=\"%dx%d\" ", dstw, dsth);
 	}
 
-	char buf[LOCATION_URL_MAX_LEN] = {};
-	const char* host = get_location_url_by_lan_addr(buf, args->iface);
+	const char *host = response_host(args);
 	strcatf(args->str, "protocolInfo=\"http-get:*:image/jpeg:"
 	                          "DLNA.ORG_PN=%s;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\"&gt;"
 	                          "%s/Resized/%s.jpg?width=%d,height=%d"
@@ -790,8 +812,7 @@ add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
 		strcatf(args->str, "resolution=\"%s\" ", resolution);
 	}
 
-	char buf[LOCATION_URL_MAX_LEN] = {};
-	const char* host = get_location_url_by_lan_addr(buf, args->iface);
+	const char *host = response_host(args);
 
 	if( args->filter & FILTER_PV_SUBTITLE )
 	{
@@ -816,10 +837,13 @@ get_child_count(const char *object, struct magic_container_s *magic)
 
 	if (magic && magic->child_count)
 		ret = sql_get_int_field(db, "SELECT count(*) from %s", magic->child_count);
-	else if (magic && magic->objectid && *(magic->objectid))
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", *(magic->objectid));
 	else
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", object);
+	{
+		if (magic && magic->objectid && *(magic->objectid))
+			object = *(magic->objectid);
+		ret = sql_get_int_param(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?",
+		                        "t", object);
+	}
 
 	return (ret > 0) ? ret : 0;
 }
@@ -828,16 +852,22 @@ static int
 object_exists(const char *object)
 {
 	int ret;
-	ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'",
-				strcmp(object, "*") == 0 ? "0" : object);
+	ret = sql_get_int_param(db, "SELECT count(*) from OBJECTS where OBJECT_ID = ?",
+				"t", strcmp(object, "*") == 0 ? "0" : object);
 	return (ret > 0);
 }
 
 #define COLUMNS "o.DETAIL_ID, o.CLASS," \
                 " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
                 " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
-                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.MTA, d.DISC "
+                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.MTA, d.DISC," \
+                " (SELECT 1 from SEEK_INDEX s where s.ID = d.ID), c.ID, b.SEC, b.WATCH_COUNT, o.CHILD_COUNT "
 #define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
+/* What COLUMNS selects from.  CAPTIONS and BOOKMARKS have at most one
+ * row per item, so joining them doesn't multiply results. */
+#define FROM_OBJECTS "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)" \
+                     " left join CAPTIONS c on (c.ID = d.ID)" \
+                     " left join BOOKMARKS b on (b.ID = d.ID)"
 
 static int
 append_with_attributes(struct string_s *str, const char *attribute, const char *value, const char *elementName)
@@ -852,14 +882,16 @@ callback(void *args, int argc, char **argv, char **azColName)
 	char *id = argv[0], *parent = argv[1], *refID = argv[2], *detailID = argv[3], *class = argv[4], *size = argv[5], *title = argv[6],
 	     *duration = argv[7], *bitrate = argv[8], *sampleFrequency = argv[9], *artist = argv[10], *album = argv[11],
 	     *genre = argv[12], *comment = argv[13], *nrAudioChannels = argv[14], *track = argv[15], *date = argv[16], *resolution = argv[17],
-	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23], *mta = argv[24], *disc = argv[25];
-	char dlna_buf[128];
+	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23], *mta = argv[24], *disc = argv[25],
+	     *seek = argv[26], *captions = argv[27], *bookmark = argv[28], *watch_count = argv[29],
+	     *child_count = argv[30];
+	char dlna_buf[192];
+	const char *ps = "";
 	const char *ext;
 	struct string_s *str = passed_args->str;
 	int ret = 0;
 
-	char buf[LOCATION_URL_MAX_LEN] = {};
-	const char* host = get_location_url_by_lan_addr(buf, passed_args->iface);
+	const char *host = response_host(passed_args);
 
 	/* Make sure we have at least 8KB left of allocated memory to finish the response. */
 	if( str->off > (str->size - 8192) )
@@ -937,12 +969,10 @@ callback(void *args, int argc, char **argv, char **azColName)
 					strcpy(mime+6, "mpeg");
 				}
 			}
-			if( (passed_args->flags & FLAG_CAPTION_RES) ||
-			    (passed_args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE)) )
-			{
-				if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%s'", detailID) > 0 )
-					passed_args->flags |= FLAG_HAS_CAPTIONS;
-			}
+			if( captions &&
+			    ((passed_args->flags & FLAG_CAPTION_RES) ||
+			     (passed_args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE))) )
+				passed_args->flags |= FLAG_HAS_CAPTIONS;
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
 			if( passed_args->flags & FLAG_SAMSUNG )
 			{
@@ -1004,17 +1034,21 @@ callback(void *args, int argc, char **argv, char **azColName)
 		if( passed_args->flags & FLAG_SKIP_DLNA_PN )
 			dlna_pn = NULL;
 
+		if( seek && seekindex_trickmode(mime) )
+			ps = "DLNA.ORG_PS=" SEEK_INDEX_SPEEDS ";";
 		if( dlna_pn )
 			snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_PN=%s;"
-			                                     "DLNA.ORG_OP=01;"
+			                                     "DLNA.ORG_OP=%s;"
+			                                     "%s"
 			                                     "DLNA.ORG_CI=0;"
 			                                     "DLNA.ORG_FLAGS=%08X%024X",
-			                                     dlna_pn, dlna_flags, 0);
+			                                     dlna_pn, seek ? "11" : "01", ps, dlna_flags, 0);
 		else if( passed_args->flags & FLAG_DLNA )
-			snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_OP=01;"
+			snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_OP=%s;"
+			                                     "%s"
 			                                     "DLNA.ORG_CI=0;"
 			                                     "DLNA.ORG_FLAGS=%08X%024X",
-			                                     dlna_flags, 0);
+			                                     seek ? "11" : "01", ps, dlna_flags, 0);
 		else
 			strcpy(dlna_buf, "*");
 
@@ -1037,7 +1071,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 		}
 		if( (passed_args->filter & FILTER_BOOKMARK_MASK) ) {
 			/* Get bookmark */
-			int sec = sql_get_int_field(db, "SELECT SEC from BOOKMARKS where ID = '%s'", detailID);
+			int sec = bookmark ? atoi(bookmark) : 0;
 			if( sec > 0 ) {
 				/* This format is wrong according to the UPnP/AV spec.  It should be in duration format,
 				** so HH:MM:SS. But Kodi seems to be the only user of this tag, and it only works with a
@@ -1052,7 +1086,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 			}
 			if( passed_args->filter & FILTER_UPNP_PLAYBACKCOUNT ) {
 				ret = strcatf(str, "&lt;upnp:playbackCount&gt;%d&lt;/upnp:playbackCount&gt;",
-				              sql_get_int_field(db, "SELECT WATCH_COUNT from BOOKMARKS where ID = '%s'", detailID));
+				              watch_count ? atoi(watch_count) : 0);
 			}
 		}
 		free(alt_title);
@@ -1259,7 +1293,9 @@ callback(void *args, int argc, char **argv, char **azColName)
 			ret = strcatf(str, "searchable=\"%d\" ", check_magic_container(id, passed_args->flags) ? 0 : 1);
 		}
 		if( passed_args->filter & FILTER_CHILDCOUNT ) {
-			ret = strcatf(str, "childCount=\"%d\"", get_child_count(id, check_magic_container(id, passed_args->flags)));
+			struct magic_container_s *magic = check_magic_container(id, passed_args->flags);
+			ret = strcatf(str, "childCount=\"%d\"",
+			              magic ? get_child_count(id, magic) : (child_count ? atoi(child_count) : 0));
 		}
 		/* If the client calls for BrowseMetadata on root, we have to include our "upnp:searchClass"'s, unless they're filtered out */
 		if( passed_args->requested == 1 && strcmp(id, "0") == 0 && (passed_args->filter & FILTER_UPNP_SEARCHCLASS) ) {
@@ -1322,6 +1358,400 @@ callback(void *args, int argc, char **argv, char **azColName)
 	return 0;
 }
 
+/* A Browse or Search result too big for one DIDL_CHUNK_SIZE buffer,
+ * sent from the stream as the rows come out of the database */
+struct didl_stream {
+	sqlite3_stmt *stmt;	/* NULL once every row is in */
+	struct Response args;
+	struct string_s str;	/* the DIDL for the next piece */
+	const char *action;	/* "Browse" or "Search" */
+	int totalMatches;
+	int chunked;		/* else the body ends when we close */
+	int started;
+	int done;
+};
+
+/* Keep the sort keys of the current row, the last columns of the
+ * statement, as where the page ended. */
+static void
+keyset_save(sqlite3_stmt *stmt, struct browse_cursor *cursor)
+{
+	struct browse_key *key;
+	int base, i;
+
+	base = sqlite3_column_count(stmt) - cursor->nkeys;
+	for( i = 0; i < cursor->nkeys; i++ )
+	{
+		key = &cursor->key[i];
+		key->type = sqlite3_column_type(stmt, base + i);
+		switch( key->type )
+		{
+		case SQLITE_INTEGER:
+			key->i = sqlite3_column_int64(stmt, base + i);
+			break;
+		case SQLITE_FLOAT:
+			key->f = sqlite3_column_double(stmt, base + i);
+			break;
+		case SQLITE_NULL:
+			break;
+		default:
+			key->type = SQLITE_TEXT;
+			key->text = strdup((const char *)sqlite3_column_text(stmt, base + i));
+			break;
+		}
+	}
+}
+
+/* Feed rows to callback() until the response has reached limit
+ * bytes.  Returns SQLITE_ROW if there may be more. */
+static int
+didl_step(sqlite3_stmt *stmt, struct Response *args, int limit)
+{
+	char *argv[64];
+	int argc, i;
+	int ret = SQLITE_ROW;
+
+	argc = MIN(sqlite3_column_count(stmt), 64);
+	while( args->str->off < limit &&
+	       (ret = sqlite3_step(stmt)) == SQLITE_ROW )
+	{
+		args->rows++;
+		for( i = 0; i < argc; i++ )
+			argv[i] = (char *)sqlite3_column_text(stmt, i);
+		if( callback(args, argc, argv, NULL) != 0 )
+			return SQLITE_ABORT;
+		if( args->cursor && ++args->cursor->rows == args->requested )
+			keyset_save(stmt, args->cursor);
+	}
+
+	return ret;
+}
+
+/* The values for a DIDL query's parameters.  Object IDs, the page and
+ * search values are all bound rather than printed into the SQL, so the
+ * statement text (and the cached statement) stays the same from page
+ * to page and container to container. */
+struct didl_params {
+	const char *id;				/* :id */
+	const char *lo, *hi;			/* :lo, :hi */
+	int start, count;			/* :start, :count */
+	const struct browse_cursor *from;	/* :k0, :k1, ... */
+	const struct search_criteria *search;	/* :v1, :v2, ... */
+};
+
+/* Copied, since a streamed response outlives the request's values */
+static void
+bind_text(sqlite3_stmt *stmt, const char *name, const char *value)
+{
+	int i;
+
+	if( value && (i = sqlite3_bind_parameter_index(stmt, name)) )
+		sqlite3_bind_text(stmt, i, value, -1, SQLITE_TRANSIENT);
+}
+
+static void
+bind_int(sqlite3_stmt *stmt, const char *name, int value)
+{
+	int i;
+
+	if( (i = sqlite3_bind_parameter_index(stmt, name)) )
+		sqlite3_bind_int(stmt, i, value);
+}
+
+static void
+didl_bind(sqlite3_stmt *stmt, const struct didl_params *p)
+{
+	const struct browse_cursor *from = p->from;
+	int i, k;
+
+	if( p->search )
+		search_bind(p->search, stmt);
+	bind_text(stmt, ":id", p->id);
+	bind_text(stmt, ":lo", p->lo);
+	bind_text(stmt, ":hi", p->hi);
+	bind_int(stmt, ":start", p->start);
+	bind_int(stmt, ":count", p->count);
+	for( k = 0; from && k < from->nkeys; k++ )
+	{
+		const struct browse_key *key = &from->key[k];
+		char name[8];
+
+		snprintf(name, sizeof(name), ":k%d", k);
+		if( !(i = sqlite3_bind_parameter_index(stmt, name)) )
+			continue;
+		if( key->type == SQLITE_INTEGER )
+			sqlite3_bind_int64(stmt, i, key->i);
+		else if( key->type == SQLITE_FLOAT )
+			sqlite3_bind_double(stmt, i, key->f);
+		else if( key->type == SQLITE_TEXT )
+			sqlite3_bind_text(stmt, i, key->text, -1, SQLITE_TRANSIENT);
+	}
+}
+
+/* Like sqlite3_exec() with callback(), but in WAL mode stops at
+ * DIDL_CHUNK_SIZE and leaves the rest of the rows to didl_fill() in
+ * *stmt.  *stmt is NULL if the result is to be sent as usual. */
+static int
+didl_exec(const char *sql, const struct didl_params *p,
+          struct Response *args, sqlite3_stmt **stmt, char **errmsg)
+{
+	int ret = SQLITE_ERROR;
+
+	*stmt = sql_prepare(db, sql);
+	if( *stmt )
+	{
+		didl_bind(*stmt, p);
+		/* A read transaction left open while the client takes its
+		 * time would hold off every writer, unless there's a WAL */
+		ret = didl_step(*stmt, args, GETFLAG(WAL_MASK) ? DIDL_CHUNK_SIZE : INT_MAX);
+		if( ret == SQLITE_ROW )
+			return SQLITE_OK;
+	}
+	if( ret != SQLITE_DONE )
+		*errmsg = sqlite3_mprintf("%s", ret == SQLITE_ABORT ?
+		                          "query aborted" : sqlite3_errmsg(db));
+	sql_release(*stmt);
+	*stmt = NULL;
+
+	return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+static int
+didl_fill(struct stream *s)
+{
+	struct didl_stream *d = s->data;
+	struct string_s *str = &d->str;
+	char *chunk;
+	int len, off = 0;
+	int ret;
+
+	if( d->done )
+		return 0;
+	/* The first piece is what the handler had already built */
+	if( d->started )
+	{
+		str->off = 0;
+		ret = didl_step(d->stmt, &d->args, DIDL_CHUNK_SIZE);
+		if( ret != SQLITE_ROW )
+		{
+			if( ret != SQLITE_DONE )
+				DPRINTF(E_WARN, L_HTTP, "SQL error while streaming %s response: %s\n",
+				        d->action, ret == SQLITE_ABORT ? "query aborted" : sqlite3_errmsg(db));
+			sql_release(d->stmt);
+			d->stmt = NULL;
+		}
+	}
+	if( !d->stmt )
+	{
+		strcatf(str, "&lt;/DIDL-Lite&gt;</Result>\n"
+		             "<NumberReturned>%u</NumberReturned>\n"
+		             "<TotalMatches>%u</TotalMatches>\n"
+		             "<UpdateID>%u</UpdateID>"
+		             "</u:%sResponse>%s",
+		             d->args.returned, d->totalMatches, updateID,
+		             d->action, afterbody);
+		DPRINTF(E_DEBUG, L_HTTP, "%s response streamed, %d items\n",
+		        d->action, d->args.returned);
+		d->done = 1;
+	}
+
+	len = str->off;
+	if( !d->started )
+		len += sizeof(beforebody) - 1;
+	chunk = malloc(len + 32);
+	if( !chunk )
+		return -1;
+	if( d->chunked )
+		off = sprintf(chunk, "%x\r\n", len);
+	if( !d->started )
+	{
+		memcpy(chunk + off, beforebody, sizeof(beforebody) - 1);
+		off += sizeof(beforebody) - 1;
+		d->started = 1;
+	}
+	memcpy(chunk + off, str->data, str->off);
+	off += str->off;
+	if( d->chunked )
+		off += sprintf(chunk + off, d->done ? "\r\n0\r\n\r\n" : "\r\n");
+
+	free(s->body);
+	s->body = chunk;
+	s->body_len = off;
+	s->body_off = 0;
+
+	return 1;
+}
+
+static void
+didl_release(void *data)
+{
+	struct didl_stream *d = data;
+
+	if( !d )
+		return;
+	sql_release(d->stmt);
+	free(d->str.data);
+	free(d);
+}
+
+/* Send the response started in args->str, with the rest of the rows
+ * still to come from stmt.  Takes over both. */
+static void
+SendDIDL(struct upnphttp *h, sqlite3_stmt *stmt, struct Response *args,
+         int totalMatches, const char *action)
+{
+	struct didl_stream *d;
+
+	d = calloc(1, sizeof(struct didl_stream));
+	if( !d )
+	{
+		sql_release(stmt);
+		Send500(h);
+		return;
+	}
+	d->stmt = stmt;
+	d->args = *args;
+	d->str = *args->str;
+	d->args.str = &d->str;
+	d->args.cursor = NULL;
+	d->action = action;
+	d->totalMatches = totalMatches;
+	memset(args->str, 0, sizeof(struct string_s));
+
+	DPRINTF(E_DEBUG, L_HTTP, "%s response is large, streaming it\n", action);
+	if( strcmp(h->HttpVer, "HTTP/1.1") == 0 )
+	{
+		h->respflags |= FLAG_CHUNKED;
+		d->chunked = 1;
+	}
+	else
+		h->reqflags &= ~FLAG_KEEPALIVE;
+	BuildHeader_upnphttp(h, 200, "OK", -1);
+	SendFill_upnphttp(h, didl_fill, didl_release, d);
+	CloseSocket_upnphttp(h);
+}
+
+/* Keyset paging.  A Browse page is "limit StartingIndex, RequestedCount",
+ * so for a deep page SQLite has to produce and sort every row before
+ * StartingIndex only to throw them away, and scrolling to the end of
+ * a big container costs O(n^2).  Instead the sort keys of the last row
+ * of each page are remembered (with o.ID appended, so the order is
+ * total), and a request for the page right after it continues with
+ * "where keys > last keys" from the start of the result.  That saves
+ * the skipping; an order no index gives (d.TITLE) still has every
+ * child sorted for each page.  See --query-bench. */
+struct keyset {
+	int nkeys;
+	const char *expr[BROWSE_CURSOR_KEYS];
+	int desc[BROWSE_CURSOR_KEYS];
+	char terms[512];		/* expr points in here */
+	char order[768];
+	char select[768];
+	char where[4096];		/* " and (...)" when resuming */
+	char cursorkey[1024];
+	const struct browse_cursor *from;
+	struct browse_cursor cursor;	/* filled in by didl_step() */
+};
+
+/* Split the order by clause into its keys.  Returns -1 if it isn't one
+ * we can page through this way. */
+static int
+keyset_init(struct keyset *ks, const char *orderBy)
+{
+	struct string_s order = { ks->order, 0, sizeof(ks->order) };
+	struct string_s select = { ks->select, 0, sizeof(ks->select) };
+	char *term, *saveptr, *p;
+	int i, open;
+
+	memset(ks, 0, sizeof(*ks));
+	if( orderBy )
+	{
+		if( strncasecmp(orderBy, "order by ", 9) != 0 )
+			return -1;
+		strncpyt(ks->terms, orderBy + 9, sizeof(ks->terms));
+		if( strlen(orderBy + 9) >= sizeof(ks->terms) )
+			return -1;
+	}
+	for( term = strtok_r(ks->terms, ",", &saveptr); term;
+	     term = strtok_r(NULL, ",", &saveptr) )
+	{
+		if( ks->nkeys >= BROWSE_CURSOR_KEYS - 1 )
+			return -1;
+		for( open = 0, p = term; *p; p++ )
+			open += (*p == '(') - (*p == ')');
+		if( open )
+			return -1;
+		while( isspace(*term) )
+			term++;
+		p = term + strlen(term);
+		while( p > term && isspace(p[-1]) )
+			*--p = '\0';
+		if( p - term > 5 && strcasecmp(p - 5, " DESC") == 0 )
+		{
+			ks->desc[ks->nkeys] = 1;
+			p[-5] = '\0';
+		}
+		else if( p - term > 4 && strcasecmp(p - 4, " ASC") == 0 )
+			p[-4] = '\0';
+		if( !*term )
+			return -1;
+		ks->expr[ks->nkeys++] = term;
+	}
+	ks->expr[ks->nkeys++] = "o.ID";
+
+	strcatf(&order, "order by ");
+	for( i = 0; i < ks->nkeys; i++ )
+	{
+		strcatf(&order, "%s%s%s", i ? ", " : "", ks->expr[i], ks->desc[i] ? " DESC" : "");
+		strcatf(&select, ", %s", ks->expr[i]);
+	}
+	strcatf(&select, " ");
+	if( order.off >= order.size || select.off >= select.size )
+		return -1;
+	ks->cursor.nkeys = ks->nkeys;
+
+	return 0;
+}
+
+/* Build the predicate for the rows after from: for keys a, b, c that
+ * is a > :k0 or (a is :k0 and b > :k1) or (... and c > :k2), allowing
+ * for descending keys and for NULLs, which SQLite sorts first. */
+static int
+keyset_where(struct keyset *ks, const struct browse_cursor *from)
+{
+	struct string_s str = { ks->where, 0, sizeof(ks->where) };
+	const char *expr;
+	int i, j, n = 0;
+
+	strcatf(&str, " and (");
+	for( j = 0; j < ks->nkeys; j++ )
+	{
+		expr = ks->expr[j];
+		/* Nothing comes after NULL in descending order */
+		if( ks->desc[j] && from->key[j].type == SQLITE_NULL )
+			continue;
+		strcatf(&str, "%s(", n++ ? " or " : "");
+		for( i = 0; i < j; i++ )
+			strcatf(&str, "%s is :k%d and ", ks->expr[i], i);
+		if( from->key[j].type == SQLITE_NULL )
+			strcatf(&str, "%s is not NULL", expr);
+		else if( ks->desc[j] )
+			strcatf(&str, "(%s < :k%d or %s is NULL)", expr, j, expr);
+		else
+			strcatf(&str, "%s > :k%d", expr, j);
+		strcatf(&str, ")");
+	}
+	strcatf(&str, ")");
+	if( str.off >= str.size )
+	{
+		ks->where[0] = '\0';
+		return -1;
+	}
+	ks->from = from;
+
+	return 0;
+}
+
 static void
 BrowseContentDirectory(struct upnphttp * h, const char * action)
 {
@@ -1334,6 +1764,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	struct magic_container_s *magic;
 	char *zErrMsg = NULL;
 	char *sql, *ptr;
+	sqlite3_stmt *stmt = NULL;
 	struct Response args;
 	struct string_s str;
 	int totalMatches = 0;
@@ -1344,13 +1775,18 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	const char *parentid_sql = "o.PARENT_ID";
 	const char *refid_sql = "o.REF_ID";
 	char where[256] = "";
+	char cachekey[512] = "";
 	char *orderBy = NULL;
+	struct keyset ks;
+	struct didl_params params;
+	int keyset = 0;
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
+	memset(&params, 0, sizeof(params));
 
 	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
@@ -1386,12 +1822,33 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 		goto browse_error;
 	}
 
+	args.iface = h->iface;
+	args.filter = set_filter_flags(Filter, h);
+	args.client = h->req_client ? h->req_client->type->type : 0;
+
+	/* The database is in flux while scanning, don't bother caching */
+	if( !GETFLAG(SCANNING_MASK) )
+	{
+		const char *cached;
+		int len;
+
+		ret = snprintf(cachekey, sizeof(cachekey), "%s\t%s\t%d\t%d\t%x\t%s\t%d\t%d",
+		               ObjectID, BrowseFlag, StartingIndex, RequestedCount,
+		               args.filter, THISORNUL(SortCriteria), args.client, args.iface);
+		if( ret < 0 || ret >= sizeof(cachekey) )
+			cachekey[0] = '\0';
+		else if( (cached = browsecache_get(cachekey, &len)) )
+		{
+			DPRINTF(E_DEBUG, L_HTTP, "Browse %s answered from cache\n", ObjectID);
+			BuildSendAndCloseSoapResp(h, cached, len);
+			goto browse_error;
+		}
+	}
+
 	str.data = malloc(DEFAULT_RESP_SIZE);
 	str.size = DEFAULT_RESP_SIZE;
 	str.off = sprintf(str.data, "%s", resp0);
 	/* See if we need to include DLNA namespace reference */
-	args.iface = h->iface;
-	args.filter = set_filter_flags(Filter, h);
 	if( args.filter & FILTER_DLNA_NAMESPACE )
 		ret = strcatf(&str, DLNA_NAMESPACE);
 	if( args.filter & FILTER_PV_SUBTITLE )
@@ -1402,7 +1859,6 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 
 	args.returned = 0;
 	args.requested = RequestedCount;
-	args.client = h->req_client ? h->req_client->type->type : 0;
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.str = &str;
 	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
@@ -1430,10 +1886,11 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				refid_sql = magic->refid_sql;
 		}
 		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where OBJECT_ID = '%q';",
-				      objectid_sql, parentid_sql, refid_sql, id);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+				      FROM_OBJECTS
+				      " where OBJECT_ID = :id",
+				      objectid_sql, parentid_sql, refid_sql);
+		params.id = id;
+		ret = didl_exec(sql, &params, &args, &stmt, &zErrMsg);
 		totalMatches = args.returned;
 	}
 	else
@@ -1463,7 +1920,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			}
 		}
 		if (!where[0])
-			sqlite3_snprintf(sizeof(where), where, "PARENT_ID = '%q'", ObjectID);
+			strncpyt(where, "PARENT_ID = :id", sizeof(where));
 
 		if (!totalMatches)
 			totalMatches = get_child_count(ObjectID, magic);
@@ -1506,13 +1963,38 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			goto browse_error;
 		}
 
-		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where %s %s limit %d, %d;",
+		/* More than one page of a plain container: page by keyset */
+		if( RequestedCount > 0 && totalMatches > RequestedCount &&
+		    strcmp(where, "PARENT_ID = :id") == 0 &&
+		    keyset_init(&ks, orderBy) == 0 )
+		{
+			const struct browse_cursor *from;
+
+			keyset = 1;
+			args.cursor = &ks.cursor;
+			ret = snprintf(ks.cursorkey, sizeof(ks.cursorkey), "%s\t%s\t%08x",
+			               ObjectID, ks.order, h->clientaddr.s_addr);
+			if( ret < 0 || ret >= sizeof(ks.cursorkey) )
+				ks.cursorkey[0] = '\0';
+			else if( StartingIndex &&
+			         (from = browsecache_cursor_get(ks.cursorkey, StartingIndex)) &&
+			         from->nkeys == ks.nkeys )
+				keyset_where(&ks, from);
+		}
+
+		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS "%s"
+				      FROM_OBJECTS
+				      " where %s%s %s limit :start, :count",
 				      objectid_sql, parentid_sql, refid_sql,
-				      where, THISORNUL(orderBy), StartingIndex, RequestedCount);
-		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+				      keyset ? ks.select : "", where,
+				      keyset ? ks.where : "", keyset ? ks.order : THISORNUL(orderBy));
+		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s [%s, %d, %d]\n", sql,
+		        ObjectID, StartingIndex, RequestedCount);
+		params.id = ObjectID;
+		params.start = (keyset && ks.from) ? 0 : StartingIndex;
+		params.count = RequestedCount;
+		params.from = keyset ? ks.from : NULL;
+		ret = didl_exec(sql, &params, &args, &stmt, &zErrMsg);
 	}
 	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
 	{
@@ -1531,310 +2013,122 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			goto browse_error;
 		}
 	}
+	if( stmt )
+	{
+		SendDIDL(h, stmt, &args, totalMatches, "Browse");
+		stmt = NULL;
+		goto browse_error;
+	}
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
 	                    "<TotalMatches>%u</TotalMatches>\n"
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:BrowseResponse>",
 	                    args.returned, totalMatches, updateID);
+	if( cachekey[0] && ret > 0 )
+		browsecache_put(cachekey, str.data, str.off);
+	/* Remember where this page ended for the next one */
+	if( keyset && ks.cursorkey[0] && ks.cursor.rows == RequestedCount )
+	{
+		ks.cursor.next = StartingIndex + RequestedCount;
+		browsecache_cursor_put(ks.cursorkey, &ks.cursor);
+	}
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
 browse_error:
+	if( keyset )
+		browsecache_cursor_free(&ks.cursor);
+	sql_release(stmt);
 	ClearNameValueList(&data);
 	free(orderBy);
 	free(str.data);
 }
 
-static inline void
-charcat(struct string_s *str, char c)
+/* The objects below id, as a condition on OBJECT_ID.  "X$*" is the
+ * range from "X$" up to "X%", so it can be looked up in the index
+ * rather than matched against every row ('%' follows '$'); likewise
+ * "X*" with the last character of X bumped.  The bounds come back in
+ * lo and hi, to be bound as :lo and :hi. */
+static const char *
+subtree_range(const char *id, const char *sep, char **lo, char **hi)
 {
-	if (str->size <= str->off)
+	size_t len = strlen(id);
+
+	*lo = *hi = NULL;
+	if( *id == '*' || !len ||
+	    (strcmp(sep, "$*") != 0 && (unsigned char)id[len-1] == 0xFF) )
 	{
-		str->data[str->size-1] = '\0';
-		return;
+		if( xasprintf(lo, "%s%s", id, sep) < 0 )
+			return NULL;
+		return "OBJECT_ID glob :lo";
+	}
+	if( strcmp(sep, "$*") == 0 )
+	{
+		if( xasprintf(lo, "%s$", id) < 0 || xasprintf(hi, "%s%%", id) < 0 )
+			return NULL;
+	}
+	else
+	{
+		if( !(*lo = strdup(id)) || !(*hi = strdup(id)) )
+			return NULL;
+		(*hi)[len-1]++;
 	}
-	str->data[str->off] = c;
-	str->off += 1;
+
+	return "(OBJECT_ID >= :lo and OBJECT_ID < :hi)";
 }
 
-static inline char *
-parse_search_criteria(const char *str, char *sep)
+/* TotalMatches for a search, when it can't be had from the page query.
+ * Counted as that query returns rows: one per object, or when grouped
+ * one per DETAIL_ID, with the objects that have none making one group. */
+static int
+search_count(const struct search_criteria *sc, const char *subtree, int grouped,
+             const char *ContainerID, const char *lo, const char *hi)
 {
-	struct string_s criteria;
-	int len;
-	int literal = 0, like = 0, class = 0;
-	const char *s;
-
-	if (!str)
-		return strdup("1 = 1");
-
-	len = strlen(str) + 32;
-	criteria.data = malloc(len);
-	criteria.size = len;
-	criteria.off = 0;
-
-	s = str;
-
-	while (isspace(*s))
-		s++;
-
-	while (*s)
+	sqlite3_stmt *stmt;
+	char *sql;
+	int count = 0;
+
+	sql = sqlite3_mprintf("SELECT (select %s"
+	                      " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                      " where %s and (%s))"
+	                      " + "
+	                      "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                      " where (OBJECT_ID = :id) and (%s))",
+	                      grouped ? "count(distinct DETAIL_ID) + (count(DETAIL_ID) < count(*))"
+	                              : "count(*)",
+	                      subtree, sc->where, sc->where);
+	stmt = sql ? sql_prepare(db, sql) : NULL;
+	if( stmt )
 	{
-		if (literal)
-		{
-			switch (*s) {
-			case '&':
-				if (strncmp(s, "&quot;", 6) == 0)
-					s += 5;
-				else if (strncmp(s, "&apos;", 6) == 0)
-				{
-					strcatf(&criteria, "'");
-					s += 6;
-					continue;
-				}
-				else
-					break;
-			case '"':
-				literal = 0;
-				if (like)
-				{
-					charcat(&criteria, '%');
-					like--;
-				}
-				charcat(&criteria, '"');
-				break;
-			case '\\':
-				if (strncmp(s, "\\&quot;", 7) == 0)
-				{
-					strcatf(&criteria, "&amp;quot;");
-					s += 7;
-					continue;
-				}
-				break;
-			case 'o':
-				if (class)
-				{
-					class = 0;
-					if (strncmp(s, "object.", 7) == 0)
-						s += 7;
-					else if (strncmp(s, "object\"", 7) == 0 ||
-					         strncmp(s, "object&quot;", 12) == 0)
-					{
-						s += 6;
-						continue;
-					}
-				}
-			default:
-				charcat(&criteria, *s);
-				break;
-			}
-		}
-		else
-		{
-			switch (*s) {
-			case '\\':
-				if (strncmp(s, "\\&quot;", 7) == 0)
-				{
-					strcatf(&criteria, "&amp;quot;");
-					s += 7;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '"':
-				literal = 1;
-				charcat(&criteria, *s);
-				if (like == 2)
-				{
-					charcat(&criteria, '%');
-					like--;
-				}
-				break;
-			case '&':
-				if (strncmp(s, "&quot;", 6) == 0)
-				{
-					literal = 1;
-					strcatf(&criteria, "\"");
-					if (like == 2)
-					{
-						charcat(&criteria, '%');
-						like--;
-					}
-					s += 5;
-				}
-				else if (strncmp(s, "&apos;", 6) == 0)
-				{
-					strcatf(&criteria, "'");
-					s += 5;
-				}
-				else if (strncmp(s, "&lt;", 4) == 0)
-				{
-					strcatf(&criteria, "<");
-					s += 3;
-				}
-				else if (strncmp(s, "&gt;", 4) == 0)
-				{
-					strcatf(&criteria, ">");
-					s += 3;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '@':
-				if (strncmp(s, "@refID", 6) == 0)
-				{
-					strcatf(&criteria, "REF_ID");
-					s += 6;
-					continue;
-				}
-				else if (strncmp(s, "@id", 3) == 0)
-				{
-					strcatf(&criteria, "OBJECT_ID");
-					s += 3;
-					continue;
-				}
-				else if (strncmp(s, "@parentID", 9) == 0)
-				{
-					strcatf(&criteria, "PARENT_ID");
-					s += 9;
-					strcpy(sep, "*");
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'c':
-				if (strncmp(s, "contains", 8) == 0)
-				{
-					strcatf(&criteria, "like");
-					s += 8;
-					like = 2;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'd':
-				if (strncmp(s, "derivedfrom", 11) == 0)
-				{
-					strcatf(&criteria, "like");
-					s += 11;
-					like = 1;
-					continue;
-				}
-				else if (strncmp(s, "dc:date", 7) == 0)
-				{
-					strcatf(&criteria, "d.DATE");
-					s += 7;
-					continue;
-				}
-				else if (strncmp(s, "dc:title", 8) == 0)
-				{
-					strcatf(&criteria, "d.TITLE");
-					s += 8;
-					continue;
-				}
-				else if (strncmp(s, "dc:creator", 10) == 0)
-				{
-					strcatf(&criteria, "d.CREATOR");
-					s += 10;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'e':
-				if (strncmp(s, "exists", 6) == 0)
-				{
-					s += 6;
-					while (isspace(*s))
-						s++;
-					if (strncmp(s, "true", 4) == 0)
-					{
-						strcatf(&criteria, "is not NULL");
-						s += 3;
-					}
-					else if (strncmp(s, "false", 5) == 0)
-					{
-						strcatf(&criteria, "is NULL");
-						s += 4;
-					}
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'o':
-				if (class)
-				{
-					if (strncmp(s, "object.", 7) == 0)
-					{
-						s += 7;
-						charcat(&criteria, '"');
-						while (*s && !isspace(*s))
-						{
-							charcat(&criteria, *s);
-							s++;
-						}
-						charcat(&criteria, '"');
-					}
-					class = 0;
-					continue;
-				}
-			case 'u':
-				if (strncmp(s, "upnp:class", 10) == 0)
-				{
-					strcatf(&criteria, "o.CLASS");
-					s += 10;
-					class = 1;
-					continue;
-				}
-				else if (strncmp(s, "upnp:actor", 10) == 0)
-				{
-					strcatf(&criteria, "d.ARTIST");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:artist", 11) == 0)
-				{
-					strcatf(&criteria, "d.ARTIST");
-					s += 11;
-					continue;
-				}
-				else if (strncmp(s, "upnp:album", 10) == 0)
-				{
-					strcatf(&criteria, "d.ALBUM");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:genre", 10) == 0)
-				{
-					strcatf(&criteria, "d.GENRE");
-					s += 10;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '(':
-				if (s > str && !isspace(s[-1]))
-					charcat(&criteria, ' ');
-				charcat(&criteria, *s);
-				break;
-			case ')':
-				charcat(&criteria, *s);
-				if (!isspace(s[1]))
-					charcat(&criteria, ' ');
-				break;
-			default:
-				charcat(&criteria, *s);
-				break;
-			}
-		}
-		s++;
+		search_bind(sc, stmt);
+		bind_text(stmt, ":id", ContainerID);
+		bind_text(stmt, ":lo", lo);
+		bind_text(stmt, ":hi", hi);
+		if( sqlite3_step(stmt) == SQLITE_ROW )
+			count = MAX(sqlite3_column_int(stmt, 0), 0);
+		sql_release(stmt);
 	}
-	charcat(&criteria, '\0');
+	sqlite3_free(sql);
 
-	return criteria.data;
+	return count;
+}
+
+/* The page query for a search: the matches below the container, and
+ * the container itself unless it is the whole tree */
+static char *
+search_sql(const struct search_criteria *sc, const char *subtree, const char *groupBy,
+           const char *ContainerID, const char *orderBy, const char *count)
+{
+	return sqlite3_mprintf( SELECT_COLUMNS
+	                      FROM_OBJECTS
+	                      " where %s and (%s) %s "
+	                      "%z %s"
+	                      " limit :start, %s",
+	                      subtree, sc->where, groupBy,
+	                      (*ContainerID == '*') ? NULL :
+	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
+	                                      FROM_OBJECTS
+	                                      " where OBJECT_ID = :id and (%s) ", sc->where),
+	                      THISORNUL(orderBy), count);
 }
 
 static void
@@ -1849,20 +2143,26 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	struct magic_container_s *magic;
 	char *zErrMsg = NULL;
 	char *sql, *ptr;
+	sqlite3_stmt *stmt = NULL;
 	struct Response args;
 	struct string_s str;
 	int totalMatches;
 	int ret;
 	const char *ContainerID;
 	char *Filter, *SearchCriteria, *SortCriteria;
-	char *orderBy = NULL, *where = NULL, sep[] = "$*";
+	char *orderBy = NULL, *lo = NULL, *hi = NULL;
+	const char *subtree, *sep = "$*";
 	char groupBy[] = "group by DETAIL_ID";
+	struct search_criteria sc;
+	struct didl_params params;
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
+	memset(&sc, 0, sizeof(sc));
+	memset(&params, 0, sizeof(params));
 
 	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
@@ -1924,33 +2224,23 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	    GETFLAG(DLNA_STRICT_MASK) )
 		groupBy[0] = '\0';
 
-	where = parse_search_criteria(SearchCriteria, sep);
-	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
-
-	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
-	                                     " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID glob '%q%s') and (%s))"
-	                                     " + "
-	                                     "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID = '%q') and (%s))",
-	                                     ContainerID, sep, where, ContainerID, where);
-	if( totalMatches < 0 )
+	if( search_compile(SearchCriteria, &sc) != 0 )
 	{
-		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
 		SoapError(h, 708, "Unsupported or invalid search criteria");
 		goto search_error;
 	}
-	/* Does the object even exist? */
-	if( !totalMatches )
+	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", sc.where);
+	/* Parents are looked for among all of the objects below, not just items */
+	if( sc.parent )
+		sep = "*";
+	subtree = subtree_range(ContainerID, sep, &lo, &hi);
+	if( !subtree )
 	{
-		if( !object_exists(ContainerID) )
-		{
-			SoapError(h, 710, "No such container");
-			goto search_error;
-		}
+		SoapError(h, 501, "Action Failed");
+		goto search_error;
 	}
+
 	ret = 0;
-	__SORT_LIMIT
 	orderBy = parse_sort_criteria(SortCriteria, &ret);
 	/* If it's a DLNA client, return an error for bad sort criteria */
 	if( ret < 0 && ((args.flags & FLAG_DLNA) || GETFLAG(DLNA_STRICT_MASK)) )
@@ -1959,25 +2249,45 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 		goto search_error;
 	}
 
-	sql = sqlite3_mprintf( SELECT_COLUMNS
-	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                      " where OBJECT_ID glob '%q%s' and (%s) %s "
-	                      "%z %s"
-	                      " limit %d, %d",
-	                      ContainerID, sep, where, groupBy,
-	                      (*ContainerID == '*') ? NULL :
-	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
-	                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                                      " where OBJECT_ID = '%q' and (%s) ", ContainerID, where),
-	                      orderBy, StartingIndex, RequestedCount);
-	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
-	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
+	/* Reading on past the page to count the matches evaluates every
+	 * column of every one of them, which costs more than counting them
+	 * separately (see --query-bench), so that is only left out when
+	 * the page itself shows where the matches end. */
+	sql = search_sql(&sc, subtree, groupBy, ContainerID, orderBy, ":count");
+	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s [%d, %d]\n", sql, StartingIndex, RequestedCount);
+	params.id = ContainerID;
+	params.lo = lo;
+	params.hi = hi;
+	params.start = StartingIndex;
+	params.count = RequestedCount;
+	params.search = &sc;
+	ret = didl_exec(sql, &params, &args, &stmt, &zErrMsg);
+	if( ret != SQLITE_OK )
 	{
-		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
+		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", THISORNUL(zErrMsg), sql);
 		sqlite3_free(zErrMsg);
+		sqlite3_free(sql);
+		SoapError(h, 708, "Unsupported or invalid search criteria");
+		goto search_error;
 	}
 	sqlite3_free(sql);
+	if( !stmt && (RequestedCount < 0 || args.rows < RequestedCount) &&
+	    (args.rows || !StartingIndex) )
+		totalMatches = StartingIndex + args.rows;
+	else
+		totalMatches = search_count(&sc, subtree, groupBy[0] != '\0', ContainerID, lo, hi);
+	if( stmt )
+	{
+		SendDIDL(h, stmt, &args, totalMatches, "Search");
+		goto search_error;
+	}
+	/* Does the object even exist? */
+	if( !totalMatches && !object_exists(ContainerID) )
+	{
+		SoapError(h, 710, "No such container");
+		goto search_error;
+	}
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
 	                    "<TotalMatches>%u</TotalMatches>\n"
@@ -1988,7 +2298,9 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 search_error:
 	ClearNameValueList(&data);
 	free(orderBy);
-	free(where);
+	search_free(&sc);
+	free(lo);
+	free(hi);
 	free(str.data);
 }
 
@@ -2041,31 +2353,6 @@ QueryStateVariable(struct upnphttp * h, const char * action)
 	ClearNameValueList(&data);
 }
 
-static int _set_watch_count(long long id, const char *old, const char *new)
-{
-	int64_t rowid = sqlite3_last_insert_rowid(db);
-	int ret;
-
-	ret = sql_exec(db, "INSERT or IGNORE into BOOKMARKS (ID, WATCH_COUNT)"
-			   " VALUES (%lld, %Q)", id, new ?: "1");
-	if (sqlite3_last_insert_rowid(db) != rowid)
-		return 0;
-
-	if (!new) /* Increment */
-		ret = sql_exec(db, "UPDATE BOOKMARKS set WATCH_COUNT ="
-				   " ifnull(WATCH_COUNT,'0') + 1"
-				   " where ID = %lld", id);
-	else if (old && old[0])
-		ret = sql_exec(db, "UPDATE BOOKMARKS set WATCH_COUNT = %Q"
-				   " where WATCH_COUNT = %Q and ID = %lld",
-				   new, old, id);
-	else
-		ret = sql_exec(db, "UPDATE BOOKMARKS set WATCH_COUNT = %Q"
-				   " where ID = %lld",
-				   new, id);
-	return ret;
-}
-
 /* For some reason, Kodi does URI encoding and appends a trailing slash */
 static void _kodi_decode(char *str)
 {
@@ -2133,7 +2420,7 @@ static void UpdateObject(struct upnphttp * h, const char * action)
 	DPRINTF(E_DEBUG, L_HTTP, "UpdateObject %s: %s => %s\n", ObjectID, CurrentTagValue, NewTagValue);
 
 	in_magic_container(ObjectID, 0, &rid);
-	detailID = sql_get_int64_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%q'", rid);
+	detailID = sql_get_int64_param(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?", "t", rid);
 	if (detailID <= 0)
 	{
 		SoapError(h, 701, "No such object");
@@ -2154,7 +2441,7 @@ static void UpdateObject(struct upnphttp * h, const char * action)
 		/* Kodi uses incorrect tag "upnp:playCount" instead of "upnp:playbackCount" */
 		if (strcmp(tag, "upnp:playbackCount") == 0 || strcmp(tag, "upnp:playCount") == 0)
 		{
-			ret = _set_watch_count(detailID, current, new);
+			ret = dbwriter_watch_count(detailID, current, new);
 		}
 		else if (strcmp(tag, "upnp:lastPlaybackPosition") == 0)
 		{
@@ -2163,17 +2450,13 @@ static void UpdateObject(struct upnphttp * h, const char * action)
 				sec = 0;
 			else
 				sec -= 1;
-			ret = sql_exec(db, "INSERT OR IGNORE into BOOKMARKS (ID, SEC)"
-					   " VALUES (%lld, %d)", (long long)detailID, sec);
-			ret = sql_exec(db, "UPDATE BOOKMARKS set SEC = %d"
-					   " where SEC = %Q and ID = %lld",
-					   sec, current, (long long)detailID);
+			ret = dbwriter_bookmark(detailID, sec, current);
 		}
 		else
 			DPRINTF(E_WARN, L_HTTP, "Tag %s unsupported for writing\n", tag);
 	}
 
-	if (ret == SQLITE_OK)
+	if (ret == 0)
 		BuildSendAndCloseSoapResp(h, resp, sizeof(resp)-1);
 	else
 		SoapError(h, 501, "Action Failed");
@@ -2250,19 +2533,13 @@ SamsungSetBookmark(struct upnphttp * h, const char * action)
 		const char *rid = ObjectID;
 		int64_t detailID;
 		int sec = atoi(PosSecond);
-		int ret;
 
 		in_magic_container(ObjectID, 0, &rid);
-		detailID = sql_get_int64_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%q'", rid);
+		detailID = sql_get_int64_param(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?", "t", rid);
 
 		if ( sec < 30 )
 			sec = 0;
-		ret = sql_exec(db, "INSERT OR IGNORE into BOOKMARKS (ID, SEC)"
-				   " VALUES (%lld, %d)", (long long)detailID, sec);
-		ret = sql_exec(db, "UPDATE BOOKMARKS set SEC = %d"
-				   " where ID = %lld",
-				   sec, (long long)detailID);
-		if( ret != SQLITE_OK )
+		if( dbwriter_bookmark(detailID, sec, NULL) != 0 )
 			DPRINTF(E_WARN, L_METADATA, "Error setting bookmark %s on ObjectID='%s'\n", PosSecond, rid);
 		BuildSendAndCloseSoapResp(h, resp, sizeof(resp)-1);
 	}
@@ -2360,7 +2637,7 @@ SamsungGetSemanticList(struct upnphttp * h, const char * action)
 		args.str = &str;
 
 		sql = sqlite3_mprintf( SELECT_COLUMNS
-	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                      FROM_OBJECTS
 	                      " where PARENT_ID in"
 	                      " ( '" VIDEO_ALL_ID "',"
 	                      " '" MUSIC_ALL_ID "',"
@@ -2458,3 +2735,297 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 
 	SoapError(h, 401, "Invalid Action");
 }
+
+/*
+ * minidlnad --query-bench: the queries above, timed against a scratch
+ * database of synthetic tracks.  By the time anything is timed the
+ * whole database is in the page cache, so the numbers are a best case;
+ * what they show is how each query grows.
+ */
+#define BENCH_RUNS	5
+#define BENCH_PAGE	50
+#define BENCH_ALBUM	12	/* tracks per album */
+
+static const char *bench_words[] = {
+	"love", "night", "blue", "river", "fire", "dream", "heart", "road",
+	"rain", "light", "stone", "summer", "ghost", "gold", "wild", "home"
+};
+#define BENCH_WORDS (sizeof(bench_words) / sizeof(bench_words[0]))
+
+/* tracks in "All Music", with references to them from their albums
+ * under "Album", as the scanner would have them */
+static int
+bench_fill(int tracks)
+{
+	char id[64], album[64], ref[128], title[64], name[32], artist[32], path[32];
+	unsigned int seed = 1;
+	int64_t detailID;
+	int i, ret;
+
+	if( sql_begin(db) != SQLITE_OK )
+		return -1;
+	for( i = 0, ret = SQLITE_OK; i < tracks && ret == SQLITE_OK; i++ )
+	{
+		snprintf(title, sizeof(title), "%s %s %d",
+		         bench_words[rand_r(&seed) % BENCH_WORDS],
+		         bench_words[rand_r(&seed) % BENCH_WORDS], i);
+		snprintf(name, sizeof(name), "Album %d", i / BENCH_ALBUM);
+		snprintf(artist, sizeof(artist), "Artist %d", i / BENCH_ALBUM / 4);
+		snprintf(path, sizeof(path), "/bench/%d.mp3", i);
+		snprintf(id, sizeof(id), "%s$%X", MUSIC_ALL_ID, i);
+		snprintf(album, sizeof(album), "%s$%X", MUSIC_ALBUM_ID, i / BENCH_ALBUM);
+		snprintf(ref, sizeof(ref), "%s$%X", album, i);
+		if( i % BENCH_ALBUM == 0 )
+			ret = sql_exec_param(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, NAME)"
+			                         " VALUES (?, ?, 'container.album.musicAlbum', ?)",
+			                     "ttt", album, MUSIC_ALBUM_ID, name);
+		if( ret == SQLITE_OK )
+			ret = sql_exec_param(db, "INSERT into DETAILS (PATH, SIZE, TITLE, ARTIST, ALBUM, GENRE,"
+			                         " TRACK, DURATION, BITRATE, MIME)"
+			                         " VALUES (?, ?, ?, ?, ?, ?, ?, '0:03:30.000', 320000, 'audio/mpeg')",
+			                     "tIttttI", path, (int64_t)8400000, title, artist, name,
+			                     bench_words[i % BENCH_WORDS], (int64_t)(i % BENCH_ALBUM + 1));
+		detailID = sqlite3_last_insert_rowid(db);
+		if( ret == SQLITE_OK )
+			ret = sql_exec_param(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME)"
+			                         " VALUES (?, ?, 'item.audioItem.musicTrack', ?, ?)",
+			                     "ttIt", id, MUSIC_ALL_ID, detailID, title);
+		if( ret == SQLITE_OK )
+			ret = sql_exec_param(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME)"
+			                         " VALUES (?, ?, ?, 'item.audioItem.musicTrack', ?, ?)",
+			                     "tttIt", ref, album, id, detailID, title);
+	}
+	if( ret != SQLITE_OK || sql_exec(db, "COMMIT") != SQLITE_OK )
+	{
+		sql_exec(db, "ROLLBACK");
+		return -1;
+	}
+
+	return 0;
+}
+
+static double
+bench_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* Run sql BENCH_RUNS times the way the handlers do: the first page
+ * rows read in full, any after them only stepped over.  Returns the
+ * average in ms, or -1 if the query failed. */
+static double
+bench_query(const char *sql, const struct didl_params *p, int page)
+{
+	struct timespec start;
+	sqlite3_stmt *stmt;
+	int run, rows, i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for( run = 0; run < BENCH_RUNS; run++ )
+	{
+		if( !(stmt = sql_prepare(db, sql)) )
+			return -1;
+		didl_bind(stmt, p);
+		rows = 0;
+		while( (ret = sqlite3_step(stmt)) == SQLITE_ROW )
+		{
+			if( rows++ >= page )
+				continue;
+			for( i = 0; i < sqlite3_column_count(stmt); i++ )
+				sqlite3_column_text(stmt, i);
+		}
+		sql_release(stmt);
+		if( ret != SQLITE_DONE )
+			return -1;
+	}
+
+	return bench_ms(&start) / BENCH_RUNS;
+}
+
+/* A page of "All Music" at growing offsets, by "limit start, count"
+ * and by keyset from where the previous page would have ended */
+static void
+bench_browse(int tracks, const char *SortCriteria)
+{
+	static const int offsets[] = { 0, 10000, 100000 };
+	struct didl_params params;
+	struct keyset ks;
+	sqlite3_stmt *stmt;
+	char *sort, *orderBy, *sql;
+	double limit_ms, keyset_ms;
+	unsigned int i;
+	int ret;
+
+	sort = SortCriteria ? strdup(SortCriteria) : NULL;
+	orderBy = parse_sort_criteria(sort, &ret);
+	free(sort);
+	if( keyset_init(&ks, orderBy) != 0 )
+	{
+		printf("Browse: can't page \"%s\" by keyset\n", THISORNUL(orderBy));
+		free(orderBy);
+		return;
+	}
+	printf("Browse of %d children, %d per page, %s:\n", tracks, BENCH_PAGE,
+	       orderBy ? orderBy : "unsorted");
+	for( i = 0; i < sizeof(offsets) / sizeof(offsets[0]) && offsets[i] < tracks; i++ )
+	{
+		memset(&params, 0, sizeof(params));
+		params.id = MUSIC_ALL_ID;
+		params.start = offsets[i];
+		params.count = BENCH_PAGE;
+		sql = sqlite3_mprintf("SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
+		                      FROM_OBJECTS
+		                      " where PARENT_ID = :id %s limit :start, :count",
+		                      THISORNUL(orderBy));
+		limit_ms = bench_query(sql, &params, BENCH_PAGE);
+		sqlite3_free(sql);
+
+		/* The keys of the row before, as the previous page left them */
+		ks.where[0] = '\0';
+		if( offsets[i] > 0 )
+		{
+			sql = sqlite3_mprintf("SELECT o.ID%s" FROM_OBJECTS
+			                      " where PARENT_ID = :id %s limit :start, 1",
+			                      ks.select, ks.order);
+			params.start = offsets[i] - 1;
+			stmt = sql ? sql_prepare(db, sql) : NULL;
+			if( stmt )
+			{
+				didl_bind(stmt, &params);
+				if( sqlite3_step(stmt) == SQLITE_ROW )
+					keyset_save(stmt, &ks.cursor);
+				sql_release(stmt);
+			}
+			sqlite3_free(sql);
+			keyset_where(&ks, &ks.cursor);
+			params.from = &ks.cursor;
+		}
+		params.start = 0;
+		sql = sqlite3_mprintf("SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS "%s"
+		                      FROM_OBJECTS
+		                      " where PARENT_ID = :id%s %s limit :start, :count",
+		                      ks.select, ks.where, ks.order);
+		keyset_ms = bench_query(sql, &params, BENCH_PAGE);
+		sqlite3_free(sql);
+		browsecache_cursor_free(&ks.cursor);
+		ks.cursor.nkeys = ks.nkeys;
+
+		printf("  offset %6d: limit %9.2f ms, keyset %9.2f ms\n",
+		       offsets[i], limit_ms, keyset_ms);
+	}
+	free(orderBy);
+}
+
+/* A search of the whole tree, with TotalMatches counted in the same
+ * pass as the page, or by search_count() after a limited page query */
+static void
+bench_search(const char *criteria)
+{
+	char groupBy[] = "group by DETAIL_ID";
+	struct search_criteria sc;
+	struct didl_params params;
+	struct timespec start;
+	const char *subtree;
+	char *lo = NULL, *hi = NULL, *sql;
+	double single_ms, page_ms, count_ms;
+	int run, matches = 0;
+
+	memset(&sc, 0, sizeof(sc));
+	if( search_compile(criteria, &sc) != 0 ||
+	    !(subtree = subtree_range("*", "$*", &lo, &hi)) )
+	{
+		printf("Search %s: can't compile it\n", criteria);
+		goto bench_error;
+	}
+	memset(&params, 0, sizeof(params));
+	params.id = "*";
+	params.lo = lo;
+	params.hi = hi;
+	params.count = BENCH_PAGE;
+	params.search = &sc;
+
+	sql = search_sql(&sc, subtree, groupBy, "*", NULL, "-1");
+	single_ms = bench_query(sql, &params, BENCH_PAGE);
+	sqlite3_free(sql);
+	sql = search_sql(&sc, subtree, groupBy, "*", NULL, ":count");
+	page_ms = bench_query(sql, &params, BENCH_PAGE);
+	sqlite3_free(sql);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for( run = 0; run < BENCH_RUNS; run++ )
+		matches = search_count(&sc, subtree, 1, "*", lo, hi);
+	count_ms = bench_ms(&start) / BENCH_RUNS;
+
+	printf("Search %s%s, %d matches, %d per page:\n"
+	       "  one pass %9.2f ms, page %9.2f ms + count %9.2f ms\n",
+	       criteria, GETFLAG(FULLTEXT_MASK) ? " using DETAILS_FTS" : "",
+	       matches, BENCH_PAGE, single_ms, page_ms, count_ms);
+bench_error:
+	search_free(&sc);
+	free(lo);
+	free(hi);
+}
+
+/* A text search, first as a LIKE over every DETAILS row and then
+ * answered from DETAILS_FTS, if this SQLite could build it */
+static void
+bench_fulltext(const char *criteria, int fulltext)
+{
+	CLEARFLAG(FULLTEXT_MASK);
+	bench_search(criteria);
+	if( !fulltext )
+		return;
+	SETFLAG(FULLTEXT_MASK);
+	bench_search(criteria);
+	CLEARFLAG(FULLTEXT_MASK);
+}
+
+int
+query_bench(int tracks)
+{
+	char dir[] = "/tmp/minidlna-bench.XXXXXX";
+	char cmd[PATH_MAX];
+	struct timespec start;
+	int fulltext, ret = 1;
+
+	if( !mkdtemp(dir) )
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Failed to create a scratch directory: %s\n", strerror(errno));
+		return 1;
+	}
+	strncpyt(db_path, dir, sizeof(db_path));
+	open_db(NULL);
+	if( CreateDatabase() != 0 )
+		DPRINTF(E_ERROR, L_HTTP, "Failed to create the scratch database\n");
+	else
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if( bench_fill(tracks) != 0 )
+			DPRINTF(E_ERROR, L_HTTP, "Failed to fill the scratch database\n");
+		else
+		{
+			printf("%d tracks (%d objects) written in %.1f seconds\n", tracks,
+			       sql_get_int_field(db, "SELECT count(*) from OBJECTS"),
+			       bench_ms(&start) / 1000);
+			bench_browse(tracks, NULL);
+			bench_browse(tracks, "+dc:title");
+			if( !(fulltext = sql_fulltext(db)) )
+				printf("No DETAILS_FTS in this SQLite, text searches only use LIKE\n");
+			CLEARFLAG(FULLTEXT_MASK);
+			bench_search("upnp:class derivedfrom \"object.item.audioItem\"");
+			bench_fulltext("dc:title contains \"love\"", fulltext);
+			bench_fulltext("dc:title contains \"4321\"", fulltext);
+			ret = 0;
+		}
+	}
+	sql_close(db);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if( system(cmd) != 0 )
+		DPRINTF(E_WARN, L_HTTP, "Failed to remove %s\n", dir);
+
+	return ret;
+}
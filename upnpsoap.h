@@ -23,6 +23,12 @@
 
 #define DEFAULT_RESP_SIZE 131072
 #define MAX_RESPONSE_SIZE 2097152
+/* In WAL mode, Browse/Search results past this much DIDL are sent
+ * chunked as they are read, leaving room for one more item and the
+ * closing tags */
+#define DIDL_CHUNK_SIZE (DEFAULT_RESP_SIZE - 16384)
+/* Seconds a streamed result may wait for the client before we drop it */
+#define DIDL_STALL_TIMEOUT 30
 
 #define CONTENT_DIRECTORY_SCHEMAS \
 	" xmlns:dc=\"http://purl.org/dc/elements/1.1/\"" \
@@ -45,6 +51,9 @@ struct Response
 	uint32_t filter;
 	uint64_t flags;
 	enum client_types client;
+	char host[LOCATION_URL_MAX_LEN];	/* see response_host() */
+	struct browse_cursor *cursor;		/* keyset paging, see Browse */
+	int rows;				/* rows read from the query */
 };
 
 /* ExecuteSoapAction():
@@ -52,4 +61,12 @@ struct Response
 void
 ExecuteSoapAction(struct upnphttp *, const char *, int);
 
+#define QUERY_BENCH_TRACKS 300000
+
+/* query_bench()
+ * fill a scratch database with synthetic tracks, time the Browse
+ * and Search queries against it and print how long each took */
+int
+query_bench(int tracks);
+
 #endif